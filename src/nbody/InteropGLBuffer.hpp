@@ -1,6 +1,9 @@
 #pragma once
 
 #include <Magnum/GL/Buffer.h>
+#include <Magnum/GL/Context.h>
+#include <Magnum/GL/Extensions.h>
+#include <Magnum/GL/OpenGL.h>
 
 #if __has_include(<cuda.h>) && __has_include(<cuda_gl_interop.h>)
 #include <cuda.h>
@@ -11,6 +14,7 @@
 #endif
 
 #include <iostream>
+#include <vector>
 
 /// @brief Magnum GL Buffer wrapper implementing backend-specific interop to
 /// work directly on OpenGL device buffers instead of using host memory.
@@ -19,76 +23,157 @@
 /// make the addition of further backends easy.
 ///
 /// If no supported interop is available at runtime or compile time, the
-/// implementation falls back to regular GL Buffer with host memory storage.
+/// buffer is mapped persistently and coherently into host memory where
+/// ARB_buffer_storage (GL 4.4) is available, so writes to the storage reach
+/// GL without another copy. The buffer may be split into slots, e.g. a ring
+/// of frames, with a fence each: writers must call waitForDraws() on a slot
+/// before writing it and the renderer fenceDraws() after drawing from it.
+/// Without it,
+/// the implementation falls back to regular GL Buffer with host memory
+/// storage, uploaded by commitWrites().
 template <typename T>
 class InteropGLBuffer : public Magnum::GL::Buffer {
  public:
   /// Default constructor, creates invalid buffer
   InteropGLBuffer() : m_storage{nullptr} {}
 
-  /// Standard constructor with specified size
-  InteropGLBuffer(size_t numElements)
-      : m_type{testCudaGL() ? InteropType::CUDA : InteropType::None},
-        m_storage{m_type == InteropType::CUDA
-                      ? Corrade::Containers::Array<T>(nullptr, numElements)
-                      : Corrade::Containers::Array<T>(Corrade::ValueInit,
-                                                      numElements)} {
-    setData(m_storage, Magnum::GL::BufferUsage::DynamicDraw);
-    mapResources();
+  /// Standard constructor with specified size and number of fenced slots
+  InteropGLBuffer(size_t numElements, size_t numSlots = 1)
+      : m_type{testCudaGL()          ? InteropType::CUDA
+               : testPersistentMap() ? InteropType::PersistentMap
+                                     : InteropType::None},
+        m_storage{m_type == InteropType::None
+                      ? Corrade::Containers::Array<T>(Corrade::ValueInit,
+                                                      numElements)
+                      : Corrade::Containers::Array<T>(nullptr, numElements)} {
+    if (m_type == InteropType::PersistentMap) {
+      m_drawFences.resize(numSlots, nullptr);
+      mapPersistent(numElements);
+    } else {
+      setData(m_storage, Magnum::GL::BufferUsage::DynamicDraw);
+      mapResources();
+    }
   }
 
   /// Destructor, unmaps resources if necessary
-  virtual ~InteropGLBuffer() { unmapResources(); }
+  virtual ~InteropGLBuffer() {
+    unmapResources();
+    deleteFences();
+  }
 
   /// No copies allowed
   InteropGLBuffer(const InteropGLBuffer&) = delete;
   /// No copies allowed
   InteropGLBuffer& operator=(const InteropGLBuffer&) = delete;
 
-  /// Move constructor
+  /// Move constructor, takes over the GL buffer together with the
+  /// resources registered for it
   InteropGLBuffer(InteropGLBuffer&& other)
-      : m_type{other.m_type},
+      : Magnum::GL::Buffer{std::move(other)},
+        m_type{other.m_type},
         m_storage{std::move(other.m_storage)},
         m_devPtr{other.m_devPtr},
         m_devPtrSize{other.m_devPtrSize},
+        m_mappedPtr{other.m_mappedPtr},
+        m_drawFences{std::move(other.m_drawFences)},
         m_backendResource{other.m_backendResource} {
-    setData(m_storage, Magnum::GL::BufferUsage::DynamicDraw);
     other.m_devPtr = nullptr;
     other.m_devPtrSize = 0;
+    other.m_mappedPtr = nullptr;
+    other.m_drawFences.clear();
     other.m_backendResource = nullptr;
   };
 
   /// Move assignment
   InteropGLBuffer& operator=(InteropGLBuffer&& other) {
     unmapResources();
+    deleteFences();
 
+    Magnum::GL::Buffer::operator=(std::move(other));
     m_type = other.m_type;
     m_storage = std::move(other.m_storage);
-    setData(m_storage, Magnum::GL::BufferUsage::DynamicDraw);
 
     m_devPtr = other.m_devPtr;
     m_devPtrSize = other.m_devPtrSize;
+    m_mappedPtr = other.m_mappedPtr;
+    m_drawFences = std::move(other.m_drawFences);
     m_backendResource = other.m_backendResource;
 
     other.m_devPtr = nullptr;
     other.m_devPtrSize = 0;
+    other.m_mappedPtr = nullptr;
+    other.m_drawFences.clear();
     other.m_backendResource = nullptr;
 
     return *this;
   };
 
   /// Return a pointer to the underlying storage which is either a GL buffer
-  /// device pointer or, in case of no interop, a host memory pointer
+  /// device pointer, a persistently mapped host pointer or, in case of no
+  /// interop, a host memory pointer
   T* getStorage() {
-    return m_type == InteropType::CUDA ? m_devPtr : m_storage.data();
+    switch (m_type) {
+      case InteropType::CUDA:
+        return m_devPtr;
+      case InteropType::PersistentMap:
+        return m_mappedPtr;
+      default:
+        return m_storage.data();
+    }
+  }
+
+  /// Return true if the storage is GL memory mapped into the host, which
+  /// host code may write to directly, e.g. from another thread
+  bool isMapped() const { return m_type == InteropType::PersistentMap; }
+
+  /// Block until the GL commands issued before the last fenceDraws() of
+  /// `slot`, which may still read the mapped storage, have completed
+  void waitForDraws(size_t slot = 0) {
+    if (slot >= m_drawFences.size() || m_drawFences[slot] == nullptr) {
+      return;
+    }
+    GLenum status{GL_TIMEOUT_EXPIRED};
+    while (status == GL_TIMEOUT_EXPIRED) {
+      status = glClientWaitSync(m_drawFences[slot],
+                                GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+    }
+    if (status == GL_WAIT_FAILED) {
+      std::cout << "Waiting for the draw fence failed" << std::endl;
+    }
+    deleteFence(slot);
+  }
+
+  /// Make the writes to the storage visible to GL. Only the host memory
+  /// fallback needs to upload them, the other storage types are GL memory.
+  void commitWrites() {
+    if (m_type == InteropType::None) {
+      setData(m_storage, Magnum::GL::BufferUsage::DynamicDraw);
+    }
+  }
+
+  /// Mark the end of the GL commands reading `slot`, for waitForDraws()
+  void fenceDraws(size_t slot = 0) {
+    if (slot < m_drawFences.size()) {
+      deleteFence(slot);
+      m_drawFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+  }
+
+  /// Return true if buffers created now are mapped persistently, i.e. no
+  /// device interop is available but GL 4.4 or ARB_buffer_storage is
+  static bool mapsPersistently() {
+    return !testCudaGL() && testPersistentMap();
   }
 
  private:
-  enum class InteropType { None, CUDA };
+  enum class InteropType { None, CUDA, PersistentMap };
   InteropType m_type{InteropType::None};
   Corrade::Containers::Array<T> m_storage;
   T* m_devPtr{nullptr};
   size_t m_devPtrSize{0};
+  T* m_mappedPtr{nullptr};
+  // Fence of the last draws from every slot, only used if mapped
+  std::vector<GLsync> m_drawFences;
 
 #if CUDA_GL_INTEROP_API_AVAILABLE
   cudaGraphicsResource* m_backendResource{nullptr};
@@ -110,8 +195,44 @@ class InteropGLBuffer : public Magnum::GL::Buffer {
 #endif
   }
 
+  /// Allocate immutable storage and map it for writing for the lifetime of
+  /// the buffer
+  void mapPersistent(size_t numElements) {
+#ifndef MAGNUM_TARGET_GLES
+    const Corrade::Containers::Array<T> zeros{Corrade::ValueInit, numElements};
+    setStorage(zeros, Magnum::GL::Buffer::StorageFlag::MapWrite |
+                          Magnum::GL::Buffer::StorageFlag::MapPersistent |
+                          Magnum::GL::Buffer::StorageFlag::MapCoherent);
+    m_mappedPtr = reinterpret_cast<T*>(
+        map(0, numElements * sizeof(T),
+            Magnum::GL::Buffer::MapFlag::Write |
+                Magnum::GL::Buffer::MapFlag::Persistent |
+                Magnum::GL::Buffer::MapFlag::Coherent)
+            .data());
+#endif
+  }
+
+  /// Delete the fence of the last draws from `slot`, if any
+  void deleteFence(size_t slot) {
+    if (m_drawFences[slot] != nullptr) {
+      glDeleteSync(m_drawFences[slot]);
+      m_drawFences[slot] = nullptr;
+    }
+  }
+
+  /// Delete the fences of all slots
+  void deleteFences() {
+    for (size_t slot = 0; slot < m_drawFences.size(); slot++) {
+      deleteFence(slot);
+    }
+  }
+
   /// Unregister the GL-device interop buffer
   void unmapResources() {
+    if (m_type == InteropType::PersistentMap && m_mappedPtr != nullptr) {
+      unmap();
+      m_mappedPtr = nullptr;
+    }
 #if CUDA_GL_INTEROP_API_AVAILABLE
     if (m_type == InteropType::CUDA) {
       if (m_devPtr != nullptr) {
@@ -141,6 +262,17 @@ class InteropGLBuffer : public Magnum::GL::Buffer {
     return false;
   }
 
+  /// Return true if buffers can be mapped persistently
+  /// (i.e. GL 4.4 or ARB_buffer_storage)
+  static bool testPersistentMap() {
+#ifndef MAGNUM_TARGET_GLES
+    return Magnum::GL::Context::current()
+        .isExtensionSupported<Magnum::GL::Extensions::ARB::buffer_storage>();
+#else
+    return false;
+#endif
+  }
+
   /// Helper function to check errors from device API
   template <typename ErrorType>
   static void checkError(ErrorType code) {
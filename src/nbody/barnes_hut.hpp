@@ -0,0 +1,284 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Device-built octree for the Barnes-Hut approximation of NBody forces.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "device_algorithms.hpp"
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+
+// Dummy classes to generate unique kernel name types
+template <typename num_t>
+class octree_extent_kernel;
+template <typename num_t>
+class octree_key_kernel;
+template <typename num_t>
+class octree_leaf_kernel;
+template <typename num_t>
+class octree_level_kernel;
+
+/* A complete octree of fixed depth over the cube [-R, R]^3 enclosing all
+ * bodies. Cells of every level are stored in Morton order, one level after
+ * the other, so the children of cell m on level L are cells 8m..8m+7 on
+ * level L+1. Every cell stores its centre of mass and total mass, and the
+ * bodies are binned into the leaf cells with a counting sort. The whole tree
+ * is rebuilt on the device in a few O(N) passes without host round-trips. */
+template <typename num_t>
+class Octree {
+  using vec4 = sycl::vec<num_t, 4>;
+
+  // Deepest level, so there are 8^m_depth leaves
+  uint32_t m_depth;
+
+  size_t m_n_bodies;
+
+  // Half the side of the root cell
+  sycl::buffer<num_t, 1> m_extent{sycl::range<1>(1)};
+
+  // Leaf cell of every body
+  sycl::buffer<uint32_t, 1> m_keys;
+
+  // Bodies sorted by leaf and the start of each leaf's range in m_order
+  sycl::buffer<uint32_t, 1> m_order;
+  sycl::buffer<uint32_t, 1> m_leaf_start;
+
+  // (centre of mass, mass) of every cell on every level
+  sycl::buffer<vec4, 1> m_cells;
+
+  KeyBinner m_binner;
+
+  // The index of the first cell on the given level
+  static constexpr size_t level_offset(uint32_t level) {
+    return ((size_t(1) << (3 * level)) - 1) / 7;
+  }
+
+  // Picks the depth so that there are about 8 bodies per leaf on average
+  static uint32_t choose_depth(size_t n_bodies) {
+    uint32_t depth = 1;
+    while (depth < MAX_DEPTH && (size_t(8) << (3 * depth)) < n_bodies) {
+      depth++;
+    }
+    return depth;
+  }
+
+ public:
+  // Limits the tree to 8^7 leaves, about 40MB of cells in single precision
+  static constexpr uint32_t MAX_DEPTH = 7;
+
+  Octree(size_t n_bodies)
+      : m_depth(choose_depth(n_bodies)),
+        m_n_bodies(n_bodies),
+        m_keys(sycl::range<1>(n_bodies)),
+        m_order(sycl::range<1>(n_bodies)),
+        m_leaf_start(sycl::range<1>((size_t(1) << (3 * m_depth)) + 1)),
+        m_cells(sycl::range<1>(level_offset(m_depth + 1))) {}
+
+  uint32_t depth() const { return m_depth; }
+
+  // Rebuilds the tree for the given body positions
+  void build(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions) {
+    size_t n_bodies = m_n_bodies;
+    uint32_t depth = m_depth;
+    size_t n_leaves = size_t(1) << (3 * depth);
+
+    // Find the smallest cube centred on the origin enclosing all bodies
+    q.submit("octree extent", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      auto extent = sycl::reduction(
+          m_extent, cgh, sycl::maximum<num_t>(),
+          sycl::property::reduction::initialize_to_identity{});
+
+      cgh.parallel_for<octree_extent_kernel<num_t>>(
+          sycl::range<1>(n_bodies), extent,
+          [=](sycl::item<1> item, auto& max_coord) {
+            auto p = pos[item];
+            max_coord.combine(
+                sycl::fmax(sycl::fabs(p.x()),
+                           sycl::fmax(sycl::fabs(p.y()), sycl::fabs(p.z()))));
+          });
+    });
+
+    // Assign every body to its leaf
+    q.submit("octree keys", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor extent(m_extent, cgh, sycl::read_only);
+      sycl::accessor keys(m_keys, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<octree_key_kernel<num_t>>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            // Grow the cube slightly so the outermost body is inside it
+            num_t r = extent[0] * num_t(1.001) + num_t(1e-6);
+            num_t cells_per_side = num_t(uint32_t(1) << depth);
+            auto max_cell = (uint32_t(1) << depth) - 1;
+            const auto coord = [&](num_t v) {
+              auto c = uint32_t((v + r) / (2 * r) * cells_per_side);
+              return sycl::min(c, max_cell);
+            };
+
+            auto p = pos[item];
+            keys[item] =
+                morton_encode(coord(p.x()), coord(p.y()), coord(p.z()));
+          });
+    });
+
+    m_binner.bin(q, m_keys, n_bodies, n_leaves, m_leaf_start, m_order);
+
+    // Centres of mass of the leaves, from the bodies binned into them
+    q.submit("octree leaves", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor order(m_order, cgh, sycl::read_only);
+      sycl::accessor start(m_leaf_start, cgh, sycl::read_only);
+      sycl::accessor cells(m_cells, cgh, sycl::write_only);
+      size_t offset = level_offset(depth);
+
+      cgh.parallel_for<octree_leaf_kernel<num_t>>(
+          sycl::range<1>(n_leaves), [=](sycl::item<1> item) {
+            auto leaf = item.get_linear_id();
+            vec3<num_t> sum(0);
+            for (uint32_t k = start[leaf]; k < start[leaf + 1]; k++) {
+              sum += pos[order[k]];
+            }
+
+            num_t mass = num_t(start[leaf + 1] - start[leaf]);
+            auto com = mass > 0 ? sum / mass : sum;
+            cells[offset + leaf] = {com.x(), com.y(), com.z(), mass};
+          });
+    });
+
+    // Combine the children of every cell, bottom-up
+    for (uint32_t level = depth; level-- > 0;) {
+      q.submit("octree levels", [&](sycl::handler& cgh) {
+        sycl::accessor cells(m_cells, cgh, sycl::read_write);
+        size_t offset = level_offset(level);
+        size_t child_offset = level_offset(level + 1);
+
+        cgh.parallel_for<octree_level_kernel<num_t>>(
+            sycl::range<1>(size_t(1) << (3 * level)),
+            [=](sycl::item<1> item) {
+              auto cell = item.get_linear_id();
+              vec3<num_t> sum(0);
+              num_t mass = 0;
+              for (size_t c = 0; c < 8; c++) {
+                vec4 child = cells[child_offset + 8 * cell + c];
+                sum += child.w() *
+                       vec3<num_t>{child.x(), child.y(), child.z()};
+                mass += child.w();
+              }
+
+              auto com = mass > 0 ? sum / mass : sum;
+              cells[offset + cell] = {com.x(), com.y(), com.z(), mass};
+            });
+      });
+    }
+  }
+
+  // Device-side view of the tree used to evaluate forces inside a kernel
+  class View {
+    sycl::accessor<vec4, 1, sycl::access_mode::read> m_cells;
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_order;
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_leaf_start;
+    sycl::accessor<num_t, 1, sycl::access_mode::read> m_extent;
+    uint32_t m_depth;
+    num_t m_theta;
+
+   public:
+    View(Octree& tree, sycl::handler& cgh, num_t theta)
+        : m_cells(tree.m_cells, cgh, sycl::read_only),
+          m_order(tree.m_order, cgh, sycl::read_only),
+          m_leaf_start(tree.m_leaf_start, cgh, sycl::read_only),
+          m_extent(tree.m_extent, cgh, sycl::read_only),
+          m_depth(tree.m_depth),
+          m_theta(theta) {}
+
+    /* Acceleration on body `id` at position `x`. Cells which appear smaller
+     * than the opening angle theta are replaced by their total mass at the
+     * centre of mass, bodies in opened leaves are summed directly. The cells
+     * containing `x` are always opened, since `x` may be up to sqrt(3) times
+     * the cell size from their centre of mass, and for larger theta a body
+     * would otherwise be attracted by a monopole including itself. */
+    template <typename Force, typename PosAcc>
+    vec3<num_t> accel(const Force& force, const PosAcc& pos, vec3<num_t> x,
+                      size_t id) const {
+      // Cells are pushed as (level, Morton index) in 5 and 27 bits
+      constexpr uint32_t LEVEL_SHIFT = 27;
+      constexpr uint32_t CELL_MASK = (uint32_t(1) << LEVEL_SHIFT) - 1;
+      uint32_t stack[8 * MAX_DEPTH + 1];
+      uint32_t top = 0;
+      stack[top++] = 0;
+
+      num_t r = m_extent[0] * num_t(1.001) + num_t(1e-6);
+      num_t root_size = 2 * r;
+      num_t theta2 = m_theta * m_theta;
+
+      // Leaf containing `x`, binned like the bodies in build(). The cell
+      // containing `x` on a level is its prefix of 3 bits per level. `x` can
+      // be outside the root cell for the intermediate RK4 stages.
+      num_t cells_per_side = num_t(uint32_t(1) << m_depth);
+      auto max_cell = (uint32_t(1) << m_depth) - 1;
+      const auto coord = [&](num_t v) {
+        num_t offset = sycl::fmax(v + r, num_t(0));
+        auto c = uint32_t(offset / root_size * cells_per_side);
+        return sycl::min(c, max_cell);
+      };
+      uint32_t own_leaf =
+          morton_encode(coord(x.x()), coord(x.y()), coord(x.z()));
+      vec3<num_t> acc(0);
+
+      while (top > 0) {
+        auto entry = stack[--top];
+        uint32_t level = entry >> LEVEL_SHIFT;
+        uint32_t cell = entry & CELL_MASK;
+
+        vec4 node = m_cells[level_offset(level) + cell];
+        if (node.w() == 0) {
+          continue;
+        }
+
+        vec3<num_t> diff{node.x() - x.x(), node.y() - x.y(),
+                         node.z() - x.z()};
+        num_t r2 = diff.x() * diff.x() + diff.y() * diff.y() +
+                   diff.z() * diff.z();
+        num_t size = root_size / num_t(uint32_t(1) << level);
+
+        bool own_cell = cell == own_leaf >> (3 * (m_depth - level));
+
+        if (!own_cell && size * size < theta2 * r2) {
+          acc += node.w() * force.pair(diff, num_t(1), false);
+        } else if (level == m_depth) {
+          for (uint32_t k = m_leaf_start[cell]; k < m_leaf_start[cell + 1];
+               k++) {
+            auto j = m_order[k];
+            acc += force.pair(pos[j] - x, num_t(1), j == id);
+          }
+        } else {
+          for (uint32_t c = 0; c < 8; c++) {
+            stack[top++] = ((level + 1) << LEVEL_SHIFT) | (8 * cell + c);
+          }
+        }
+      }
+
+      return force.total(acc, num_t(1));
+    }
+  };
+};
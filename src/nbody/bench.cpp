@@ -0,0 +1,521 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Headless NBody benchmark reporting step timings as JSON.
+ *
+ **************************************************************************/
+
+#include "sim.hpp"
+#include "sim_multi.hpp"
+#include "sim_usm.hpp"
+#include "trajectory.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace {
+
+constexpr double PI = 3.141592653589793;
+
+// Command line names of the force_t and integrator_t values
+const std::array<const char*, 3> FORCE_NAMES = {
+    {"gravity", "lennard-jones", "coulomb"}};
+const std::array<const char*, 5> INTEGRATOR_NAMES = {
+    {"euler", "rk4", "leapfrog", "velocity-verlet", "block-leapfrog"}};
+
+// Benchmark settings, filled from the command line
+struct options {
+  std::string backend = "buffer";
+  std::string force = "gravity";
+  std::string integrator = "euler";
+  std::string kernel = "naive";
+  std::string layout = "vec3";
+  std::string solver = "direct";
+  std::string distrib = "cylinder";
+  std::string precision = "float";
+  bool specialise = false;
+  // Whether to print the device time of every kernel, buffer backend only
+  bool profile = false;
+  // Steps between Morton reorders of the bodies, 0 never reorders
+  size_t reorder_every = 0;
+  // Whether --force and --integrator were given, a restart keeps the ones
+  // from the checkpoint otherwise
+  bool force_set = false;
+  bool integrator_set = false;
+  // Checkpoint files to start from and to write after the timed steps
+  std::string restart;
+  std::string checkpoint;
+  // Trajectory file written while stepping once more after the timing
+  std::string trajectory;
+  size_t dump_every = 10;
+  bool quantise = false;
+  uint32_t max_rung = 4;
+  size_t n_bodies = 16384;
+  size_t n_steps = 20;
+  size_t n_warmup = 2;
+};
+
+void print_usage(const char* name) {
+  std::fprintf(
+      stderr,
+      "Usage: %s [options]\n"
+      "  --backend buffer|usm|multi|numa         (default buffer)\n"
+      "  --force gravity|lennard-jones|coulomb   (default gravity)\n"
+      "  --integrator euler|rk4|leapfrog|velocity-verlet|block-leapfrog\n"
+      "                                          (default euler)\n"
+      "  --max-rung N block time step levels     (default 4)\n"
+      "  --kernel naive|tiled|symmetric          (default naive)\n"
+      "  --layout vec3|packed|soa                (default vec3)\n"
+      "  --solver direct|barnes-hut|cell-list|neighbour-list|pme\n"
+      "                                          (default direct, pme\n"
+      "                                           is periodic Coulomb)\n"
+      "  --distrib cylinder|sphere|charged       (default cylinder,\n"
+      "                                           charged for coulomb)\n"
+      "  --precision float|mixed|double          (default float, mixed\n"
+      "                                           sums forces in double)\n"
+      "  --specialise yes|no                     (default no, pass force\n"
+      "                                           parameters as\n"
+      "                                           specialisation constants)\n"
+      "  --profile yes|no  print kernel execution times to stderr\n"
+      "                  (default no, buffer backend only)\n"
+      "  --reorder N  sort the bodies along a Morton curve every N steps\n"
+      "                  (default 0 = never, buffer backend only)\n"
+      "  --restart FILE  start from a checkpoint instead of --distrib,\n"
+      "                  keeping its force and integrator unless given\n"
+      "  --checkpoint FILE  write a checkpoint after the timed steps\n"
+      "                  (both buffer backend only)\n"
+      "  --trajectory FILE  write positions while stepping --steps more\n"
+      "  --dump-every N   steps between trajectory frames (default 10)\n"
+      "  --quantise yes|no  16-bit trajectory positions   (default no)\n"
+      "  --bodies N                              (default 16384)\n"
+      "  --steps N    timed steps                (default 20)\n"
+      "  --warmup N   untimed steps before them  (default 2)\n",
+      name);
+}
+
+// Returns false if the command line couldn't be parsed
+bool parse_options(int argc, char** argv, options& opts) {
+  bool distrib_set = false;
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const char* key = argv[i];
+    const char* value = argv[++i];
+
+    if (!std::strcmp(key, "--backend")) {
+      opts.backend = value;
+    } else if (!std::strcmp(key, "--force")) {
+      opts.force = value;
+      opts.force_set = true;
+    } else if (!std::strcmp(key, "--integrator")) {
+      opts.integrator = value;
+      opts.integrator_set = true;
+    } else if (!std::strcmp(key, "--max-rung")) {
+      opts.max_rung = uint32_t(std::strtoul(value, nullptr, 10));
+    } else if (!std::strcmp(key, "--kernel")) {
+      opts.kernel = value;
+    } else if (!std::strcmp(key, "--layout")) {
+      opts.layout = value;
+    } else if (!std::strcmp(key, "--solver")) {
+      opts.solver = value;
+    } else if (!std::strcmp(key, "--distrib")) {
+      opts.distrib = value;
+      distrib_set = true;
+    } else if (!std::strcmp(key, "--precision")) {
+      opts.precision = value;
+    } else if (!std::strcmp(key, "--specialise")) {
+      opts.specialise = !std::strcmp(value, "yes");
+    } else if (!std::strcmp(key, "--profile")) {
+      opts.profile = !std::strcmp(value, "yes");
+    } else if (!std::strcmp(key, "--reorder")) {
+      opts.reorder_every = std::strtoul(value, nullptr, 10);
+    } else if (!std::strcmp(key, "--restart")) {
+      opts.restart = value;
+    } else if (!std::strcmp(key, "--checkpoint")) {
+      opts.checkpoint = value;
+    } else if (!std::strcmp(key, "--trajectory")) {
+      opts.trajectory = value;
+    } else if (!std::strcmp(key, "--dump-every")) {
+      opts.dump_every = std::strtoul(value, nullptr, 10);
+    } else if (!std::strcmp(key, "--quantise")) {
+      opts.quantise = !std::strcmp(value, "yes");
+    } else if (!std::strcmp(key, "--bodies")) {
+      opts.n_bodies = std::strtoul(value, nullptr, 10);
+    } else if (!std::strcmp(key, "--steps")) {
+      opts.n_steps = std::strtoul(value, nullptr, 10);
+    } else if (!std::strcmp(key, "--warmup")) {
+      opts.n_warmup = std::strtoul(value, nullptr, 10);
+    } else {
+      return false;
+    }
+  }
+
+  // Coulomb needs charges, which only the charged distribution provides
+  if (opts.force == "coulomb" && !distrib_set) {
+    opts.distrib = "charged";
+  }
+  return opts.n_bodies > 0 && opts.n_steps > 0 && opts.dump_every > 0;
+}
+
+// Uniform ball of radius 25 with alternating unit charges
+template <typename num_t>
+std::vector<particle_data<num_t>> charged_particles(size_t n_bodies) {
+  std::mt19937 rng(std::random_device{}());
+  std::uniform_real_distribution<num_t> unif(-25, 25);
+  std::vector<particle_data<num_t>> particles(n_bodies);
+  for (size_t i = 0; i < n_bodies; i++) {
+    sycl::vec<num_t, 3> pos;
+    do {
+      pos = {unif(rng), unif(rng), unif(rng)};
+    } while (pos.x() * pos.x() + pos.y() * pos.y() + pos.z() * pos.z() >
+             num_t(25 * 25));
+    particles[i] = {num_t(i % 2 ? 1 : -1), pos};
+  }
+  return particles;
+}
+
+// Sets up the simulation described by `opts`, throws on invalid settings.
+// `args` are passed on to the backend constructor after the bodies.
+template <template <typename> class Sim, typename num_t, typename... Args>
+Sim<num_t> make_sim(const options& opts, Args... args) {
+  if (!opts.restart.empty()) {
+    if constexpr (std::is_same_v<Sim<num_t>, GravSim<num_t>>) {
+      return GravSim<num_t>(MappedCheckpoint(opts.restart));
+    } else {
+      throw std::runtime_error("Only the buffer backend can restart!");
+    }
+  }
+
+  // Same defaults as the distribution settings of the NBody demo
+  if (opts.distrib == "cylinder") {
+    distrib_cylinder<num_t> params{{0, 25},
+                                   {0, num_t(2 * PI)},
+                                   {-50, 50},
+                                   sycl::pow(num_t(10), num_t(.4))};
+    return Sim<num_t>(opts.n_bodies, params, args...);
+  } else if (opts.distrib == "sphere") {
+    return Sim<num_t>(opts.n_bodies, distrib_sphere<num_t>{{0, 25}},
+                      args...);
+  } else if (opts.distrib == "charged") {
+    return Sim<num_t>(opts.n_bodies, charged_particles<num_t>(opts.n_bodies),
+                      args...);
+  }
+  throw std::runtime_error("Unknown distribution " + opts.distrib + "!");
+}
+
+template <template <typename> class Sim, typename num_t>
+void configure_sim(Sim<num_t>& sim, const options& opts) {
+  bool restarted = !opts.restart.empty();
+  if (restarted && !opts.force_set) {
+    // Keep the force of the checkpoint
+  } else if (opts.force == "gravity") {
+    sim.set_force_type(force_t::GRAVITY);
+  } else if (opts.force == "lennard-jones") {
+    sim.set_force_type(force_t::LENNARD_JONES);
+  } else if (opts.force == "coulomb") {
+    sim.set_force_type(force_t::COULOMB);
+  } else {
+    throw std::runtime_error("Unknown force " + opts.force + "!");
+  }
+
+  if (restarted && !opts.integrator_set) {
+    // Keep the integrator of the checkpoint, and with it the leapfrog
+    // stagger
+  } else if (opts.integrator == "euler") {
+    sim.set_integrator(integrator_t::EULER);
+  } else if (opts.integrator == "rk4") {
+    sim.set_integrator(integrator_t::RK4);
+  } else if (opts.integrator == "leapfrog") {
+    sim.set_integrator(integrator_t::LEAPFROG);
+  } else if (opts.integrator == "velocity-verlet") {
+    sim.set_integrator(integrator_t::VELOCITY_VERLET);
+  } else if (opts.integrator == "block-leapfrog") {
+    sim.set_integrator(integrator_t::BLOCK_LEAPFROG);
+    // Only the buffer backend gets this far, the others throw above
+    if constexpr (std::is_same_v<Sim<num_t>, GravSim<num_t>>) {
+      sim.set_block_steps(opts.max_rung, num_t(1e-2));
+    }
+  } else {
+    throw std::runtime_error("Unknown integrator " + opts.integrator + "!");
+  }
+
+  sim.set_double_accumulation(opts.precision == "mixed");
+  sim.set_specialise_forces(opts.specialise);
+
+  if (opts.reorder_every) {
+    if constexpr (std::is_same_v<Sim<num_t>, GravSim<num_t>>) {
+      sim.set_reorder_interval(opts.reorder_every);
+    } else {
+      throw std::runtime_error("Only the buffer backend can reorder bodies!");
+    }
+  }
+
+  if (opts.kernel == "naive") {
+    sim.set_kernel(kernel_t::NAIVE);
+  } else if (opts.kernel == "tiled") {
+    sim.set_kernel(kernel_t::TILED);
+  } else if (opts.kernel == "symmetric") {
+    sim.set_kernel(kernel_t::SYMMETRIC);
+  } else {
+    throw std::runtime_error("Unknown kernel " + opts.kernel + "!");
+  }
+
+  if (opts.layout == "vec3") {
+    sim.set_layout(layout_t::VEC3);
+  } else if (opts.layout == "packed") {
+    sim.set_layout(layout_t::PACKED);
+  } else if (opts.layout == "soa") {
+    sim.set_layout(layout_t::SOA);
+  } else {
+    throw std::runtime_error("Unknown layout " + opts.layout + "!");
+  }
+
+  if (opts.solver == "direct") {
+    sim.set_solver(solver_t::DIRECT);
+  } else if (opts.solver == "barnes-hut") {
+    sim.set_solver(solver_t::BARNES_HUT);
+  } else if (opts.solver == "cell-list") {
+    sim.set_solver(solver_t::CELL_LIST);
+  } else if (opts.solver == "neighbour-list") {
+    sim.set_solver(solver_t::NEIGHBOUR_LIST);
+  } else if (opts.solver == "pme") {
+    sim.set_solver(solver_t::PME);
+  } else {
+    throw std::runtime_error("Unknown solver " + opts.solver + "!");
+  }
+}
+
+// Steps the simulation again while streaming positions to a trajectory file,
+// and reports the step time and the frames written and dropped
+template <template <typename> class Sim, typename num_t>
+void write_trajectory(Sim<num_t>& sim, const options& opts) {
+  TrajectoryWriter<num_t> writer(sim.get_queue(), opts.trajectory,
+                                 opts.n_bodies, opts.quantise);
+
+  auto tstart = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < opts.n_steps; i++) {
+    sim.step();
+    if (i % opts.dump_every == 0) {
+      // Frame times count from the start of the trajectory
+      writer.push(sim, i, double(i + 1) * GravSim<num_t>::STEP_SIZE);
+    }
+  }
+  sim.sync_queue();
+  auto tend = std::chrono::high_resolution_clock::now();
+  double step_time = std::chrono::duration<double>(tend - tstart).count() /
+                     double(opts.n_steps);
+
+  writer.flush();
+  std::fprintf(stderr,
+               "Trajectory: %.9g s per step, %zu frames written, %zu "
+               "dropped\n",
+               step_time, writer.frames_written(), writer.frames_dropped());
+}
+
+// Prints the device time of every kernel recorded over `n_steps` steps
+template <typename num_t>
+void print_profile(GravSim<num_t>& sim, size_t n_steps) {
+  auto& profiler = sim.profiler();
+  profiler.collect_all();
+  std::fprintf(stderr, "Kernel time: %.9g s per step\n",
+               profiler.take_busy_ms() * 1e-3 / double(n_steps));
+  for (auto const& k : profiler.stats()) {
+    std::fprintf(stderr,
+                 "  %-20s %5zu runs, mean %.6f ms, min %.6f ms, max %.6f "
+                 "ms, waited %.6f ms\n",
+                 k.name.c_str(), k.count, k.mean_ms, k.min_ms, k.max_ms,
+                 k.mean_wait_ms);
+  }
+}
+
+// Runs the benchmark on the given simulation backend and prints the results
+template <template <typename> class Sim, typename num_t, typename... Args>
+void run(const options& opts, Args... args) {
+  auto sim = make_sim<Sim, num_t>(opts, args...);
+  configure_sim(sim, opts);
+
+  // Warm-up steps absorb kernel compilation and first-touch allocations
+  for (size_t i = 0; i < opts.n_warmup; i++) {
+    sim.step();
+  }
+  sim.sync_queue();
+
+  if (opts.profile) {
+    if constexpr (std::is_same_v<Sim<num_t>, GravSim<num_t>>) {
+      sim.profiler().set_enabled(true);
+    } else {
+      throw std::runtime_error("Only the buffer backend can profile!");
+    }
+  }
+
+  // Every step is waited on individually so the median is not skewed by
+  // steps overlapping with each other
+  std::vector<double> step_times(opts.n_steps);
+  for (auto& step_time : step_times) {
+    auto tstart = std::chrono::high_resolution_clock::now();
+    sim.step();
+    sim.sync_queue();
+    auto tend = std::chrono::high_resolution_clock::now();
+    step_time = std::chrono::duration<double>(tend - tstart).count();
+  }
+
+  // The same number of steps again, enqueued as one batch without waiting
+  // in between, shows how much of a step is host and launch overhead
+  auto tstart = std::chrono::high_resolution_clock::now();
+  sim.step(opts.n_steps);
+  sim.sync_queue();
+  auto tend = std::chrono::high_resolution_clock::now();
+  double batched = std::chrono::duration<double>(tend - tstart).count() /
+                   double(opts.n_steps);
+
+  std::sort(step_times.begin(), step_times.end());
+  size_t mid = step_times.size() / 2;
+  double median = step_times.size() % 2
+                      ? step_times[mid]
+                      : (step_times[mid - 1] + step_times[mid]) / 2;
+
+  std::printf(
+      "{\n"
+      "  \"backend\": \"%s\",\n"
+      "  \"force\": \"%s\",\n"
+      "  \"integrator\": \"%s\",\n"
+      "  \"kernel\": \"%s\",\n"
+      "  \"layout\": \"%s\",\n"
+      "  \"solver\": \"%s\",\n"
+      "  \"distribution\": \"%s\",\n"
+      "  \"precision\": \"%s\",\n"
+      "  \"specialised\": %s,\n"
+      "  \"reorder_every\": %zu,\n"
+      "  \"bodies\": %zu,\n"
+      "  \"steps\": %zu,\n"
+      "  \"warmup_steps\": %zu,\n"
+      "  \"median_step_time_s\": %.9g,\n"
+      "  \"min_step_time_s\": %.9g,\n"
+      "  \"max_step_time_s\": %.9g,\n"
+      "  \"batched_step_time_s\": %.9g,\n"
+      "  \"interactions_per_s\": %.9g,\n"
+      "  \"gflops\": %.9g\n"
+      "}\n",
+      opts.backend.c_str(), opts.force.c_str(), opts.integrator.c_str(),
+      opts.kernel.c_str(), opts.layout.c_str(), opts.solver.c_str(),
+      opts.distrib.c_str(), opts.precision.c_str(),
+      opts.specialise ? "true" : "false", opts.reorder_every, opts.n_bodies,
+      opts.n_steps, opts.n_warmup, median, step_times.front(),
+      step_times.back(), batched,
+      double(sim.interactions_per_step()) / median,
+      double(sim.flops_per_step()) / median * 1e-9);
+
+  if constexpr (std::is_same_v<Sim<num_t>, GravSim<num_t>>) {
+    if (opts.profile) {
+      // Both the individually waited and the batched steps
+      print_profile(sim, 2 * opts.n_steps);
+      sim.profiler().set_enabled(false);
+    }
+  }
+
+  if (!opts.trajectory.empty()) {
+    write_trajectory(sim, opts);
+  }
+
+  if (!opts.checkpoint.empty()) {
+    if constexpr (std::is_same_v<Sim<num_t>, GravSim<num_t>>) {
+      sim.save_checkpoint(opts.checkpoint);
+      sim.wait_checkpoint();
+    } else {
+      throw std::runtime_error("Only the buffer backend can checkpoint!");
+    }
+  }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  options opts;
+  if (!parse_options(argc, argv, opts)) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  try {
+    if (opts.precision != "float" && opts.precision != "mixed" &&
+        opts.precision != "double") {
+      throw std::runtime_error("Unknown precision " + opts.precision + "!");
+    }
+
+    // Like the Mandelbrot demo, fall back to floats on devices without
+    // double support
+    if (opts.precision != "float" &&
+        !supports_doubles(sycl::device(sycl::default_selector_v))) {
+      std::fprintf(stderr,
+                   "The device doesn't support doubles, using float\n");
+      opts.precision = "float";
+    }
+
+    // Only for the printed results, the simulation reads them from the file
+    if (!opts.restart.empty()) {
+      MappedCheckpoint checkpoint(opts.restart);
+      auto const& header = checkpoint.header();
+      opts.n_bodies = header.n_bodies;
+      opts.distrib = "checkpoint " + opts.restart;
+      if (!opts.force_set && header.force < FORCE_NAMES.size()) {
+        opts.force = FORCE_NAMES[header.force];
+      }
+      if (!opts.integrator_set &&
+          header.integrator < INTEGRATOR_NAMES.size()) {
+        opts.integrator = INTEGRATOR_NAMES[header.integrator];
+      }
+    }
+
+    bool doubles = opts.precision == "double";
+    if (opts.backend == "buffer") {
+      if (doubles) {
+        run<GravSim, double>(opts);
+      } else {
+        run<GravSim, float>(opts);
+      }
+    } else if (opts.backend == "usm") {
+      if (doubles) {
+        run<GravSimUSM, double>(opts);
+      } else {
+        run<GravSimUSM, float>(opts);
+      }
+    } else if (opts.backend == "multi" || opts.backend == "numa") {
+      auto split = opts.backend == "multi" ? device_split_t::DEVICES
+                                           : device_split_t::NUMA;
+      if (doubles) {
+        run<GravSimMulti, double>(opts, split);
+      } else {
+        run<GravSimMulti, float>(opts, split);
+      }
+    } else {
+      throw std::runtime_error("Unknown backend " + opts.backend + "!");
+    }
+  } catch (std::exception& e) {
+    std::fprintf(stderr, "%s\n", e.what());
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,158 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Per-body power-of-two time steps for the NBody leapfrog integrator.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "device_algorithms.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+
+// Dummy classes to generate unique kernel name types
+class block_flag_kernel;
+class block_compact_kernel;
+
+/* Every body sits on a rung r and advances with a time step of
+ * step_size / 2^r. A full step is split into 2^max_rung sub-steps of the
+ * smallest time step, and a body on rung r takes its own step every
+ * 2^(max_rung - r) sub-steps. Before each sub-step's force evaluation, the
+ * bodies whose step ends there are compacted into a list of active bodies on
+ * the device, so the force kernel only does work for them. The count stays
+ * on the device: the force kernel is launched over all bodies and work-items
+ * past the end of the list return straight away. */
+template <typename num_t>
+class BlockSteps {
+  size_t m_n_bodies;
+
+  // Rung of every body
+  sycl::buffer<uint32_t, 1> m_rungs;
+
+  // Exclusive scan of the active flags, the last element is the active count
+  sycl::buffer<uint32_t, 1> m_offsets;
+
+  // Indices of the active bodies
+  sycl::buffer<uint32_t, 1> m_active;
+
+  DeviceScan<uint32_t> m_scan;
+
+  // Whether the body on `rung` takes a step ending at sub-step `t`
+  static bool is_active(uint32_t t, uint32_t rung, uint32_t max_rung) {
+    auto period = uint32_t(1) << (max_rung - sycl::min(rung, max_rung));
+    return (t & (period - 1)) == 0;
+  }
+
+ public:
+  // The rungs are limited to 2^MAX_RUNG sub-steps per step
+  static constexpr uint32_t MAX_RUNG = 16;
+
+  BlockSteps(size_t n_bodies)
+      : m_n_bodies(n_bodies),
+        m_rungs(sycl::range<1>(n_bodies)),
+        m_offsets(sycl::range<1>(n_bodies + 1)),
+        m_active(sycl::range<1>(n_bodies)) {}
+
+  // Rung of every body, e.g. to reorder it along with the bodies
+  sycl::buffer<uint32_t, 1>& rungs() { return m_rungs; }
+
+  // Compacts the bodies whose step ends at sub-step `t` into the active list.
+  // At t = 0 all bodies are active.
+  void select_active(ProfiledQueue q, uint32_t t, uint32_t max_rung) {
+    size_t n_bodies = m_n_bodies;
+
+    q.submit("block flags", [&](sycl::handler& cgh) {
+      sycl::accessor rungs(m_rungs, cgh, sycl::read_only);
+      sycl::accessor flags(m_offsets, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<block_flag_kernel>(
+          sycl::range<1>(n_bodies + 1), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            // The extra work-item leaves a zero to scan into the total
+            flags[id] = id < n_bodies &&
+                        (t == 0 || is_active(t, rungs[id], max_rung));
+          });
+    });
+
+    m_scan.exclusive(q, m_offsets, n_bodies + 1);
+
+    q.submit("block compact", [&](sycl::handler& cgh) {
+      sycl::accessor rungs(m_rungs, cgh, sycl::read_only);
+      sycl::accessor offsets(m_offsets, cgh, sycl::read_only);
+      sycl::accessor active(m_active, cgh, sycl::write_only);
+
+      cgh.parallel_for<block_compact_kernel>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            if (t == 0 || is_active(t, rungs[id], max_rung)) {
+              active[offsets[id]] = uint32_t(id);
+            }
+          });
+    });
+  }
+
+  // Device-side view of the active list and rungs of sub-step `t`
+  class View {
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read_write> m_rungs;
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_offsets;
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_active;
+    size_t m_n_bodies;
+    uint32_t m_t;
+    uint32_t m_max_rung;
+
+   public:
+    View(BlockSteps& steps, sycl::handler& cgh, uint32_t t, uint32_t max_rung)
+        : m_rungs(steps.m_rungs, cgh, sycl::read_write),
+          m_offsets(steps.m_offsets, cgh, sycl::read_only),
+          m_active(steps.m_active, cgh, sycl::read_only),
+          m_n_bodies(steps.m_n_bodies),
+          m_t(t),
+          m_max_rung(max_rung) {}
+
+    uint32_t n_active() const { return m_offsets[m_n_bodies]; }
+
+    // The k-th active body
+    uint32_t active(size_t k) const { return m_active[k]; }
+
+    uint32_t rung(uint32_t id) const {
+      return sycl::min(m_rungs[id], m_max_rung);
+    }
+
+    void set_rung(uint32_t id, uint32_t rung) const { m_rungs[id] = rung; }
+
+    /* The lowest rung whose time step keeps accel * dt^2 below `eta`. A body
+     * may always move to a shorter step, but only to a longer one at a
+     * sub-step where that longer step begins, so it stays in sync. */
+    uint32_t choose_rung(uint32_t old_rung, num_t accel, num_t eta,
+                         num_t step_size) const {
+      uint32_t rung = 0;
+      while (rung < m_max_rung &&
+             accel * step_size * step_size >
+                 eta * num_t(uint32_t(1) << (2 * rung))) {
+        rung++;
+      }
+      while (m_t != 0 && rung < old_rung &&
+             !is_active(m_t, rung, m_max_rung)) {
+        rung++;
+      }
+      return rung;
+    }
+  };
+};
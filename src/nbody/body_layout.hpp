@@ -0,0 +1,225 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Alternative memory layouts of body data for the direct sum kernels.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+
+// Dummy classes to generate unique kernel name types
+template <typename num_t>
+class pack_weighted_kernel;
+template <typename num_t>
+class pack_unit_kernel;
+template <typename num_t>
+class split_weighted_kernel;
+template <typename num_t>
+class split_unit_kernel;
+
+// Device-side view of positions and weights read from separate streams,
+// the layout the simulation itself stores them in
+template <typename num_t, typename PosAcc, typename Weights>
+struct split_bodies {
+  PosAcc positions;
+  Weights weights;
+
+  vec3<num_t> pos(size_t i) const { return positions[i]; }
+  num_t weight(size_t i) const { return weights(i); }
+};
+
+/* Local memory tiles for the tiled direct sum kernels. The work-group walks
+ * over all bodies one tile at a time, with each work-item staging one body
+ * of the tile in local memory, so every global read is shared by the whole
+ * work-group. `Bodies` is any view with pos(i) and weight(i). */
+template <typename num_t>
+class BodyTiles {
+  sycl::local_accessor<vec3<num_t>, 1> m_pos;
+  sycl::local_accessor<num_t, 1> m_weight;
+
+ public:
+  BodyTiles(sycl::handler& cgh, size_t tile_size)
+      : m_pos(sycl::range<1>(tile_size), cgh),
+        m_weight(sycl::range<1>(tile_size), cgh) {}
+
+  /* Sum of the pair() terms of all bodies acting on body `id` at `x`, in
+   * `acc_t` precision. Has to be called by every work-item of the group,
+   * including those past the last body, as it contains barriers. */
+  template <typename acc_t, typename Force, typename Bodies>
+  vec3<acc_t> pair_sum(sycl::nd_item<1> item, const Force& force,
+                       const Bodies& bodies, size_t n_bodies, vec3<num_t> x,
+                       size_t id) const {
+    size_t tile_size = item.get_local_range(0);
+    auto lid = item.get_local_id(0);
+    vec3<acc_t> acc(0);
+
+    for (size_t base = 0; base < n_bodies; base += tile_size) {
+      if (base + lid < n_bodies) {
+        m_pos[lid] = bodies.pos(base + lid);
+        m_weight[lid] = bodies.weight(base + lid);
+      }
+      sycl::group_barrier(item.get_group());
+
+      auto tile_end = std::min(tile_size, n_bodies - base);
+      for (size_t i = 0; i < tile_end; i++) {
+        auto pair = force.pair(m_pos[i] - x, m_weight[i], base + i == id);
+        acc += pair.template convert<acc_t>();
+      }
+      // Don't overwrite the tile while others are still reading it
+      sycl::group_barrier(item.get_group());
+    }
+
+    return acc;
+  }
+};
+
+/* Position and weight (mass or charge) of every body packed into a single
+ * vec4, so the inner loop of the force kernels fetches everything it needs
+ * about another body with one aligned 16 byte load. */
+template <typename num_t>
+class PackedBodies {
+  using vec4 = sycl::vec<num_t, 4>;
+
+  size_t m_n_bodies;
+
+  sycl::buffer<vec4, 1> m_bodies;
+
+ public:
+  PackedBodies(size_t n_bodies)
+      : m_n_bodies(n_bodies), m_bodies(sycl::range<1>(n_bodies)) {}
+
+  // Packs the current positions with the given weights, or with unit weights
+  // if `weights` is null
+  void update(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+               sycl::buffer<num_t, 1>* weights) {
+    q.submit("pack bodies", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor bodies(m_bodies, cgh, sycl::write_only, sycl::no_init);
+
+      if (weights) {
+        sycl::accessor w(*weights, cgh, sycl::read_only);
+        cgh.parallel_for<pack_weighted_kernel<num_t>>(
+            sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+              auto p = pos[item];
+              bodies[item] = {p.x(), p.y(), p.z(), w[item]};
+            });
+      } else {
+        cgh.parallel_for<pack_unit_kernel<num_t>>(
+            sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+              auto p = pos[item];
+              bodies[item] = {p.x(), p.y(), p.z(), num_t(1)};
+            });
+      }
+    });
+  }
+
+  // Device-side view of the packed bodies used inside a kernel
+  class View {
+    sycl::accessor<vec4, 1, sycl::access_mode::read> m_bodies;
+
+   public:
+    View(PackedBodies& bodies, sycl::handler& cgh)
+        : m_bodies(bodies.m_bodies, cgh, sycl::read_only) {}
+
+    vec3<num_t> pos(size_t i) const {
+      vec4 b = m_bodies[i];
+      return {b.x(), b.y(), b.z()};
+    }
+
+    num_t weight(size_t i) const { return m_bodies[i].w(); }
+  };
+};
+
+/* Structure of arrays: every coordinate and the weight in its own array.
+ * Consecutive work-items then read consecutive scalars, which CPU devices
+ * can turn into plain vector loads when vectorising across work-items. */
+template <typename num_t>
+class SoaBodies {
+  size_t m_n_bodies;
+
+  sycl::buffer<num_t, 1> m_x;
+  sycl::buffer<num_t, 1> m_y;
+  sycl::buffer<num_t, 1> m_z;
+  sycl::buffer<num_t, 1> m_w;
+
+ public:
+  SoaBodies(size_t n_bodies)
+      : m_n_bodies(n_bodies),
+        m_x(sycl::range<1>(n_bodies)),
+        m_y(sycl::range<1>(n_bodies)),
+        m_z(sycl::range<1>(n_bodies)),
+        m_w(sycl::range<1>(n_bodies)) {}
+
+  // Splits the current positions and the given weights, or unit weights if
+  // `weights` is null, into separate arrays
+  void update(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+               sycl::buffer<num_t, 1>* weights) {
+    q.submit("split bodies", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor x(m_x, cgh, sycl::write_only, sycl::no_init);
+      sycl::accessor y(m_y, cgh, sycl::write_only, sycl::no_init);
+      sycl::accessor z(m_z, cgh, sycl::write_only, sycl::no_init);
+      sycl::accessor w(m_w, cgh, sycl::write_only, sycl::no_init);
+
+      if (weights) {
+        sycl::accessor in_w(*weights, cgh, sycl::read_only);
+        cgh.parallel_for<split_weighted_kernel<num_t>>(
+            sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+              auto p = pos[item];
+              x[item] = p.x();
+              y[item] = p.y();
+              z[item] = p.z();
+              w[item] = in_w[item];
+            });
+      } else {
+        cgh.parallel_for<split_unit_kernel<num_t>>(
+            sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+              auto p = pos[item];
+              x[item] = p.x();
+              y[item] = p.y();
+              z[item] = p.z();
+              w[item] = num_t(1);
+            });
+      }
+    });
+  }
+
+  // Device-side view of the arrays used inside a kernel
+  class View {
+    sycl::accessor<num_t, 1, sycl::access_mode::read> m_x;
+    sycl::accessor<num_t, 1, sycl::access_mode::read> m_y;
+    sycl::accessor<num_t, 1, sycl::access_mode::read> m_z;
+    sycl::accessor<num_t, 1, sycl::access_mode::read> m_w;
+
+   public:
+    View(SoaBodies& bodies, sycl::handler& cgh)
+        : m_x(bodies.m_x, cgh, sycl::read_only),
+          m_y(bodies.m_y, cgh, sycl::read_only),
+          m_z(bodies.m_z, cgh, sycl::read_only),
+          m_w(bodies.m_w, cgh, sycl::read_only) {}
+
+    vec3<num_t> pos(size_t i) const { return {m_x[i], m_y[i], m_z[i]}; }
+
+    num_t weight(size_t i) const { return m_w[i]; }
+  };
+};
@@ -0,0 +1,200 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Reordering of the NBody bodies along a Morton curve for locality.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "device_algorithms.hpp"
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Dummy classes to generate unique kernel name types
+template <typename num_t>
+class order_extent_kernel;
+template <typename num_t>
+class order_key_kernel;
+template <typename T>
+class order_gather_kernel;
+template <typename T>
+class order_scatter_kernel;
+
+/* Sorts the bodies along a Morton curve through the cube enclosing them, so
+ * that bodies close in space are also close in memory and the neighbour
+ * searches and tree walks reuse the cache lines they load. sort() only
+ * computes the new order, every per-body array is then moved into it with
+ * permute(). The original index of the body in every slot is kept in ids(),
+ * so output can still be written in the order the bodies were created. */
+template <typename num_t>
+class BodyOrder {
+  size_t m_n_bodies;
+
+  // Morton key of every body, then scratch space for permuting the ids
+  sycl::buffer<uint32_t, 1> m_keys;
+
+  // Slot every body came from, in the new order
+  sycl::buffer<uint32_t, 1> m_order;
+
+  // Original index of the body in every slot
+  sycl::buffer<uint32_t, 1> m_ids;
+
+  // Largest absolute coordinate of any body
+  sycl::buffer<num_t, 1> m_extent{sycl::range<1>(1)};
+
+  DeviceRadixSort m_sort;
+
+  // Scratch space for permuting and writing out the other arrays
+  std::unique_ptr<sycl::buffer<vec3<num_t>, 1>> m_scratch_vec3 = nullptr;
+  std::unique_ptr<sycl::buffer<num_t, 1>> m_scratch_num = nullptr;
+
+  size_t m_n_sorts = 0;
+
+  // Bits of every coordinate in the Morton keys
+  static constexpr uint32_t KEY_BITS = 10;
+
+  template <typename T>
+  sycl::buffer<T, 1>& scratch(std::unique_ptr<sycl::buffer<T, 1>>& buf) {
+    if (!buf) {
+      buf = std::make_unique<sycl::buffer<T, 1>>(sycl::range<1>(m_n_bodies));
+    }
+    return *buf;
+  }
+
+  sycl::buffer<vec3<num_t>, 1>& scratch_for(vec3<num_t>) {
+    return scratch(m_scratch_vec3);
+  }
+  sycl::buffer<num_t, 1>& scratch_for(num_t) { return scratch(m_scratch_num); }
+  sycl::buffer<uint32_t, 1>& scratch_for(uint32_t) { return m_keys; }
+
+ public:
+  BodyOrder(size_t n_bodies)
+      : m_n_bodies(n_bodies),
+        m_keys(sycl::range<1>(n_bodies)),
+        m_order(sycl::range<1>(n_bodies)),
+        m_ids(sycl::range<1>(n_bodies)) {
+    auto ids = m_ids.get_host_access(sycl::write_only);
+    for (size_t i = 0; i < n_bodies; i++) {
+      ids[i] = uint32_t(i);
+    }
+  }
+
+  // How often the bodies have been sorted
+  size_t n_sorts() const { return m_n_sorts; }
+
+  // Original index of the body in every slot
+  sycl::buffer<uint32_t, 1>& ids() { return m_ids; }
+
+  /* Finds the Morton order of the given positions and moves the ids into it.
+   * The arrays of the bodies still have to be permuted afterwards. */
+  void sort(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions) {
+    size_t n_bodies = m_n_bodies;
+
+    q.submit("order extent", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      auto extent = sycl::reduction(
+          m_extent, cgh, sycl::maximum<num_t>(),
+          sycl::property::reduction::initialize_to_identity{});
+
+      cgh.parallel_for<order_extent_kernel<num_t>>(
+          sycl::range<1>(n_bodies), extent,
+          [=](sycl::item<1> item, auto& max_coord) {
+            auto p = pos[item];
+            max_coord.combine(
+                sycl::fmax(sycl::fabs(p.x()),
+                           sycl::fmax(sycl::fabs(p.y()), sycl::fabs(p.z()))));
+          });
+    });
+
+    q.submit("order keys", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor extent(m_extent, cgh, sycl::read_only);
+      sycl::accessor keys(m_keys, cgh, sycl::write_only, sycl::no_init);
+      sycl::accessor order(m_order, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<order_key_kernel<num_t>>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            num_t r = extent[0] * num_t(1.001) + num_t(1e-6);
+            num_t cells_per_side = num_t(uint32_t(1) << KEY_BITS);
+            auto max_cell = (uint32_t(1) << KEY_BITS) - 1;
+            const auto coord = [&](num_t v) {
+              auto c = uint32_t((v + r) / (2 * r) * cells_per_side);
+              return sycl::min(c, max_cell);
+            };
+
+            auto p = pos[item];
+            keys[item] =
+                morton_encode(coord(p.x()), coord(p.y()), coord(p.z()));
+            order[item] = uint32_t(item.get_linear_id());
+          });
+    });
+
+    m_sort.sort(q, m_keys, m_order, n_bodies, 3 * KEY_BITS);
+    permute(q, m_ids);
+    m_n_sorts++;
+  }
+
+  // Gathers `src` into `dst` in the order found by the last sort()
+  template <typename T>
+  void gather(ProfiledQueue q, sycl::buffer<T, 1>& src,
+               sycl::buffer<T, 1>& dst) {
+    q.submit("order gather", [&](sycl::handler& cgh) {
+      sycl::accessor order(m_order, cgh, sycl::read_only);
+      sycl::accessor in(src, cgh, sycl::read_only);
+      sycl::accessor out(dst, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<order_gather_kernel<T>>(
+          sycl::range<1>(m_n_bodies),
+          [=](sycl::item<1> item) { out[item] = in[order[item]]; });
+    });
+  }
+
+  // Moves a per-body array into the order found by the last sort(). Only
+  // swaps buffer handles, so the buffer of `data` changes.
+  template <typename T>
+  void permute(ProfiledQueue q, sycl::buffer<T, 1>& data) {
+    auto& tmp = scratch_for(T{});
+    gather(q, data, tmp);
+    std::swap(data, tmp);
+  }
+
+  // Copies a per-body array to `dest` in the original order of the bodies
+  template <typename T>
+  sycl::event copy_in_id_order(ProfiledQueue q, sycl::buffer<T, 1>& src,
+                                void* dest) {
+    auto& tmp = scratch_for(T{});
+    q.submit("order scatter", [&](sycl::handler& cgh) {
+      sycl::accessor ids(m_ids, cgh, sycl::read_only);
+      sycl::accessor in(src, cgh, sycl::read_only);
+      sycl::accessor out(tmp, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<order_scatter_kernel<T>>(
+          sycl::range<1>(m_n_bodies),
+          [=](sycl::item<1> item) { out[ids[item]] = in[item]; });
+    });
+    return q.submit("order copy", [&](sycl::handler& cgh) {
+      sycl::accessor in(tmp, cgh, sycl::read_only);
+      cgh.copy(in, static_cast<T*>(dest));
+    });
+  }
+};
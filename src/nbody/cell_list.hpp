@@ -0,0 +1,202 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Device-built uniform cell grid for short-range NBody forces.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "device_algorithms.hpp"
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+#include <stdexcept>
+
+// Dummy class to generate unique kernel name types
+template <typename num_t>
+class cell_key_kernel;
+
+/* Bins bodies into a uniform grid of cubic cells whose side is at least the
+ * interaction cutoff, so all neighbours of a body lie in the 27 cells around
+ * its own. The grid is unbounded: cells are hashed into a fixed number of
+ * buckets, which avoids having to find the extent of the system on the host.
+ * Bodies are sorted by bucket with a counting sort.
+ *
+ * build_periodic() instead wraps the cells around a cubic periodic box, so
+ * the neighbours of bodies near a face are found in the cells at the opposite
+ * face. Callers then take the minimum image of the distances. */
+template <typename num_t>
+class CellList {
+  size_t m_n_bodies;
+
+  // Number of hash buckets, a power of two
+  size_t m_n_buckets;
+
+  // Side of a single cell
+  num_t m_cell_size = num_t(1);
+
+  // Cells along every side of the periodic box, 0 if the grid is unbounded
+  int32_t m_cells_per_side = 0;
+
+  // Bucket of every body
+  sycl::buffer<uint32_t, 1> m_keys;
+
+  // Bodies sorted by bucket and the start of each bucket's range in m_order
+  sycl::buffer<uint32_t, 1> m_order;
+  sycl::buffer<uint32_t, 1> m_bucket_start;
+
+  KeyBinner m_binner;
+
+  // About one bucket per body keeps collisions between cells rare
+  static size_t choose_buckets(size_t n_bodies) {
+    size_t n_buckets = 1024;
+    while (n_buckets < n_bodies) {
+      n_buckets *= 2;
+    }
+    return n_buckets;
+  }
+
+  // Wraps cell coordinates into the periodic box, if there is one
+  static sycl::vec<int32_t, 3> wrap_cell(sycl::vec<int32_t, 3> cell,
+                                         int32_t cells_per_side) {
+    if (cells_per_side == 0) {
+      return cell;
+    }
+    auto const n = cells_per_side;
+    return {(cell.x() % n + n) % n, (cell.y() % n + n) % n,
+            (cell.z() % n + n) % n};
+  }
+
+  static sycl::vec<int32_t, 3> cell_of(vec3<num_t> x, num_t inv_cell_size,
+                                       int32_t cells_per_side) {
+    return wrap_cell({int32_t(sycl::floor(x.x() * inv_cell_size)),
+                      int32_t(sycl::floor(x.y() * inv_cell_size)),
+                      int32_t(sycl::floor(x.z() * inv_cell_size))},
+                     cells_per_side);
+  }
+
+  static uint32_t bucket_of(sycl::vec<int32_t, 3> cell, size_t n_buckets) {
+    auto h = (uint32_t(cell.x()) * 73856093u) ^
+             (uint32_t(cell.y()) * 19349663u) ^
+             (uint32_t(cell.z()) * 83492791u);
+    return h & uint32_t(n_buckets - 1);
+  }
+
+ public:
+  CellList(size_t n_bodies)
+      : m_n_bodies(n_bodies),
+        m_n_buckets(choose_buckets(n_bodies)),
+        m_keys(sycl::range<1>(n_bodies)),
+        m_order(sycl::range<1>(n_bodies)),
+        m_bucket_start(sycl::range<1>(m_n_buckets + 1)) {}
+
+  // Rebuilds the grid for the given positions and cell side
+  void build(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+              num_t cell_size) {
+    m_cells_per_side = 0;
+    build_cells(q, positions, cell_size);
+  }
+
+  /* Rebuilds the grid for the given positions in a periodic cube of side
+   * `box` with its corner at the origin, using the smallest cells that are
+   * at least `cutoff` wide. The box must be at least three cutoffs wide. */
+  void build_periodic(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+                       num_t box, num_t cutoff) {
+    m_cells_per_side = int32_t(sycl::floor(box / cutoff));
+    if (m_cells_per_side < 3) {
+      throw std::runtime_error(
+          "The periodic box must be at least three cutoffs wide!");
+    }
+    build_cells(q, positions, box / num_t(m_cells_per_side));
+  }
+
+ private:
+  void build_cells(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+                    num_t cell_size) {
+    m_cell_size = cell_size;
+    num_t inv_cell_size = num_t(1) / cell_size;
+    int32_t cells_per_side = m_cells_per_side;
+    size_t n_buckets = m_n_buckets;
+
+    q.submit("cell keys", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor keys(m_keys, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<cell_key_kernel<num_t>>(
+          sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+            keys[item] = bucket_of(
+                cell_of(pos[item], inv_cell_size, cells_per_side), n_buckets);
+          });
+    });
+
+    m_binner.bin(q, m_keys, m_n_bodies, m_n_buckets, m_bucket_start,
+                 m_order);
+  }
+
+ public:
+
+  // Device-side view of the grid used to find neighbours inside a kernel
+  class View {
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_order;
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_bucket_start;
+    size_t m_n_buckets;
+    num_t m_inv_cell_size;
+    int32_t m_cells_per_side;
+
+   public:
+    View(CellList& grid, sycl::handler& cgh)
+        : m_order(grid.m_order, cgh, sycl::read_only),
+          m_bucket_start(grid.m_bucket_start, cgh, sycl::read_only),
+          m_n_buckets(grid.m_n_buckets),
+          m_inv_cell_size(num_t(1) / grid.m_cell_size),
+          m_cells_per_side(grid.m_cells_per_side) {}
+
+    /* Calls func(j) for every body j in the 27 cells around position `x`.
+     * `pos` must hold the positions the grid was built from. Bodies which
+     * only share a bucket with a neighbouring cell through a hash collision
+     * are skipped, so every body is visited at most once. */
+    template <typename PosAcc, typename Func>
+    void for_each_neighbour(const PosAcc& pos, vec3<num_t> x,
+                            Func&& func) const {
+      auto centre = cell_of(x, m_inv_cell_size, m_cells_per_side);
+
+      for (int32_t dz = -1; dz <= 1; dz++) {
+        for (int32_t dy = -1; dy <= 1; dy++) {
+          for (int32_t dx = -1; dx <= 1; dx++) {
+            auto cell = wrap_cell({centre.x() + dx, centre.y() + dy,
+                                   centre.z() + dz},
+                                  m_cells_per_side);
+            auto bucket = bucket_of(cell, m_n_buckets);
+
+            for (uint32_t k = m_bucket_start[bucket];
+                 k < m_bucket_start[bucket + 1]; k++) {
+              auto j = m_order[k];
+              auto other = cell_of(pos[j], m_inv_cell_size, m_cells_per_side);
+              if (other.x() == cell.x() && other.y() == cell.y() &&
+                  other.z() == cell.z()) {
+                func(j);
+              }
+            }
+          }
+        }
+      }
+    }
+  };
+};
@@ -0,0 +1,275 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Binary snapshots of the NBody simulation state.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "forces.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/* A checkpoint file starts with this header, followed at
+ * CHECKPOINT_DATA_OFFSET by the velocities and positions of all bodies and,
+ * if present, their charges. The arrays are stored exactly as they sit in
+ * memory, so a file can only be loaded with the same element sizes it was
+ * written with. */
+struct checkpoint_header {
+  char magic[8];
+  uint32_t version;
+
+  // sizeof(num_t) and sizeof(vec3<num_t>) of the arrays
+  uint32_t num_size;
+  uint32_t vec_size;
+
+  uint32_t has_charges;
+  uint64_t n_bodies;
+
+  // force_t and integrator_t values
+  uint32_t force;
+  uint32_t integrator;
+
+  // Whether the velocities are half a step ahead for leapfrog integration
+  uint32_t leapfrog_staggered;
+  uint32_t reserved;
+
+  double time;
+  double grav_G;
+  double grav_damping;
+  double lj_eps;
+  double lj_sigma;
+  double lj_cutoff;
+  double lj_skin;
+};
+
+constexpr char CHECKPOINT_MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'C', 'K', 'P'};
+constexpr uint32_t CHECKPOINT_VERSION = 1;
+
+// The arrays start on a page boundary so they can be mapped directly
+constexpr size_t CHECKPOINT_DATA_OFFSET = 4096;
+
+// Header with the format fields filled in for bodies of type num_t
+template <typename num_t>
+checkpoint_header make_checkpoint_header(size_t n_bodies, bool has_charges) {
+  checkpoint_header header{};
+  std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+  header.version = CHECKPOINT_VERSION;
+  header.num_size = sizeof(num_t);
+  header.vec_size = sizeof(vec3<num_t>);
+  header.has_charges = has_charges;
+  header.n_bodies = n_bodies;
+  return header;
+}
+
+/* Writes checkpoints on a background thread from a host USM staging copy of
+ * the bodies, so the device copies are fast and the simulation only has to
+ * wait for them rather than for the file. One checkpoint is written at a
+ * time, staging the next waits for the previous one to finish. */
+template <typename num_t>
+class CheckpointWriter {
+  sycl::queue m_q;
+
+  size_t m_capacity = 0;
+  vec3<num_t>* m_vel = nullptr;
+  vec3<num_t>* m_pos = nullptr;
+  num_t* m_charges = nullptr;
+
+  std::future<void> m_pending;
+
+  void free_staging() {
+    sycl::free(m_vel, m_q);
+    sycl::free(m_pos, m_q);
+    sycl::free(m_charges, m_q);
+  }
+
+ public:
+  CheckpointWriter(sycl::queue q) : m_q(q) {}
+
+  CheckpointWriter(const CheckpointWriter&) = delete;
+  CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+
+  ~CheckpointWriter() {
+    if (m_pending.valid()) {
+      m_pending.wait();
+    }
+    free_staging();
+  }
+
+  // Blocks until the checkpoint being written is on disk, rethrows its
+  // errors
+  void wait() {
+    if (m_pending.valid()) {
+      m_pending.get();
+    }
+  }
+
+  // Makes room for `n_bodies` bodies once the previous checkpoint is written
+  void reserve(size_t n_bodies) {
+    wait();
+    if (n_bodies > m_capacity) {
+      free_staging();
+      m_vel = sycl::malloc_host<vec3<num_t>>(n_bodies, m_q);
+      m_pos = sycl::malloc_host<vec3<num_t>>(n_bodies, m_q);
+      m_charges = sycl::malloc_host<num_t>(n_bodies, m_q);
+      m_capacity = n_bodies;
+    }
+  }
+
+  vec3<num_t>* velocities() { return m_vel; }
+  vec3<num_t>* positions() { return m_pos; }
+  num_t* charges() { return m_charges; }
+
+  /* Writes the staged bodies to `path` once the `copies` into the staging
+   * allocations have completed. The file is written under a temporary name
+   * and renamed at the end, so a crash never leaves a truncated checkpoint
+   * in place of the last good one. */
+  void write_async(checkpoint_header header, const std::string& path,
+                   std::vector<sycl::event> copies) {
+    m_pending = std::async(std::launch::async, [=]() {
+      sycl::event::wait(copies);
+
+      std::string tmp_path = path + ".tmp";
+      std::FILE* file = std::fopen(tmp_path.c_str(), "wb");
+      if (!file) {
+        throw std::runtime_error("Can't open " + tmp_path + "!");
+      }
+
+      size_t n = header.n_bodies;
+      std::vector<char> header_page(CHECKPOINT_DATA_OFFSET, 0);
+      std::memcpy(header_page.data(), &header, sizeof(header));
+      bool ok = std::fwrite(header_page.data(), 1, header_page.size(),
+                            file) == header_page.size() &&
+                std::fwrite(m_vel, sizeof(vec3<num_t>), n, file) == n &&
+                std::fwrite(m_pos, sizeof(vec3<num_t>), n, file) == n;
+      if (ok && header.has_charges) {
+        ok = std::fwrite(m_charges, sizeof(num_t), n, file) == n;
+      }
+      ok = std::fclose(file) == 0 && ok;
+
+      if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        throw std::runtime_error("Failed to write checkpoint " + path + "!");
+      }
+    });
+  }
+};
+
+/* Read-only memory mapping of a checkpoint file. The body arrays are read
+ * straight from the mapped pages, which the OS fetches on first access, so
+ * opening a checkpoint costs the same no matter how many bodies it holds. */
+class MappedCheckpoint {
+  int m_fd = -1;
+  void* m_data = MAP_FAILED;
+  size_t m_size = 0;
+
+ public:
+  explicit MappedCheckpoint(const std::string& path) {
+    m_fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (m_fd < 0 || fstat(m_fd, &st) != 0) {
+      close_file();
+      throw std::runtime_error("Can't open checkpoint " + path + "!");
+    }
+
+    m_size = size_t(st.st_size);
+    if (m_size >= CHECKPOINT_DATA_OFFSET) {
+      m_data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    }
+    if (m_data == MAP_FAILED) {
+      close_file();
+      throw std::runtime_error("Can't map checkpoint " + path + "!");
+    }
+    // The arrays are copied front to back
+    madvise(m_data, m_size, MADV_SEQUENTIAL);
+
+    // Divide rather than multiply, so a huge n_bodies can't overflow past
+    // the size check
+    auto const& h = header();
+    size_t bytes_per_body =
+        2 * size_t(h.vec_size) + (h.has_charges ? size_t(h.num_size) : 0);
+    if (std::memcmp(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != CHECKPOINT_VERSION || h.num_size == 0 ||
+        h.vec_size == 0 ||
+        h.n_bodies > (m_size - CHECKPOINT_DATA_OFFSET) / bytes_per_body) {
+      close_file();
+      throw std::runtime_error(path + " isn't a valid checkpoint!");
+    }
+  }
+
+  MappedCheckpoint(const MappedCheckpoint&) = delete;
+  MappedCheckpoint& operator=(const MappedCheckpoint&) = delete;
+
+  ~MappedCheckpoint() { close_file(); }
+
+  const checkpoint_header& header() const {
+    return *static_cast<const checkpoint_header*>(m_data);
+  }
+
+  // Throws if the arrays weren't written with bodies of type num_t
+  template <typename num_t>
+  void check_types() const {
+    if (header().num_size != sizeof(num_t) ||
+        header().vec_size != sizeof(vec3<num_t>)) {
+      throw std::runtime_error(
+          "The checkpoint was written with a different precision!");
+    }
+  }
+
+  template <typename num_t>
+  const vec3<num_t>* velocities() const {
+    return reinterpret_cast<const vec3<num_t>*>(
+        static_cast<const char*>(m_data) + CHECKPOINT_DATA_OFFSET);
+  }
+
+  template <typename num_t>
+  const vec3<num_t>* positions() const {
+    return velocities<num_t>() + header().n_bodies;
+  }
+
+  // Only valid if the header says the checkpoint has charges
+  template <typename num_t>
+  const num_t* charges() const {
+    return reinterpret_cast<const num_t*>(positions<num_t>() +
+                                          header().n_bodies);
+  }
+
+ private:
+  void close_file() {
+    if (m_data != MAP_FAILED) {
+      munmap(m_data, m_size);
+      m_data = MAP_FAILED;
+    }
+    if (m_fd >= 0) {
+      close(m_fd);
+      m_fd = -1;
+    }
+  }
+};
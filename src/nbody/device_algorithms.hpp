@@ -0,0 +1,310 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Device-wide scan and sorting building blocks for the NBody solvers.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// Dummy classes to generate unique kernel name types
+template <typename T>
+class scan_blocks_kernel;
+template <typename T>
+class scan_add_kernel;
+class bin_count_kernel;
+class bin_scatter_kernel;
+class radix_count_kernel;
+class radix_scatter_kernel;
+
+// Interleaves the lowest 10 bits of x, y and z into a 30-bit Morton code
+inline uint32_t morton_encode(uint32_t x, uint32_t y, uint32_t z) {
+  const auto spread = [](uint32_t v) {
+    v &= 0x3ff;
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  };
+  return spread(x) | (spread(y) << 1) | (spread(z) << 2);
+}
+
+/* Device-wide exclusive prefix sum. Every work-group scans one block, the
+ * block totals are scanned recursively and then added back onto each block.
+ * The block total buffers are kept between calls, as destroying a buffer
+ * would block the host until the scan has finished. They are held by
+ * pointer, so creating a deeper level doesn't move the buffers of the
+ * levels still being scanned. */
+template <typename T>
+class DeviceScan {
+  std::vector<std::unique_ptr<sycl::buffer<T, 1>>> m_block_sums;
+
+  // Levels outgrown by a larger scan, kept alive rather than destroyed while
+  // earlier scans may still use them
+  std::vector<std::unique_ptr<sycl::buffer<T, 1>>> m_retired;
+
+ public:
+  // Replaces the first `n` elements of `data` with their exclusive prefix sum
+  void exclusive(ProfiledQueue q, sycl::buffer<T, 1>& data, size_t n) {
+    exclusive_level(q, data, n, 0);
+  }
+
+ private:
+  void exclusive_level(ProfiledQueue q, sycl::buffer<T, 1>& data, size_t n,
+                        size_t level) {
+    if (n == 0) {
+      return;
+    }
+
+    auto device = q.queue().get_device();
+    size_t wg_size = std::min<size_t>(
+        256, device.get_info<sycl::info::device::max_work_group_size>());
+    size_t n_groups = (n + wg_size - 1) / wg_size;
+
+    if (m_block_sums.size() <= level) {
+      m_block_sums.push_back(std::make_unique<sycl::buffer<T, 1>>(
+          sycl::range<1>(n_groups)));
+    } else if (m_block_sums[level]->size() < n_groups) {
+      m_retired.push_back(std::move(m_block_sums[level]));
+      m_block_sums[level] =
+          std::make_unique<sycl::buffer<T, 1>>(sycl::range<1>(n_groups));
+    }
+    // The buffer itself stays put when deeper levels are added
+    auto& block_sums = *m_block_sums[level];
+
+    q.submit("scan blocks", [&](sycl::handler& cgh) {
+      sycl::accessor acc(data, cgh, sycl::read_write);
+      sycl::accessor sums(block_sums, cgh, sycl::write_only);
+
+      cgh.parallel_for<scan_blocks_kernel<T>>(
+          sycl::nd_range<1>(n_groups * wg_size, wg_size),
+          [=](sycl::nd_item<1> item) {
+            auto i = item.get_global_id(0);
+            T val = i < n ? acc[i] : T(0);
+            T ex = sycl::exclusive_scan_over_group(item.get_group(), val,
+                                                   sycl::plus<T>());
+            if (i < n) {
+              acc[i] = ex;
+            }
+            if (item.get_local_id(0) == wg_size - 1) {
+              sums[item.get_group_linear_id()] = ex + val;
+            }
+          });
+    });
+
+    if (n_groups > 1) {
+      exclusive_level(q, block_sums, n_groups, level + 1);
+
+      q.submit("scan add", [&](sycl::handler& cgh) {
+        sycl::accessor acc(data, cgh, sycl::read_write);
+        sycl::accessor sums(block_sums, cgh, sycl::read_only);
+
+        cgh.parallel_for<scan_add_kernel<T>>(
+            sycl::range<1>(n), [=](sycl::item<1> item) {
+              acc[item] += sums[item.get_linear_id() / wg_size];
+            });
+      });
+    }
+  }
+};
+
+/* Counting sort of the indices 0..n-1 by a key smaller than `n_bins`.
+ * Afterwards, the indices with key k are stored in `order` in the range
+ * [bin_start[k], bin_start[k + 1]). The order within a bin is unspecified. */
+class KeyBinner {
+  DeviceScan<uint32_t> m_scan;
+
+  // Next free slot of every bin while scattering
+  std::unique_ptr<sycl::buffer<uint32_t, 1>> m_cursor;
+
+ public:
+  // `bin_start` must hold at least n_bins + 1 elements
+  void bin(ProfiledQueue q, sycl::buffer<uint32_t, 1>& keys, size_t n,
+            size_t n_bins, sycl::buffer<uint32_t, 1>& bin_start,
+            sycl::buffer<uint32_t, 1>& order) {
+    if (!m_cursor || m_cursor->size() < n_bins) {
+      m_cursor = std::make_unique<sycl::buffer<uint32_t, 1>>(
+          sycl::range<1>(n_bins));
+    }
+
+    q.submit("bin clear", [&](sycl::handler& cgh) {
+      sycl::accessor counts(bin_start, cgh, sycl::write_only, sycl::no_init);
+      cgh.fill(counts, uint32_t(0));
+    });
+
+    q.submit("bin count", [&](sycl::handler& cgh) {
+      sycl::accessor key(keys, cgh, sycl::read_only);
+      sycl::accessor counts(bin_start, cgh, sycl::read_write);
+
+      cgh.parallel_for<bin_count_kernel>(
+          sycl::range<1>(n), [=](sycl::item<1> item) {
+            sycl::atomic_ref<uint32_t, sycl::memory_order::relaxed,
+                             sycl::memory_scope::device>
+                count(counts[key[item]]);
+            count++;
+          });
+    });
+
+    m_scan.exclusive(q, bin_start, n_bins + 1);
+
+    // Scatter each index into the next free slot of its bin
+    q.submit("bin start copy", [&](sycl::handler& cgh) {
+      sycl::accessor start(bin_start, cgh, sycl::range<1>(n_bins),
+                           sycl::read_only);
+      sycl::accessor next(*m_cursor, cgh, sycl::range<1>(n_bins),
+                          sycl::write_only, sycl::no_init);
+      cgh.copy(start, next);
+    });
+
+    q.submit("bin scatter", [&](sycl::handler& cgh) {
+      sycl::accessor key(keys, cgh, sycl::read_only);
+      sycl::accessor next(*m_cursor, cgh, sycl::read_write);
+      sycl::accessor out(order, cgh, sycl::write_only);
+
+      cgh.parallel_for<bin_scatter_kernel>(
+          sycl::range<1>(n), [=](sycl::item<1> item) {
+            sycl::atomic_ref<uint32_t, sycl::memory_order::relaxed,
+                             sycl::memory_scope::device>
+                slot(next[key[item]]);
+            out[slot.fetch_add(1)] = uint32_t(item.get_linear_id());
+          });
+    });
+  }
+};
+
+/* Stable least significant digit radix sort of 32-bit keys carrying 32-bit
+ * values, RADIX_BITS bits per pass. Every work-item counts the digits of a
+ * block of BLOCK consecutive elements and later scatters them in order,
+ * which keeps each pass stable. The counts of all blocks are scanned digit
+ * by digit, so that every block knows where its elements of each digit go. */
+class DeviceRadixSort {
+ public:
+  static constexpr uint32_t RADIX_BITS = 4;
+  static constexpr uint32_t RADIX = 1u << RADIX_BITS;
+  static constexpr size_t BLOCK = 256;
+
+ private:
+  DeviceScan<uint32_t> m_scan;
+
+  // Digit counts of every block, digit-major, then their exclusive scan
+  std::unique_ptr<sycl::buffer<uint32_t, 1>> m_counts;
+
+  // The other side of the keys and values between passes
+  std::unique_ptr<sycl::buffer<uint32_t, 1>> m_keys_tmp;
+  std::unique_ptr<sycl::buffer<uint32_t, 1>> m_values_tmp;
+
+  static void reserve(std::unique_ptr<sycl::buffer<uint32_t, 1>>& buf,
+                      size_t n) {
+    if (!buf || buf->size() < n) {
+      buf = std::make_unique<sycl::buffer<uint32_t, 1>>(sycl::range<1>(n));
+    }
+  }
+
+ public:
+  // Sorts the first `n` keys by their lowest `key_bits` bits, and moves the
+  // values along with them
+  void sort(ProfiledQueue q, sycl::buffer<uint32_t, 1>& keys,
+             sycl::buffer<uint32_t, 1>& values, size_t n, uint32_t key_bits) {
+    if (n == 0) {
+      return;
+    }
+    size_t n_blocks = (n + BLOCK - 1) / BLOCK;
+    reserve(m_counts, RADIX * n_blocks);
+    reserve(m_keys_tmp, n);
+    reserve(m_values_tmp, n);
+
+    auto* src_keys = &keys;
+    auto* src_values = &values;
+    auto* dst_keys = m_keys_tmp.get();
+    auto* dst_values = m_values_tmp.get();
+
+    for (uint32_t shift = 0; shift < key_bits; shift += RADIX_BITS) {
+      q.submit("radix count", [&](sycl::handler& cgh) {
+        sycl::accessor key(*src_keys, cgh, sycl::read_only);
+        sycl::accessor counts(*m_counts, cgh, sycl::write_only,
+                              sycl::no_init);
+
+        cgh.parallel_for<radix_count_kernel>(
+            sycl::range<1>(n_blocks), [=](sycl::item<1> item) {
+              auto block = item.get_linear_id();
+              uint32_t hist[RADIX] = {};
+              auto end = sycl::min((block + 1) * BLOCK, n);
+              for (auto i = block * BLOCK; i < end; i++) {
+                hist[(key[i] >> shift) & (RADIX - 1)]++;
+              }
+              for (uint32_t d = 0; d < RADIX; d++) {
+                counts[d * n_blocks + block] = hist[d];
+              }
+            });
+      });
+
+      m_scan.exclusive(q, *m_counts, RADIX * n_blocks);
+
+      q.submit("radix scatter", [&](sycl::handler& cgh) {
+        sycl::accessor key(*src_keys, cgh, sycl::read_only);
+        sycl::accessor value(*src_values, cgh, sycl::read_only);
+        sycl::accessor offsets(*m_counts, cgh, sycl::read_only);
+        sycl::accessor out_key(*dst_keys, cgh, sycl::write_only);
+        sycl::accessor out_value(*dst_values, cgh, sycl::write_only);
+
+        cgh.parallel_for<radix_scatter_kernel>(
+            sycl::range<1>(n_blocks), [=](sycl::item<1> item) {
+              auto block = item.get_linear_id();
+              uint32_t next[RADIX];
+              for (uint32_t d = 0; d < RADIX; d++) {
+                next[d] = offsets[d * n_blocks + block];
+              }
+              auto end = sycl::min((block + 1) * BLOCK, n);
+              for (auto i = block * BLOCK; i < end; i++) {
+                auto slot = next[(key[i] >> shift) & (RADIX - 1)]++;
+                out_key[slot] = key[i];
+                out_value[slot] = value[i];
+              }
+            });
+      });
+
+      std::swap(src_keys, dst_keys);
+      std::swap(src_values, dst_values);
+    }
+
+    // An odd number of passes leaves the result in the temporaries
+    if (src_keys != &keys) {
+      q.submit("radix keys copy", [&](sycl::handler& cgh) {
+        sycl::accessor from(*src_keys, cgh, sycl::range<1>(n),
+                            sycl::read_only);
+        sycl::accessor to(keys, cgh, sycl::range<1>(n), sycl::write_only);
+        cgh.copy(from, to);
+      });
+      q.submit("radix values copy", [&](sycl::handler& cgh) {
+        sycl::accessor from(*src_values, cgh, sycl::range<1>(n),
+                            sycl::read_only);
+        sycl::accessor to(values, cgh, sycl::range<1>(n), sycl::write_only);
+        cgh.copy(from, to);
+      });
+    }
+  }
+};
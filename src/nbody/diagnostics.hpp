@@ -0,0 +1,146 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Energy and momentum of the NBody simulation, summed on the device.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstddef>
+
+// Template to generate unique kernel name types
+template <typename T, size_t Z>
+class diagnostics_kernel {};
+
+// Conserved quantities of all bodies, which have unit mass
+template <typename num_t>
+struct diagnostics_report {
+  num_t kinetic_energy;
+  num_t potential_energy;
+  vec3<num_t> momentum;
+  vec3<num_t> angular_momentum;
+  // Steps taken before the quantities were computed
+  size_t step;
+
+  num_t energy() const { return kinetic_energy + potential_energy; }
+};
+
+/* Sums the kinetic energy, linear and angular momentum of the bodies with
+ * sycl::reduction, and their potential energy with a direct sum over all
+ * pairs. The sums stay in device buffers until read() is called, so passes
+ * can be enqueued between steps without waiting for them. The potential
+ * energy always takes a direct sum, which costs as much as an Euler step of
+ * the direct sum solver. */
+template <typename num_t>
+class Diagnostics {
+  // Kinetic and potential energy, then the momentum and angular momentum
+  // components
+  sycl::buffer<num_t, 1> m_sums[8] = {
+      sycl::buffer<num_t, 1>(1), sycl::buffer<num_t, 1>(1),
+      sycl::buffer<num_t, 1>(1), sycl::buffer<num_t, 1>(1),
+      sycl::buffer<num_t, 1>(1), sycl::buffer<num_t, 1>(1),
+      sycl::buffer<num_t, 1>(1), sycl::buffer<num_t, 1>(1)};
+
+  size_t m_step = 0;
+
+  auto sum(size_t i, sycl::handler& cgh) {
+    return sycl::reduction(m_sums[i], cgh, sycl::plus<num_t>(),
+                           sycl::property::reduction::initialize_to_identity{});
+  }
+
+ public:
+  /* Enqueues the sums for the bodies in `vel` and `pos` after `step` steps.
+   * `charges`, if not null, holds the weights passed to the potential of
+   * `force`, otherwise all weights are one. */
+  template <size_t ForceId, typename Force>
+  void submit(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& vel,
+               sycl::buffer<vec3<num_t>, 1>& pos, Force force,
+               sycl::buffer<num_t, 1>* charges, size_t step) {
+    m_step = step;
+    size_t n_bodies = pos.size();
+
+    q.submit("diagnostics kinetic", [&](sycl::handler& cgh) {
+      sycl::accessor v(vel, cgh, sycl::read_only);
+      sycl::accessor x(pos, cgh, sycl::read_only);
+
+      cgh.parallel_for<diagnostics_kernel<num_t, 0>>(
+          sycl::range<1>(n_bodies), sum(0, cgh), sum(2, cgh), sum(3, cgh),
+          sum(4, cgh), sum(5, cgh), sum(6, cgh), sum(7, cgh),
+          [=](sycl::item<1> item, auto& kinetic, auto& px, auto& py,
+              auto& pz, auto& lx, auto& ly, auto& lz) {
+            auto const vi = v[item];
+            auto const l = sycl::cross(x[item], vi);
+            kinetic.combine(num_t(.5) * sycl::dot(vi, vi));
+            px.combine(vi.x());
+            py.combine(vi.y());
+            pz.combine(vi.z());
+            lx.combine(l.x());
+            ly.combine(l.y());
+            lz.combine(l.z());
+          });
+    });
+
+    q.submit("diagnostics potential", [&](sycl::handler& cgh) {
+      sycl::accessor x(pos, cgh, sycl::read_only);
+
+      // Every pair is visited from both ends, hence the factor of a half
+      if (charges) {
+        sycl::accessor w(*charges, cgh, sycl::read_only);
+        cgh.parallel_for<diagnostics_kernel<num_t, 1 + ForceId>>(
+            sycl::range<1>(n_bodies), sum(1, cgh),
+            [=](sycl::item<1> item, auto& potential) {
+              auto id = item.get_linear_id();
+              num_t u = 0;
+              for (size_t j = 0; j < n_bodies; j++) {
+                u += force.potential(x[j] - x[id], w[j], j == id);
+              }
+              potential.combine(num_t(.5) * force.total_potential(u, w[id]));
+            });
+      } else {
+        cgh.parallel_for<diagnostics_kernel<num_t, 4 + ForceId>>(
+            sycl::range<1>(n_bodies), sum(1, cgh),
+            [=](sycl::item<1> item, auto& potential) {
+              auto id = item.get_linear_id();
+              num_t u = 0;
+              for (size_t j = 0; j < n_bodies; j++) {
+                u += force.potential(x[j] - x[id], num_t(1), j == id);
+              }
+              potential.combine(num_t(.5) *
+                                force.total_potential(u, num_t(1)));
+            });
+      }
+    });
+  }
+
+  // Blocks until the last submitted sums are available
+  diagnostics_report<num_t> read() {
+    num_t values[8];
+    for (size_t i = 0; i < 8; i++) {
+      values[i] = m_sums[i].get_host_access(sycl::read_only)[0];
+    }
+    return {values[0],
+            values[1],
+            {values[2], values[3], values[4]},
+            {values[5], values[6], values[7]},
+            m_step};
+  }
+};
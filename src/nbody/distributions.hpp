@@ -0,0 +1,127 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Initial body distributions shared by the NBody simulation backends.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "forces.hpp"
+#include "philox.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+#include <random>
+
+// Initial cylinder distribution parameters
+template <typename num_t>
+struct distrib_cylinder {
+  sycl::vec<num_t, 2> radius;
+  sycl::vec<num_t, 2> angle;
+  sycl::vec<num_t, 2> height;
+  num_t speed;
+};
+
+// Data describing a single charged particle
+template <typename num_t>
+struct particle_data {
+  num_t charge;
+  sycl::vec<num_t, 3> pos;
+};
+
+// Initial sphere distribution parameters
+template <typename num_t>
+struct distrib_sphere {
+  sycl::vec<num_t, 2> radius;
+};
+
+// A fresh seed for the distributions below, different on every call
+inline uint64_t random_seed() {
+  std::random_device rd;
+  return (uint64_t(rd()) << 32) | rd();
+}
+
+/* The distributions below sample every body from its own Philox counter, so
+ * any subset of bodies can be generated independently, in a kernel or on
+ * the host, with the same result for the same seed. */
+
+// Velocity and position of body `id` of a cylinder distribution
+template <typename num_t>
+void sample_body(uint64_t seed, size_t id,
+                 const distrib_cylinder<num_t>& params, vec3<num_t>& vel,
+                 vec3<num_t>& pos) {
+  // Points uniformly distributed in a cylinder using cylindrical polar
+  // coordinates
+  auto u = philox_uniform<num_t>(seed, id);
+  auto rmin = params.radius.x();
+  auto rmax = params.radius.y();
+  auto r = sycl::sqrt(rmin * rmin + u[0] * (rmax * rmax - rmin * rmin));
+  auto phi = params.angle.x() + u[1] * (params.angle.y() - params.angle.x());
+  auto y = params.height.x() + u[2] * (params.height.y() - params.height.x());
+
+  // Velocity tangential to the circular cylinder slice is given
+  // by the derivative of position w.r.t phi
+  vel = {-r * sycl::sin(phi), num_t(0), r * sycl::cos(phi)};
+  // Adjust to make chosen speed the speed of outermost bodies
+  vel *= params.speed / params.radius.y();
+  pos = {r * sycl::cos(phi), y, r * sycl::sin(phi)};
+}
+
+// Velocity and position of body `id` of a spherical shell distribution
+template <typename num_t>
+void sample_body(uint64_t seed, size_t id, const distrib_sphere<num_t>& params,
+                 vec3<num_t>& vel, vec3<num_t>& pos) {
+  // Uniform spherical distribution from spherical coordinates
+  auto u = philox_uniform<num_t>(seed, id);
+  auto rmin = params.radius.x();
+  auto rmax = params.radius.y();
+  auto r = sycl::pow(rmin * rmin * rmin +
+                         u[0] * (rmax * rmax * rmax - rmin * rmin * rmin),
+                     num_t(1) / num_t(3));
+  auto cost = num_t(2) * u[1] - num_t(1);
+  auto sint = sycl::sqrt(1 - cost * cost);
+  auto phi = u[2] * num_t(2 * 3.141592653589793);
+
+  // Spherical distribution gives no initial velocity to bodies
+  vel = {0, 0, 0};
+  pos = {r * sint * sycl::cos(phi), r * sint * sycl::sin(phi), r * cost};
+}
+
+// Dummy class to generate unique kernel name types
+template <typename num_t, template <typename> class Distrib>
+class sample_distrib_kernel;
+
+/* Samples `count` bodies of the given distribution starting with body
+ * `first` on the device, one work-item each, into the USM allocations
+ * vel[k] and pos[k] for body first + k */
+template <typename num_t, template <typename> class Distrib>
+sycl::event submit_sample_distrib(sycl::queue& q, Distrib<num_t> params,
+                                  uint64_t seed, size_t first, size_t count,
+                                  vec3<num_t>* vel, vec3<num_t>* pos) {
+  return q.submit([&](sycl::handler& cgh) {
+    cgh.parallel_for<sample_distrib_kernel<num_t, Distrib>>(
+        sycl::range<1>(count), [=](sycl::item<1> item) {
+          auto k = item.get_linear_id();
+          vec3<num_t> v;
+          vec3<num_t> x;
+          sample_body(seed, first + k, params, v, x);
+          vel[k] = v;
+          pos[k] = x;
+        });
+  });
+}
@@ -0,0 +1,132 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Three-dimensional complex FFT on a cubic grid for the NBody demo.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cstdint>
+#include <stdexcept>
+
+// Complex numbers as (real, imaginary) pairs
+template <typename num_t>
+using complex_t = sycl::vec<num_t, 2>;
+
+template <typename num_t>
+complex_t<num_t> complex_mul(complex_t<num_t> a, complex_t<num_t> b) {
+  return {a.x() * b.x() - a.y() * b.y(), a.x() * b.y() + a.y() * b.x()};
+}
+
+// Dummy class to generate unique kernel name types
+template <typename num_t, int Sign>
+class fft_kernel;
+
+/* Unnormalised in-place FFT of a K x K x K grid stored as (z * K + y) * K + x,
+ * with K a power of two. The transform with Sign s computes
+ *
+ *   out[m] = sum_k in[k] exp(s * 2 pi i m.k / K)
+ *
+ * one axis at a time. Every work-item transforms a whole line of the grid
+ * with an iterative radix-2 Cooley-Tukey FFT, which is plenty for the grid
+ * sizes used by the particle-mesh solver, where K^2 lines keep the device
+ * busy. */
+template <typename num_t>
+class GridFFT {
+  uint32_t m_size;
+  uint32_t m_log_size;
+
+ public:
+  explicit GridFFT(uint32_t size) : m_size(size), m_log_size(0) {
+    if (size < 2 || (size & (size - 1)) != 0) {
+      throw std::runtime_error("The FFT size must be a power of two!");
+    }
+    while ((1u << m_log_size) < size) {
+      m_log_size++;
+    }
+  }
+
+  uint32_t size() const { return m_size; }
+
+  template <int Sign>
+  void transform(ProfiledQueue q, sycl::buffer<complex_t<num_t>, 1>& grid) {
+    static_assert(Sign == 1 || Sign == -1, "The sign must be 1 or -1");
+    for (uint32_t axis = 0; axis < 3; axis++) {
+      transform_axis<Sign>(q, grid, axis);
+    }
+  }
+
+ private:
+  template <int Sign>
+  void transform_axis(ProfiledQueue q, sycl::buffer<complex_t<num_t>, 1>& grid,
+                       uint32_t axis) {
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    uint32_t n = m_size;
+    uint32_t log_n = m_log_size;
+    // Distance between consecutive elements of a line, and between the lines
+    // along the two other axes
+    uint32_t stride = axis == 0 ? 1 : axis == 1 ? n : n * n;
+    uint32_t stride_a = axis == 0 ? n : 1;
+    uint32_t stride_b = axis == 2 ? n : n * n;
+
+    q.submit("fft axis", [&](sycl::handler& cgh) {
+      sycl::accessor data(grid, cgh, sycl::read_write);
+
+      cgh.parallel_for<fft_kernel<num_t, Sign>>(
+          sycl::range<2>(n, n), [=](sycl::item<2> item) {
+            uint32_t base = uint32_t(item.get_id(0)) * stride_b +
+                            uint32_t(item.get_id(1)) * stride_a;
+            const auto at = [&](uint32_t i) -> complex_t<num_t>& {
+              return data[base + i * stride];
+            };
+
+            // Bit-reversal permutation
+            for (uint32_t i = 0; i < n; i++) {
+              uint32_t j = 0;
+              for (uint32_t b = 0; b < log_n; b++) {
+                j |= ((i >> b) & 1u) << (log_n - 1 - b);
+              }
+              if (i < j) {
+                auto tmp = at(i);
+                at(i) = at(j);
+                at(j) = tmp;
+              }
+            }
+
+            // Butterflies of doubling length
+            for (uint32_t len = 2; len <= n; len *= 2) {
+              num_t angle =
+                  num_t(Sign) * num_t(2 * 3.141592653589793) / num_t(len);
+              for (uint32_t start = 0; start < n; start += len) {
+                for (uint32_t k = 0; k < len / 2; k++) {
+                  complex_t<num_t> w{sycl::cos(angle * num_t(k)),
+                                     sycl::sin(angle * num_t(k))};
+                  auto u = at(start + k);
+                  auto v = complex_mul(at(start + k + len / 2), w);
+                  at(start + k) = u + v;
+                  at(start + k + len / 2) = u - v;
+                }
+              }
+            }
+          });
+    });
+  }
+};
@@ -0,0 +1,176 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Pairwise interaction models for the NBody demo.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <cstddef>
+
+// Convenience types
+template <typename num_t>
+using vec3 = sycl::vec<num_t, 3>;
+
+/* Each force model provides two functions which together give the
+ * acceleration of body i as total(sum over j of pair(x_j - x_i, w_j, i == j),
+ * w_i), where w is the per-body weight (mass or charge). Keeping the model
+ * separate from the loop over bodies lets every kernel variant share it.
+ *
+ * FLOPS is the number of floating point operations of one pair interaction,
+ * including forming x_j - x_i and accumulating the result, with square
+ * roots, divisions and powers counted as a single operation.
+ *
+ * Likewise, the potential energy of body i is
+ * total_potential(sum over j of potential(x_j - x_i, w_j, i == j), w_i),
+ * which counts every pair from both ends.
+ *
+ * specialise(cgh) stores the parameters of a model in the specialisation
+ * constants below, and specialised_force() rebuilds the model from them inside
+ * the kernel, so that the JIT compiler sees them as constants. */
+
+inline constexpr sycl::specialization_id<bool> forces_specialised(false);
+
+template <typename num_t>
+inline constexpr sycl::specialization_id<num_t> gravity_G_spec(0);
+
+template <typename num_t>
+inline constexpr sycl::specialization_id<num_t> gravity_damping_spec(0);
+
+template <typename num_t>
+inline constexpr sycl::specialization_id<num_t> lennard_jones_A_spec(0);
+
+// Softened Newtonian gravity between bodies of unit mass
+template <typename num_t>
+struct gravity_force {
+  static constexpr size_t FLOPS = 20;
+
+  num_t G;
+  num_t damping;
+
+  vec3<num_t> pair(vec3<num_t> diff, num_t, bool self) const {
+    auto const r = sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z());
+    return diff / (r * r * r + num_t(1e24) * num_t(self) + damping);
+  }
+
+  vec3<num_t> total(vec3<num_t> acc, num_t) const { return G * acc; }
+
+  // Leaves out the damping, which only matters for very close bodies
+  num_t potential(vec3<num_t> diff, num_t, bool self) const {
+    auto const r = sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z());
+    return num_t(-1) / (r + num_t(1e24) * num_t(self));
+  }
+
+  num_t total_potential(num_t sum, num_t) const { return G * sum; }
+
+  void specialise(sycl::handler& cgh) const {
+    cgh.set_specialization_constant<forces_specialised>(true);
+    cgh.set_specialization_constant<gravity_G_spec<num_t>>(G);
+    cgh.set_specialization_constant<gravity_damping_spec<num_t>>(damping);
+  }
+
+  static gravity_force specialised(sycl::kernel_handler& kh) {
+    return {kh.get_specialization_constant<gravity_G_spec<num_t>>(),
+            kh.get_specialization_constant<gravity_damping_spec<num_t>>()};
+  }
+};
+
+// Lennard-Jones potential with A = 24 * eps * sigma
+template <typename num_t>
+struct lennard_jones_force {
+  static constexpr size_t FLOPS = 26;
+
+  num_t A;
+
+  vec3<num_t> pair(vec3<num_t> diff, num_t, bool self) const {
+    auto const r = sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z()) +
+                   num_t(1e24) * num_t(self);
+    return sycl::pow(r, num_t(-8)) * diff -
+           num_t(2) * sycl::pow(r, num_t(-14)) * diff;
+  }
+
+  vec3<num_t> total(vec3<num_t> acc, num_t) const { return A * acc; }
+
+  num_t potential(vec3<num_t> diff, num_t, bool self) const {
+    auto const r = sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z()) +
+                   num_t(1e24) * num_t(self);
+    return (sycl::pow(r, num_t(-12)) - sycl::pow(r, num_t(-6))) / num_t(6);
+  }
+
+  num_t total_potential(num_t sum, num_t) const { return A * sum; }
+
+  void specialise(sycl::handler& cgh) const {
+    cgh.set_specialization_constant<forces_specialised>(true);
+    cgh.set_specialization_constant<lennard_jones_A_spec<num_t>>(A);
+  }
+
+  static lennard_jones_force specialised(sycl::kernel_handler& kh) {
+    return {kh.get_specialization_constant<lennard_jones_A_spec<num_t>>()};
+  }
+};
+
+// Electrostatic interaction between charged particles of unit mass
+template <typename num_t>
+struct coulomb_force {
+  static constexpr size_t FLOPS = 22;
+
+  vec3<num_t> pair(vec3<num_t> diff, num_t charge, bool self) const {
+    auto const r = sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z());
+    return charge * diff / (r * r * r + num_t(1e24) * num_t(self));
+  }
+
+  vec3<num_t> total(vec3<num_t> acc, num_t my_charge) const {
+    return my_charge * acc;
+  }
+
+  num_t potential(vec3<num_t> diff, num_t charge, bool self) const {
+    auto const r = sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z());
+    return -charge / (r + num_t(1e24) * num_t(self));
+  }
+
+  num_t total_potential(num_t sum, num_t my_charge) const {
+    return my_charge * sum;
+  }
+
+  // Coulomb has no parameters to specialise
+  void specialise(sycl::handler&) const {}
+
+  static coulomb_force specialised(sycl::kernel_handler&) { return {}; }
+};
+
+// The force model rebuilt from the specialisation constants if `specialise`
+// was called for the kernel, or `force` otherwise
+template <typename Force>
+Force specialised_force(sycl::kernel_handler& kh, const Force& force) {
+  return kh.get_specialization_constant<forces_specialised>()
+             ? Force::specialised(kh)
+             : force;
+}
+
+// Weight function for forces which don't depend on a per-body quantity
+template <typename num_t>
+struct unit_weights {
+  num_t operator()(size_t) const { return num_t(1); }
+};
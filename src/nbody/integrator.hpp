@@ -20,85 +20,48 @@
 
 #pragma once
 
-#include "tuple_utils.hpp"
+/* Second order integration methods for a single body. Given a function
+ * `func` computing the acceleration from velocity, position and time, a time
+ * step size `step` and the velocity, position and time `t` at the start of
+ * the step, these update `vel` and `pos` in place. Working on plain values
+ * leaves only arithmetic for the compiler to vectorise. */
 
-/* Given a function `func` expressing a derivative of order N, a time step size
- * `step`,
- * and N+1 values `vals` with the initial conditions of y(N-1), .., y1, y, t, in
- * that order,
- * returns the new values of y(N-1), ..., y1, y, t after the step in a tuple.
- * Uses Runge-Kutta RK4 integration. */
-template <typename time_t, typename func_t, typename... Args>
-std::tuple<Args...> integrate_step_rk4(func_t func, time_t step, Args... vals) {
-  static_assert(sizeof...(Args) >= 2,
-                "Do you want infinite loops in your compiler? Because this is "
-                "how you get infinite loops in your compiler.");
-
-  // preserve the initial values
-  auto const init = std::make_tuple(vals...);
-  // arguments to the function describing the derivative: yN = f(y(N-1), .., y1,
-  // y, t)
-  // start with initial values
-  auto args = init;
-  // no addition to args here, since it's the first step
-
-  // k0s: yN, .., y1, 1.0
-  // these values will be added to args to advance them for a half step
-  // 1.0 is there at the end so that ks can be added to args without a special
-  // case for time
-  auto k0s =
-      std::tuple_cat(std::make_tuple(call(func, args)),
-                     squash_tuple<0, 2>(args), std::make_tuple(time_t(1)));
-
-  args = init;
-  // args to calculate k1s are obtained by adding k0s to initial values
-  args = add_tuples(args, mult_tuple(k0s, step / time_t(2)));
-  auto k1s =
-      std::tuple_cat(std::make_tuple(call(func, args)),
-                     squash_tuple<0, 2>(args), std::make_tuple(time_t(1)));
-
-  args = init;
-  // args to calculate k2s are obtained by adding k1s to initial values
-  args = add_tuples(args, mult_tuple(k1s, step / time_t(2)));
-  auto k2s =
-      std::tuple_cat(std::make_tuple(call(func, args)),
-                     squash_tuple<0, 2>(args), std::make_tuple(time_t(1)));
+// Euler integration
+template <typename time_t, typename func_t, typename vec_t>
+void integrate_step_euler(func_t func, time_t step, vec_t& vel, vec_t& pos,
+                          time_t t) {
+  vec_t const acc = func(vel, pos, t);
+  pos += vel * step;
+  vel += acc * step;
+}
 
-  args = init;
-  // args to calculate k3s are obtained by adding k2s to initial values
-  args = add_tuples(args, mult_tuple(k2s, step));
-  auto k3s =
-      std::tuple_cat(std::make_tuple(call(func, args)),
-                     squash_tuple<0, 2>(args), std::make_tuple(time_t(1)));
+// Runge-Kutta RK4 integration
+template <typename time_t, typename func_t, typename vec_t>
+void integrate_step_rk4(func_t func, time_t step, vec_t& vel, vec_t& pos,
+                        time_t t) {
+  time_t const half = step / time_t(2);
 
-  // calculate the new values from all ks using the formula y_(i+1) = y_i +
-  // step/6 * (k0 + 2*k1 + 2*k2 + k3)
-  auto final = add_tuples(k0s, mult_tuple(k1s, time_t(2)));
-  final = add_tuples(final, mult_tuple(k2s, time_t(2)));
-  final = add_tuples(final, std::move(k3s));
-  final = mult_tuple(final, step / time_t(6));
-  final = add_tuples(final, init);
+  vec_t const a0 = func(vel, pos, t);
+  vec_t const v1 = vel + a0 * half;
+  vec_t const a1 = func(v1, pos + vel * half, t + half);
+  vec_t const v2 = vel + a1 * half;
+  vec_t const a2 = func(v2, pos + v1 * half, t + half);
+  vec_t const v3 = vel + a2 * step;
+  vec_t const a3 = func(v3, pos + v2 * step, t + step);
 
-  return final;
+  time_t const sixth = step / time_t(6);
+  pos += (vel + v1 * time_t(2) + v2 * time_t(2) + v3) * sixth;
+  vel += (a0 + a1 * time_t(2) + a2 * time_t(2) + a3) * sixth;
 }
 
-/* Given a function `func` expressing a derivative of order N, a time step size
- * `step`,
- * and N+1 values `vals` with the initial conditions of y(N-1), .., y1, y, t, in
- * that order,
- * returns the new values of y(N-1), ..., y1, y, t after the step in a tuple.
- * Uses Euler integration. */
-template <typename time_t, typename func_t, typename... Args>
-std::tuple<Args...> integrate_step_euler(func_t func, time_t step, Args... vals
-                                         // TODO kmem ptr for temporary storage
-) {
-  static_assert(sizeof...(Args) >= 2,
-                "Do you want infinite loops in your compiler? Because this is "
-                "how you get infinite loops in your compiler.");
-
-  auto const init = std::make_tuple(vals...);
-  auto const to_add =
-      std::tuple_cat(std::make_tuple(call(func, init)),
-                     squash_tuple<0, 2>(init), std::make_tuple(time_t(1)));
-  return add_tuples(init, mult_tuple(to_add, step));
+/* Kick-drift-kick leapfrog with the closing half kick of one step merged into
+ * the opening half kick of the next, so every step evaluates `func` only
+ * once. `vel` is the velocity half a step before `t`, and becomes the velocity
+ * half a step after it. Being symplectic, it doesn't drift in energy over
+ * long runs. */
+template <typename time_t, typename func_t, typename vec_t>
+void integrate_step_leapfrog(func_t func, time_t step, vec_t& vel, vec_t& pos,
+                             time_t t) {
+  vel += func(vel, pos, t) * step;
+  pos += vel * step;
 }
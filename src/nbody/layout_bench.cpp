@@ -0,0 +1,147 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Compares the body data layouts of the NBody direct sum kernels.
+ *
+ **************************************************************************/
+
+#include "sim.hpp"
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <tuple>
+#include <vector>
+
+using num_t = float;
+
+// Lennard-Jones length scale of the benchmark
+constexpr num_t LJ_SIGMA = num_t(1e-3);
+
+// Bodies in a unit ball with alternating charges, for gravity and Coulomb
+static std::vector<particle_data<num_t>> random_ball(size_t n_bodies) {
+  std::mt19937 rng(42);
+  std::uniform_real_distribution<num_t> unif(-1, 1);
+  std::vector<particle_data<num_t>> particles(n_bodies);
+  for (size_t i = 0; i < n_bodies; i++) {
+    sycl::vec<num_t, 3> pos;
+    do {
+      pos = {unif(rng), unif(rng), unif(rng)};
+    } while (pos.x() * pos.x() + pos.y() * pos.y() + pos.z() * pos.z() > 1);
+    particles[i] = {num_t(i % 2 ? 1 : -1), pos};
+  }
+  return particles;
+}
+
+// Bodies on a cubic lattice at the minimum of the Lennard-Jones potential.
+// In the random ball, close pairs blow the system up within a few steps.
+static std::vector<particle_data<num_t>> lj_lattice(size_t n_bodies) {
+  auto side = size_t(std::ceil(std::cbrt(double(n_bodies))));
+  num_t spacing = std::pow(num_t(2), num_t(1) / num_t(6)) * LJ_SIGMA;
+  num_t centre = num_t(side - 1) / num_t(2);
+  std::vector<particle_data<num_t>> particles(n_bodies);
+  for (size_t i = 0; i < n_bodies; i++) {
+    sycl::vec<num_t, 3> cell{num_t(i % side), num_t(i / side % side),
+                             num_t(i / (side * side))};
+    particles[i] = {num_t(i % 2 ? 1 : -1), (cell - centre) * spacing};
+  }
+  return particles;
+}
+
+int main(int argc, char** argv) {
+  size_t n_bodies = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16384;
+  size_t n_steps = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10;
+  if (n_bodies == 0 || n_steps == 0) {
+    std::fprintf(stderr, "Usage: %s [n_bodies] [n_steps]\n", argv[0]);
+    return 1;
+  }
+
+  const auto ball = random_ball(n_bodies);
+  const auto lattice = lj_lattice(n_bodies);
+
+  const std::array<std::pair<force_t, const char*>, 3> forces = {
+      {{force_t::GRAVITY, "gravity"},
+       {force_t::LENNARD_JONES, "lennard-jones"},
+       {force_t::COULOMB, "coulomb"}}};
+  const std::array<std::pair<kernel_t, const char*>, 3> kernels = {
+      {{kernel_t::NAIVE, "naive"},
+       {kernel_t::TILED, "tiled"},
+       {kernel_t::SYMMETRIC, "symmetric"}}};
+  const std::array<std::pair<layout_t, const char*>, 3> layouts = {
+      {{layout_t::VEC3, "vec3"},
+       {layout_t::PACKED, "packed"},
+       {layout_t::SOA, "soa"}}};
+
+  // Average step time in seconds of the given settings, on a new simulation
+  // so that every measurement starts from the same bodies
+  const auto time_steps = [&](force_t force, kernel_t kernel, layout_t layout,
+                              bool specialise) {
+    auto particles = force == force_t::LENNARD_JONES ? lattice : ball;
+    GravSim<num_t> sim(n_bodies, std::move(particles));
+    sim.set_lj_sigma(LJ_SIGMA);
+    sim.set_force_type(force);
+    sim.set_kernel(kernel);
+    sim.set_layout(layout);
+    sim.set_specialise_forces(specialise);
+
+    // Warm up, so kernel compilation and allocations aren't timed
+    sim.step();
+    sim.sync_queue();
+
+    auto tstart = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < n_steps; i++) {
+      sim.step();
+    }
+    sim.sync_queue();
+    auto tend = std::chrono::high_resolution_clock::now();
+
+    return std::make_tuple(
+        std::chrono::duration<double>(tend - tstart).count() / double(n_steps),
+        sim.interactions_per_step(), sim.bytes_per_interaction());
+  };
+
+  std::printf("%zu bodies, %zu steps per measurement\n", n_bodies, n_steps);
+  std::printf("%-14s %-9s %-7s %12s %16s %12s %10s %12s %8s\n", "force",
+              "kernel", "layout", "step [ms]", "interactions/s",
+              "B/interact.", "GB/s", "spec. [ms]", "gain");
+
+  for (auto const& force : forces) {
+    for (auto const& kernel : kernels) {
+      for (auto const& layout : layouts) {
+        auto [step_time, n_interactions, bytes] =
+            time_steps(force.first, kernel.first, layout.first, false);
+
+        // The same kernels with the force parameters in specialisation
+        // constants
+        double spec_time = std::get<0>(
+            time_steps(force.first, kernel.first, layout.first, true));
+
+        double interactions = double(n_interactions) / step_time;
+
+        std::printf(
+            "%-14s %-9s %-7s %12.3f %16.4e %12.3f %10.2f %12.3f %7.2fx\n",
+            force.second, kernel.second, layout.second, step_time * 1e3,
+            interactions, bytes, interactions * bytes * 1e-9, spec_time * 1e3,
+            step_time / spec_time);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -19,7 +19,9 @@
  **************************************************************************/
 
 #include "InteropGLBuffer.hpp"
+#include "particle_loader.hpp"
 #include "sim.hpp"
+#include "sim_thread.hpp"
 
 #include <Corrade/PluginManager/Manager.h>
 #include <Corrade/Utility/Resource.h>
@@ -46,8 +48,11 @@
 
 #include <sycl/sycl.hpp>
 
+#include <algorithm>
+#include <array>
 #include <chrono>
-#include <fstream>
+#include <memory>
+#include <vector>
 
 using num_t = float;
 constexpr num_t PI{3.141592653589793238462643383279502884197169399};
@@ -131,7 +136,19 @@ class NBodyApp : public Magnum::Platform::Application {
 
   int32_t m_ui_n_bodies = 1024;
 
-  const int32_t m_num_updates_per_frame = 1;
+  // Seed of the distributions, 0 picks a new one on every initialization
+  int32_t m_ui_seed = 0;
+
+  // Steps computed between two snapshots, chosen by the simulation thread
+  // in adaptive mode
+  int32_t m_ui_steps_per_batch = 1;
+
+  // Whether to fit as many steps between snapshots as the budget allows
+  bool m_ui_adaptive_steps = false;
+
+  // Simulation time between snapshots targeted in adaptive mode
+  float m_ui_batch_budget_ms = 12;
+
   int32_t m_num_updates = 0;
 
   // Whether 'initialize' was clicked
@@ -160,6 +177,8 @@ class NBodyApp : public Magnum::Platform::Application {
   struct {
     float eps = 1;
     float lg_sigma = -5;
+    float cutoff = 2.5;
+    float skin = 0.5;
   } m_ui_force_lj_params;
 
   std::array<char, 256> m_ui_force_coulomb_file;
@@ -168,9 +187,70 @@ class NBodyApp : public Magnum::Platform::Application {
   enum {
     UI_INTEGRATOR_EULER = 0,
     UI_INTEGRATOR_RK4 = 1,
+    UI_INTEGRATOR_LEAPFROG = 2,
+    UI_INTEGRATOR_VELOCITY_VERLET = 3,
+    UI_INTEGRATOR_BLOCK_LEAPFROG = 4,
   };
   int32_t m_ui_integrator_id = UI_INTEGRATOR_EULER;
 
+  // Block time step settings
+  int32_t m_ui_block_max_rung = 4;
+  float m_ui_block_lg_eta = -2;
+
+  // Force kernel choice
+  enum {
+    UI_KERNEL_NAIVE = 0,
+    UI_KERNEL_TILED = 1,
+    UI_KERNEL_SYMMETRIC = 2,
+  };
+  int32_t m_ui_kernel_id = UI_KERNEL_NAIVE;
+
+  // Body data layout choice
+  enum {
+    UI_LAYOUT_VEC3 = 0,
+    UI_LAYOUT_PACKED = 1,
+    UI_LAYOUT_SOA = 2,
+  };
+  int32_t m_ui_layout_id = UI_LAYOUT_VEC3;
+
+  // Whether to sum forces in double precision, if the device supports it
+  bool m_ui_double_accum = false;
+
+  // Whether to compile the force parameters into the direct sum kernels
+  bool m_ui_specialise_forces = false;
+
+  // Solver choice
+  enum {
+    UI_SOLVER_DIRECT = 0,
+    UI_SOLVER_BARNES_HUT = 1,
+    UI_SOLVER_CELL_LIST = 2,
+    UI_SOLVER_NEIGHBOUR_LIST = 3,
+    UI_SOLVER_PME = 4,
+  };
+  int32_t m_ui_solver_id = UI_SOLVER_DIRECT;
+
+  // Barnes-Hut opening angle
+  float m_ui_bh_theta = 0.5;
+
+  // Particle-mesh Ewald periodic box, short-range cutoff and mesh size
+  struct {
+    float box = 50;
+    float cutoff = 6.25;
+    int32_t lg_grid = 6;
+  } m_ui_pme_params;
+
+  // Whether the user has requested a Barnes-Hut accuracy check
+  bool m_ui_check_accuracy = false;
+
+  // Whether to sum the energy and momentum on the device every few steps
+  bool m_ui_diagnostics = false;
+
+  // Whether to record the device execution time of every kernel
+  bool m_ui_profile = false;
+
+  // Steps between sorting the bodies along a Morton curve, 0 never sorts
+  int32_t m_ui_reorder_every = 0;
+
   // -- PROGRAM VARIABLES --
   size_t m_n_bodies = m_ui_n_bodies;
 
@@ -182,8 +262,30 @@ class NBodyApp : public Magnum::Platform::Application {
   NBodyShader m_shader;
   Magnum::ImGuiIntegration::Context m_imgui{Magnum::NoCreate};
 
-  // The simulation
-  GravSim<num_t> m_sim;
+  // The simulation, stepped on its own thread. Frames draw the latest
+  // snapshot it published, so they never wait for the steps.
+  std::unique_ptr<SimThread<num_t>> m_sim_thread = nullptr;
+  bool m_supports_doubles;
+
+  // Latest energy and momentum read back, and the energy of the first
+  // reading since initialization to measure the drift against
+  diagnostics_report<num_t> m_diagnostics{};
+  num_t m_initial_energy = 0;
+  bool m_have_initial_energy = false;
+
+  // Smoothed host time spent submitting a batch of steps, and device time
+  // spent running their kernels, while profiling
+  double m_submit_ms = 0;
+  double m_kernel_ms = 0;
+  std::vector<kernel_stats> m_kernel_stats;
+
+  // Coulomb simulation being loaded in the background. The window stays
+  // responsive meanwhile, but no steps are taken until it's ready.
+  std::unique_ptr<ParticleLoader<num_t>> m_coulomb_loader = nullptr;
+
+  // Loads abandoned for another initialization. Destroying a loader waits
+  // for it, so they are only dropped once they have finished.
+  std::vector<std::unique_ptr<ParticleLoader<num_t>>> m_discarded_loaders;
 
  public:
   NBodyApp(const Arguments& arguments)
@@ -197,7 +299,8 @@ class NBodyApp : public Magnum::Platform::Application {
                             GLConfiguration::Flag::QuietLog)},
         m_imgui{Magnum::Vector2{windowSize()} / dpiScaling(), windowSize(),
                 framebufferSize()},
-        m_sim(m_n_bodies, distrib_cylinder<num_t>{}) {
+        m_supports_doubles(
+            supports_doubles(sycl::device(sycl::default_selector_v))) {
     const Corrade::Utility::Resource rs{"nbody-data"};
     Corrade::PluginManager::Manager<Magnum::Trade::AbstractImporter> manager;
     auto importer{manager.loadAndInstantiate("AnyImageImporter")};
@@ -236,39 +339,231 @@ class NBodyApp : public Magnum::Platform::Application {
   }
 
   // Initializes the GL buffer for star position data with the current number of
-  // bodies
+  // bodies. Mapped persistently, it holds every snapshot of the simulation
+  // thread, which copies the bodies straight into it.
   void init_gl_bufs() {
     const size_t arraySize{m_n_bodies * sizeof(sycl::vec<num_t, 3>)};
-    m_vbo = InteropGLBuffer<char>{2 * arraySize};
+    const size_t slots{InteropGLBuffer<char>::mapsPersistently()
+                           ? SimThread<num_t>::N_SNAPSHOTS
+                           : 1};
+    m_vbo = InteropGLBuffer<char>{slots * 2 * arraySize, slots};
     m_mesh = Magnum::GL::Mesh{Magnum::GL::MeshPrimitive::Points};
     m_mesh.setCount(m_n_bodies);
   }
 
+  // Folds the timings of the batch that produced `snapshot` into the
+  // smoothed averages
+  void update_profile(const sim_snapshot<num_t>& snapshot) {
+    if (!m_ui_profile || snapshot.batch_steps == 0) {
+      return;
+    }
+    m_submit_ms = 0.9 * m_submit_ms + 0.1 * snapshot.submit_ms;
+    m_kernel_ms = 0.9 * m_kernel_ms + 0.1 * snapshot.kernel_ms;
+    m_kernel_stats = snapshot.kernels;
+  }
+
+  // Starts stepping `sim` on its own thread in place of the previous one
+  void start_sim(GravSim<num_t> sim) {
+    // Stops the previous thread first, which may still write its snapshots
+    // into the buffer replaced below
+    m_sim_thread = nullptr;
+    m_n_bodies = sim.n_bodies();
+    init_gl_bufs();
+
+    // Snapshots go to the mapped buffer, otherwise to host USM
+    std::array<sycl::vec<num_t, 3>*, SimThread<num_t>::N_SNAPSHOTS> storage{};
+    if (m_vbo.isMapped()) {
+      const size_t arraySize{m_n_bodies * sizeof(sycl::vec<num_t, 3>)};
+      for (size_t i = 0; i < storage.size(); i++) {
+        storage[i] = reinterpret_cast<sycl::vec<num_t, 3>*>(
+            m_vbo.getStorage() + i * 2 * arraySize);
+      }
+    }
+    m_sim_thread =
+        std::make_unique<SimThread<num_t>>(std::move(sim), storage);
+    m_diagnostics = {};
+    m_have_initial_energy = false;
+  }
+
+  // Applies the settings of the UI to the simulation
+  void configure_sim(GravSim<num_t>& sim) {
+    // Update force parameters
+    switch (m_ui_force_id) {
+      case UI_FORCE_GRAVITY: {
+        sim.set_grav_G(sycl::pow(num_t(10), m_ui_force_gravity_params.lg_G));
+        sim.set_grav_damping(
+            sycl::pow(num_t(10), m_ui_force_gravity_params.lg_damping));
+        sim.set_force_type(force_t::GRAVITY);
+      } break;
+
+      case UI_FORCE_LJ: {
+        sim.set_lj_eps(m_ui_force_lj_params.eps);
+        sim.set_lj_sigma(sycl::pow(num_t(10), m_ui_force_lj_params.lg_sigma));
+        sim.set_force_type(force_t::LENNARD_JONES);
+      } break;
+
+      case UI_FORCE_COULOMB: {
+        sim.set_force_type(force_t::COULOMB);
+      } break;
+
+      default:
+        throw "unreachable";
+    }
+
+    // Update integration method
+    switch (m_ui_integrator_id) {
+      case UI_INTEGRATOR_EULER: {
+        sim.set_integrator(integrator_t::EULER);
+      } break;
+
+      case UI_INTEGRATOR_RK4: {
+        sim.set_integrator(integrator_t::RK4);
+      } break;
+
+      case UI_INTEGRATOR_LEAPFROG: {
+        sim.set_integrator(integrator_t::LEAPFROG);
+      } break;
+
+      case UI_INTEGRATOR_VELOCITY_VERLET: {
+        sim.set_integrator(integrator_t::VELOCITY_VERLET);
+      } break;
+
+      case UI_INTEGRATOR_BLOCK_LEAPFROG: {
+        sim.set_integrator(integrator_t::BLOCK_LEAPFROG);
+        sim.set_block_steps(uint32_t(m_ui_block_max_rung),
+                            sycl::pow(num_t(10), num_t(m_ui_block_lg_eta)));
+      } break;
+
+      default:
+        throw "unreachable";
+    }
+
+    // Update force kernel variant
+    switch (m_ui_kernel_id) {
+      case UI_KERNEL_NAIVE: {
+        sim.set_kernel(kernel_t::NAIVE);
+      } break;
+
+      case UI_KERNEL_TILED: {
+        sim.set_kernel(kernel_t::TILED);
+      } break;
+
+      case UI_KERNEL_SYMMETRIC: {
+        // The symmetric kernel can't evaluate RK4's intermediate stages
+        sim.set_kernel(m_ui_integrator_id == UI_INTEGRATOR_RK4
+                             ? kernel_t::NAIVE
+                             : kernel_t::SYMMETRIC);
+      } break;
+
+      default:
+        throw "unreachable";
+    }
+
+    // Update body data layout
+    switch (m_ui_layout_id) {
+      case UI_LAYOUT_VEC3: {
+        sim.set_layout(layout_t::VEC3);
+      } break;
+
+      case UI_LAYOUT_PACKED: {
+        sim.set_layout(layout_t::PACKED);
+      } break;
+
+      case UI_LAYOUT_SOA: {
+        sim.set_layout(layout_t::SOA);
+      } break;
+
+      default:
+        throw "unreachable";
+    }
+
+    sim.set_double_accumulation(m_ui_double_accum && m_supports_doubles);
+    sim.set_specialise_forces(m_ui_specialise_forces);
+    sim.set_diagnostics_interval(m_ui_diagnostics ? 16 : 0);
+    sim.profiler().set_enabled(m_ui_profile);
+    sim.set_reorder_interval(size_t(m_ui_reorder_every));
+
+    // Update solver, Barnes-Hut only applies to gravity, the cell and
+    // neighbour lists only to Lennard-Jones and particle-mesh Ewald only to
+    // Coulomb
+    if (m_ui_integrator_id == UI_INTEGRATOR_BLOCK_LEAPFROG) {
+      // Block time steps only work with the direct sum
+      sim.set_solver(solver_t::DIRECT);
+    } else if (m_ui_force_id == UI_FORCE_GRAVITY &&
+               m_ui_solver_id == UI_SOLVER_BARNES_HUT) {
+      sim.set_solver(solver_t::BARNES_HUT);
+      sim.set_bh_theta(m_ui_bh_theta);
+    } else if (m_ui_force_id == UI_FORCE_LJ &&
+               m_ui_solver_id == UI_SOLVER_CELL_LIST) {
+      sim.set_solver(solver_t::CELL_LIST);
+      sim.set_lj_cutoff(m_ui_force_lj_params.cutoff);
+    } else if (m_ui_force_id == UI_FORCE_LJ &&
+               m_ui_solver_id == UI_SOLVER_NEIGHBOUR_LIST) {
+      sim.set_solver(solver_t::NEIGHBOUR_LIST);
+      sim.set_lj_cutoff(m_ui_force_lj_params.cutoff);
+      sim.set_lj_skin(m_ui_force_lj_params.skin);
+    } else if (m_ui_force_id == UI_FORCE_COULOMB &&
+               m_ui_solver_id == UI_SOLVER_PME) {
+      sim.set_solver(solver_t::PME);
+      sim.set_pme_box(m_ui_pme_params.box);
+      // The periodic cell list needs at least three cells along every side
+      sim.set_pme_cutoff(
+          std::min(m_ui_pme_params.cutoff, m_ui_pme_params.box / 3));
+      sim.set_pme_grid(1u << m_ui_pme_params.lg_grid);
+    } else {
+      sim.set_solver(solver_t::DIRECT);
+    }
+  }
+
+  // Takes one step and prints how long it took
+  void single_step(GravSim<num_t>& sim) {
+    sim.sync_queue();
+
+    // Measure submission, execution and sync
+    auto tstart = std::chrono::high_resolution_clock::now();
+    sim.step();
+    sim.sync_queue();
+    auto tend = std::chrono::high_resolution_clock::now();
+
+    // Convert to seconds
+    auto diff = tend - tstart;
+    auto sdiff = std::chrono::duration_cast<
+                     std::chrono::duration<num_t, std::ratio<1, 1>>>(diff)
+                     .count();
+
+    std::cout << "Time taken for step: " << sdiff << "s ("
+              << num_t(sim.interactions_per_step()) / sdiff
+              << " interactions/s)" << std::endl;
+
+    if (m_ui_profile) {
+      sim.profiler().collect_all();
+      std::cout << "Time spent in kernels: "
+                << sim.profiler().take_busy_ms() * 1e-3 << "s" << std::endl;
+    }
+  }
+
   void tickEvent() override {
     // Initialize simulation if requested in UI
-    if (m_ui_initialize) {
-      m_n_bodies = m_ui_n_bodies;
-
-      if (m_ui_force_id == UI_FORCE_COULOMB) {
+    if (m_ui_initialize && m_ui_force_id == UI_FORCE_COULOMB) {
+      if (!m_coulomb_loader) {
         printf("Loading Coulomb data from %s\n",
                m_ui_force_coulomb_file.data());
+        m_coulomb_loader = std::make_unique<ParticleLoader<num_t>>(
+            m_ui_force_coulomb_file.data());
+      }
+      m_ui_initialize = false;
+    } else if (m_ui_initialize) {
+      // A distribution replaces whatever was still being loaded
+      if (m_coulomb_loader) {
+        m_discarded_loaders.push_back(std::move(m_coulomb_loader));
+      }
 
-        // First line is the particle count
-        std::ifstream fin{m_ui_force_coulomb_file.data()};
-        fin >> m_n_bodies;
+      size_t n_bodies = m_ui_n_bodies;
+      uint64_t seed = m_ui_seed ? uint64_t(m_ui_seed) : random_seed();
 
-        // Following lines are particle data
-        std::vector<particle_data<num_t>> particles(m_n_bodies);
-        for (auto& particle : particles) {
-          num_t pos[3];
-          fin >> particle.charge >> pos[0] >> pos[1] >> pos[2];
-          particle.pos = {pos[0], pos[1], pos[2]};
-        }
-
-        m_sim = GravSim<num_t>(m_n_bodies, std::move(particles));
-      } else if (m_ui_distrib_id == UI_DISTRIB_CYLINDER) {
-        m_sim = GravSim<num_t>(
-            m_n_bodies,
+      if (m_ui_distrib_id == UI_DISTRIB_CYLINDER) {
+        start_sim(GravSim<num_t>(
+            n_bodies,
             distrib_cylinder<num_t>{
                 {m_ui_distrib_cylinder_params.min_radius,
                  m_ui_distrib_cylinder_params.max_radius},
@@ -276,85 +571,88 @@ class NBodyApp : public Magnum::Platform::Application {
                  m_ui_distrib_cylinder_params.max_angle_pis * PI},
                 {m_ui_distrib_cylinder_params.min_height,
                  m_ui_distrib_cylinder_params.max_height},
-                sycl::pow(num_t(10), m_ui_distrib_cylinder_params.lg_speed)});
+                sycl::pow(num_t(10), m_ui_distrib_cylinder_params.lg_speed)},
+            seed));
       } else if (m_ui_distrib_id == UI_DISTRIB_SPHERE) {
-        m_sim = GravSim<num_t>(
-            m_n_bodies,
+        start_sim(GravSim<num_t>(
+            n_bodies,
             distrib_sphere<num_t>{{m_ui_distrib_sphere_params.min_radius,
-                                   m_ui_distrib_sphere_params.max_radius}});
+                                   m_ui_distrib_sphere_params.max_radius}},
+            seed));
       }
 
-      init_gl_bufs();
-
       m_ui_initialize = false;
     }
 
-    if (!m_ui_paused || m_ui_step) {
-      // Update force parameters
-      switch (m_ui_force_id) {
-        case UI_FORCE_GRAVITY: {
-          m_sim.set_grav_G(
-              sycl::pow(num_t(10), m_ui_force_gravity_params.lg_G));
-          m_sim.set_grav_damping(
-              sycl::pow(num_t(10), m_ui_force_gravity_params.lg_damping));
-          m_sim.set_force_type(force_t::GRAVITY);
-        } break;
-
-        case UI_FORCE_LJ: {
-          m_sim.set_lj_eps(m_ui_force_lj_params.eps);
-          m_sim.set_lj_sigma(
-              sycl::pow(num_t(10), m_ui_force_lj_params.lg_sigma));
-          m_sim.set_force_type(force_t::LENNARD_JONES);
-        } break;
-
-        case UI_FORCE_COULOMB: {
-          m_sim.set_force_type(force_t::COULOMB);
-        } break;
-
-        default:
-          throw "unreachable";
+    // Polled whatever force is selected now, the load was started for
+    // Coulomb
+    if (m_coulomb_loader && m_coulomb_loader->ready()) {
+      try {
+        start_sim(m_coulomb_loader->get());
+      } catch (std::exception& e) {
+        printf("Failed to load Coulomb data: %s\n", e.what());
       }
+      m_coulomb_loader = nullptr;
+    }
+    m_discarded_loaders.erase(
+        std::remove_if(m_discarded_loaders.begin(), m_discarded_loaders.end(),
+                       [](const auto& loader) { return loader->ready(); }),
+        m_discarded_loaders.end());
+
+    if (m_sim_thread && !m_coulomb_loader) {
+      if (!m_ui_paused || m_ui_step) {
+        m_sim_thread->with_sim([&](GravSim<num_t>& sim) {
+          configure_sim(sim);
+          if (m_ui_step) {
+            single_step(sim);
+          }
+        });
+        if (m_ui_step) {
+          m_sim_thread->request_snapshot();
+        }
 
-      // Update integration method
-      switch (m_ui_integrator_id) {
-        case UI_INTEGRATOR_EULER: {
-          m_sim.set_integrator(integrator_t::EULER);
-        } break;
-
-        case UI_INTEGRATOR_RK4: {
-          m_sim.set_integrator(integrator_t::RK4);
-        } break;
-
-        default:
-          throw "unreachable";
+        // Make sure not to step until clicked again
+        m_ui_step = false;
       }
 
-      // Run simulation frame
-      if (m_ui_step) {
-        m_sim.sync_queue();
-
-        // Measure submission, execution and sync
-        auto tstart = std::chrono::high_resolution_clock::now();
-        m_sim.step();
-        m_sim.sync_queue();
-        auto tend = std::chrono::high_resolution_clock::now();
-
-        // Convert to seconds
-        auto diff = tend - tstart;
-        auto sdiff = std::chrono::duration_cast<
-                         std::chrono::duration<num_t, std::ratio<1, 1>>>(diff)
-                         .count();
-
-        std::cout << "Time taken for step: " << sdiff << "s" << std::endl;
+      if (m_ui_adaptive_steps) {
+        m_sim_thread->set_batch_budget(m_ui_batch_budget_ms);
+        m_ui_steps_per_batch = int32_t(m_sim_thread->steps_per_batch());
       } else {
-        for (int32_t step = 0; step < m_num_updates_per_frame; ++step) {
-          m_sim.step();
+        m_sim_thread->set_steps_per_batch(size_t(m_ui_steps_per_batch));
+      }
+      m_sim_thread->set_running(!m_ui_paused);
+
+      // Reading the sums back waits for the last pass, so only do it now
+      // and then. Passes run after every 16 steps, step 0 means none has run
+      // yet.
+      if (m_ui_diagnostics && m_num_updates % 30 == 0) {
+        m_diagnostics = m_sim_thread->with_sim(
+            [](GravSim<num_t>& sim) { return sim.diagnostics(); });
+        if (m_diagnostics.step > 0 && !m_have_initial_energy) {
+          m_initial_energy = m_diagnostics.energy();
+          m_have_initial_energy = true;
         }
       }
 
-      // Make sure not to step until clicked again
-      m_ui_step = false;
+      if (m_ui_check_accuracy) {
+        m_sim_thread->with_sim([&](GravSim<num_t>& sim) {
+          sim.set_grav_G(sycl::pow(num_t(10), m_ui_force_gravity_params.lg_G));
+          sim.set_grav_damping(
+              sycl::pow(num_t(10), m_ui_force_gravity_params.lg_damping));
+          sim.set_bh_theta(m_ui_bh_theta);
+
+          auto report = sim.check_barnes_hut_accuracy(1024);
+          std::cout << "Barnes-Hut error relative to direct sum over "
+                    << report.n_samples << " bodies: rms " << report.rms_error
+                    << ", max " << report.max_error << std::endl;
+        });
+      }
+    } else if (m_sim_thread) {
+      // No steps are taken while a new simulation is loading
+      m_sim_thread->set_running(false);
     }
+    m_ui_check_accuracy = false;
 
     m_num_updates++;
   }
@@ -375,21 +673,43 @@ class NBodyApp : public Magnum::Platform::Application {
         Magnum::GL::Renderer::BlendFunction::OneMinusSourceAlpha);
     Magnum::GL::Renderer::enable(Magnum::GL::Renderer::Feature::Blending);
 
-    // Update star buffer data with new positions
+    // Update star buffer data with the latest snapshot, if the simulation
+    // thread published a new one since the last frame
     const size_t arraySize{m_n_bodies * sizeof(sycl::vec<num_t, 3>)};
 
-    sycl::event::wait_and_throw(
-        {m_sim.copyTo<1>(m_vbo.getStorage()),
-         m_sim.copyTo<0>(m_vbo.getStorage() + arraySize)});
+    if (m_sim_thread && m_sim_thread->has_new_snapshot()) {
+      // Mapped, the snapshot drawn so far goes back to the simulation thread
+      // to copy a later batch into, once GL is done drawing from it
+      if (m_vbo.isMapped()) {
+        m_vbo.waitForDraws(m_sim_thread->snapshot().slot);
+      }
+      m_sim_thread->update_snapshot();
+      auto const& snapshot = m_sim_thread->snapshot();
+      if (!m_vbo.isMapped()) {
+        auto q = m_sim_thread->get_queue();
+        sycl::event::wait_and_throw(
+            {q.memcpy(m_vbo.getStorage(), snapshot.pos, arraySize),
+             q.memcpy(m_vbo.getStorage() + arraySize, snapshot.vel,
+                      arraySize)});
+        m_vbo.commitWrites();
+      }
+      update_profile(snapshot);
+    }
 
-    m_mesh.addVertexBuffer(m_vbo, 0, NBodyShader::Position{})
-        .addVertexBuffer(m_vbo, arraySize, NBodyShader::Velocity{});
+    // Mapped snapshots are drawn from where the simulation thread wrote them
+    const size_t slot{m_vbo.isMapped() && m_sim_thread
+                          ? m_sim_thread->snapshot().slot
+                          : 0};
+    m_mesh.addVertexBuffer(m_vbo, slot * 2 * arraySize, NBodyShader::Position{})
+        .addVertexBuffer(m_vbo, (slot * 2 + 1) * arraySize,
+                         NBodyShader::Velocity{});
 
     // Draw bodies
     m_shader.setView({&m_view, 1})
         .setViewProjection({&m_viewProjection, 1})
         .bindTexture(m_star_tex)
         .draw(m_mesh);
+    m_vbo.fenceDraws(slot);
 
     // TODO: Port the Cinder arrow drawing to Magnum
     /*
@@ -419,10 +739,45 @@ class NBodyApp : public Magnum::Platform::Application {
     ImGui::ListBox("Type of force", &m_ui_force_id, forces.data(),
                    forces.size(), forces.size());
 
-    std::array<const char*, 2> integrators = {
-        {"Euler [fast, inaccurate]", "RK4 [slow, accurate]"}};
+    std::array<const char*, 5> integrators = {
+        {"Euler [fast, inaccurate]", "RK4 [slow, accurate]",
+         "Leapfrog [fast, conserves energy]",
+         "Velocity Verlet [fast, conserves energy]",
+         "Block leapfrog [per-body time steps]"}};
     ImGui::ListBox("Integrator", &m_ui_integrator_id, integrators.data(),
                    integrators.size(), integrators.size());
+    if (m_ui_integrator_id == UI_INTEGRATOR_BLOCK_LEAPFROG) {
+      ImGui::SliderInt("Time step levels", &m_ui_block_max_rung, 0, 8);
+      ImGui::SliderFloat("Step accuracy [lg]", &m_ui_block_lg_eta, -6, 0);
+    }
+
+    std::array<const char*, 3> kernels = {
+        {"Naive [global memory]", "Tiled [local memory]",
+         "Symmetric [each pair once, no RK4]"}};
+    ImGui::ListBox("Force kernel", &m_ui_kernel_id, kernels.data(),
+                   kernels.size(), kernels.size());
+
+    std::array<const char*, 3> layouts = {
+        {"vec3 [separate charges]", "Packed vec4 [position + weight]",
+         "Structure of arrays [CPU vectorisation]"}};
+    ImGui::ListBox("Body layout", &m_ui_layout_id, layouts.data(),
+                   layouts.size(), layouts.size());
+
+    if (m_supports_doubles) {
+      ImGui::Checkbox("Double precision force sums", &m_ui_double_accum);
+    } else {
+      ImGui::Text("Double precision not supported by device");
+    }
+    ImGui::Checkbox("Specialise force parameters [recompiles on change]",
+                    &m_ui_specialise_forces);
+
+    std::array<const char*, 5> solvers = {
+        {"Direct sum [O(N^2)]", "Barnes-Hut [O(N log N), gravity only]",
+         "Cell list [O(N), Lennard-Jones only]",
+         "Neighbour list [O(N), Lennard-Jones only]",
+         "Particle-mesh Ewald [periodic, Coulomb only, no RK4]"}};
+    ImGui::ListBox("Solver", &m_ui_solver_id, solvers.data(), solvers.size(),
+                   solvers.size());
 
     switch (m_ui_force_id) {
       case UI_FORCE_GRAVITY: {
@@ -433,6 +788,14 @@ class NBodyApp : public Magnum::Platform::Application {
           ImGui::SliderFloat("Damping factor [lg]",
                              &m_ui_force_gravity_params.lg_damping, -14, 0);
 
+          if (m_ui_solver_id == UI_SOLVER_BARNES_HUT) {
+            ImGui::SliderFloat("Opening angle", &m_ui_bh_theta, 0, 1.5);
+
+            if (ImGui::Button("Check accuracy against direct sum")) {
+              m_ui_check_accuracy = true;
+            }
+          }
+
           ImGui::TreePop();
         }
       } break;
@@ -445,6 +808,21 @@ class NBodyApp : public Magnum::Platform::Application {
           ImGui::SliderFloat("Zero potential radius [lg]",
                              &m_ui_force_lj_params.lg_sigma, -8, -2);
 
+          if (m_ui_solver_id == UI_SOLVER_CELL_LIST ||
+              m_ui_solver_id == UI_SOLVER_NEIGHBOUR_LIST) {
+            ImGui::SliderFloat("Cutoff radius", &m_ui_force_lj_params.cutoff,
+                               0.1, 10);
+          }
+
+          if (m_ui_solver_id == UI_SOLVER_NEIGHBOUR_LIST) {
+            ImGui::SliderFloat("Neighbour list skin",
+                               &m_ui_force_lj_params.skin, 0.01, 2);
+            ImGui::Text("Neighbour list rebuilds: %zu",
+                        m_sim_thread
+                            ? m_sim_thread->snapshot().neighbour_list_rebuilds
+                            : size_t(0));
+          }
+
           ImGui::TreePop();
         }
       } break;
@@ -453,14 +831,25 @@ class NBodyApp : public Magnum::Platform::Application {
         if (ImGui::TreeNode("Coulomb settings")) {
           ImGui::Text(
               "Data format:\nLine 1: particle count (N)\nLines 2-(N+1): "
-              "<charge> <x> <y> <z>");
+              "<charge> <x> <y> <z>\nor a checkpoint file");
           ImGui::InputText("Data input file", m_ui_force_coulomb_file.data(),
                            m_ui_force_coulomb_file.size());
 
-          if (ImGui::Button("Initialize from file")) {
+          if (m_coulomb_loader) {
+            ImGui::ProgressBar(m_coulomb_loader->progress());
+          } else if (ImGui::Button("Initialize from file")) {
             m_ui_initialize = true;
           }
 
+          if (m_ui_solver_id == UI_SOLVER_PME) {
+            ImGui::SliderFloat("Periodic box side", &m_ui_pme_params.box, 10,
+                               500);
+            ImGui::SliderFloat("Short-range cutoff [at most box / 3]",
+                               &m_ui_pme_params.cutoff, 0.5, 50);
+            ImGui::SliderInt("Mesh size [lg]", &m_ui_pme_params.lg_grid, 3,
+                             7);
+          }
+
           ImGui::TreePop();
         }
 
@@ -475,7 +864,11 @@ class NBodyApp : public Magnum::Platform::Application {
       ImGui::ListBox("Distribution", &m_ui_distrib_id, distribs.data(),
                      distribs.size(), distribs.size());
 
-      ImGui::SliderInt("Number of bodies", &m_ui_n_bodies, 128, 16384);
+      // The approximate solvers make much larger systems interactive
+      int32_t max_bodies =
+          m_ui_solver_id == UI_SOLVER_DIRECT ? 16384 : 1 << 20;
+      ImGui::SliderInt("Number of bodies", &m_ui_n_bodies, 128, max_bodies);
+      ImGui::InputInt("Seed [0 = random]", &m_ui_seed);
 
       switch (m_ui_distrib_id) {
         case UI_DISTRIB_CYLINDER: {
@@ -525,6 +918,53 @@ class NBodyApp : public Magnum::Platform::Application {
       ImGui::TreePop();
     }
 
+    // The simulation thread publishes a snapshot after every batch
+    ImGui::Checkbox("Adaptive steps per snapshot", &m_ui_adaptive_steps);
+    if (m_ui_adaptive_steps) {
+      ImGui::SliderFloat("Snapshot budget [ms]", &m_ui_batch_budget_ms, 1,
+                         100);
+      ImGui::Text("Steps per snapshot: %d", m_ui_steps_per_batch);
+    } else {
+      ImGui::SliderInt("Steps per snapshot", &m_ui_steps_per_batch, 1, 64);
+    }
+    if (m_sim_thread) {
+      ImGui::Text("Steps taken: %zu", m_sim_thread->snapshot().step_count);
+    }
+
+    // Sorted bodies make the neighbour searches and tree walks cache
+    // friendlier
+    ImGui::SliderInt("Morton reorder interval [steps, 0 = off]",
+                     &m_ui_reorder_every, 0, 256);
+
+    ImGui::Checkbox("Kernel profiling", &m_ui_profile);
+    if (m_ui_profile) {
+      ImGui::Text("Per snapshot: %.3f ms submitting, %.3f ms in kernels",
+                  m_submit_ms, m_kernel_ms);
+      for (auto const& k : m_kernel_stats) {
+        ImGui::Text("%s: %.3f ms (%.3f - %.3f), waited %.3f ms, %zu runs",
+                    k.name.c_str(), k.mean_ms, k.min_ms, k.max_ms,
+                    k.mean_wait_ms, k.count);
+      }
+    }
+
+    ImGui::Checkbox("Energy and momentum diagnostics", &m_ui_diagnostics);
+    if (m_ui_diagnostics && m_diagnostics.step > 0) {
+      auto const& d = m_diagnostics;
+      ImGui::Text("After step %zu:", d.step);
+      ImGui::Text("Energy %.6g (kinetic %.6g, potential %.6g)",
+                  double(d.energy()), double(d.kinetic_energy),
+                  double(d.potential_energy));
+      ImGui::Text("Relative energy drift %.3g",
+                  double((d.energy() - m_initial_energy) /
+                         sycl::fabs(m_initial_energy)));
+      ImGui::Text("Momentum (%.3g, %.3g, %.3g)", double(d.momentum.x()),
+                  double(d.momentum.y()), double(d.momentum.z()));
+      ImGui::Text("Angular momentum (%.3g, %.3g, %.3g)",
+                  double(d.angular_momentum.x()),
+                  double(d.angular_momentum.y()),
+                  double(d.angular_momentum.z()));
+    }
+
     if (m_ui_paused) {
       if (ImGui::Button("Start")) {
         m_ui_paused = false;
@@ -0,0 +1,200 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Strong and weak scaling benchmark of the MPI NBody simulation.
+ *
+ **************************************************************************/
+
+// Run with e.g. `mpirun -n 4 ./nbody_mpi_bench --scaling strong`. The
+// simulation is timed on the first 1, 2, 4, ... ranks and on all of them,
+// and rank 0 prints the step times and parallel efficiencies as JSON.
+
+#include "sim_mpi.hpp"
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr double PI = 3.141592653589793;
+
+using num_t = float;
+
+// Benchmark settings, filled from the command line
+struct options {
+  std::string force = "gravity";
+  std::string scaling = "strong";
+  size_t n_bodies = 16384;
+  size_t n_steps = 10;
+  size_t n_warmup = 1;
+};
+
+void print_usage(const char* name) {
+  std::fprintf(
+      stderr,
+      "Usage: %s [options]\n"
+      "  --force gravity|lennard-jones           (default gravity)\n"
+      "  --scaling strong|weak                   (default strong)\n"
+      "  --bodies N   in total for strong scaling,\n"
+      "               per rank for weak scaling  (default 16384)\n"
+      "  --steps N    timed steps                (default 10)\n"
+      "  --warmup N   untimed steps before them  (default 1)\n",
+      name);
+}
+
+// Returns false if the command line couldn't be parsed
+bool parse_options(int argc, char** argv, options& opts) {
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) {
+      return false;
+    }
+    const char* key = argv[i];
+    const char* value = argv[++i];
+
+    if (!std::strcmp(key, "--force")) {
+      opts.force = value;
+    } else if (!std::strcmp(key, "--scaling")) {
+      opts.scaling = value;
+    } else if (!std::strcmp(key, "--bodies")) {
+      opts.n_bodies = std::strtoul(value, nullptr, 10);
+    } else if (!std::strcmp(key, "--steps")) {
+      opts.n_steps = std::strtoul(value, nullptr, 10);
+    } else if (!std::strcmp(key, "--warmup")) {
+      opts.n_warmup = std::strtoul(value, nullptr, 10);
+    } else {
+      return false;
+    }
+  }
+  return opts.n_bodies > 0 && opts.n_steps > 0 &&
+         (opts.force == "gravity" || opts.force == "lennard-jones") &&
+         (opts.scaling == "strong" || opts.scaling == "weak");
+}
+
+// Median time of a step on the ranks of `comm`, where every step takes as
+// long as its slowest rank
+double median_step_time(MPI_Comm comm, size_t n_bodies, const options& opts) {
+  // Same defaults as the distribution settings of the NBody demo
+  distrib_cylinder<num_t> params{{0, 25},
+                                 {0, num_t(2 * PI)},
+                                 {-50, 50},
+                                 sycl::pow(num_t(10), num_t(.4))};
+  GravSimMPI<num_t> sim(comm, n_bodies, params);
+  sim.set_force_type(opts.force == "gravity" ? force_t::GRAVITY
+                                             : force_t::LENNARD_JONES);
+
+  for (size_t i = 0; i < opts.n_warmup; i++) {
+    sim.step();
+  }
+
+  std::vector<double> step_times(opts.n_steps);
+  for (auto& step_time : step_times) {
+    MPI_Barrier(comm);
+    double tstart = MPI_Wtime();
+    sim.step();
+    double local = MPI_Wtime() - tstart;
+    MPI_Allreduce(&local, &step_time, 1, MPI_DOUBLE, MPI_MAX, comm);
+  }
+
+  std::sort(step_times.begin(), step_times.end());
+  size_t mid = step_times.size() / 2;
+  return step_times.size() % 2 ? step_times[mid]
+                               : (step_times[mid - 1] + step_times[mid]) / 2;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  MPI_Init(&argc, &argv);
+
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  int rank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+
+  options opts;
+  if (!parse_options(argc, argv, opts)) {
+    if (rank == 0) {
+      print_usage(argv[0]);
+    }
+    MPI_Finalize();
+    return 1;
+  }
+
+  // Powers of two up to the number of ranks, and the number of ranks itself
+  std::vector<int> rank_counts;
+  for (int n = 1; n < size; n *= 2) {
+    rank_counts.push_back(n);
+  }
+  rank_counts.push_back(size);
+
+  bool weak = opts.scaling == "weak";
+  if (rank == 0) {
+    std::printf(
+        "{\n"
+        "  \"force\": \"%s\",\n"
+        "  \"scaling\": \"%s\",\n"
+        "  \"steps\": %zu,\n"
+        "  \"runs\": [\n",
+        opts.force.c_str(), opts.scaling.c_str(), opts.n_steps);
+  }
+
+  double base_rate = 0;
+  for (size_t i = 0; i < rank_counts.size(); i++) {
+    int n_ranks = rank_counts[i];
+    size_t n_bodies = weak ? opts.n_bodies * n_ranks : opts.n_bodies;
+
+    // The ranks left out wait for the others at the barrier below
+    MPI_Comm comm;
+    MPI_Comm_split(MPI_COMM_WORLD, rank < n_ranks ? 0 : MPI_UNDEFINED, rank,
+                   &comm);
+    double median = 0;
+    if (comm != MPI_COMM_NULL) {
+      median = median_step_time(comm, n_bodies, opts);
+      MPI_Comm_free(&comm);
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+
+    if (rank == 0) {
+      // The efficiency compares the interactions per second and rank with
+      // those of a single rank. This covers weak scaling too, where the
+      // interactions of a direct sum step grow with the square of the ranks.
+      double rate = double(n_bodies) * double(n_bodies) / median;
+      if (i == 0) {
+        base_rate = rate;
+      }
+      std::printf(
+          "    {\"ranks\": %d, \"bodies\": %zu, "
+          "\"median_step_time_s\": %.9g, \"interactions_per_s\": %.9g, "
+          "\"efficiency\": %.4f}%s\n",
+          n_ranks, n_bodies, median, rate, rate / (base_rate * n_ranks),
+          i + 1 < rank_counts.size() ? "," : "");
+    }
+  }
+
+  if (rank == 0) {
+    std::printf("  ]\n}\n");
+  }
+
+  MPI_Finalize();
+  return 0;
+}
@@ -0,0 +1,287 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Verlet neighbour lists reused across steps for short-range forces.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "cell_list.hpp"
+#include "device_algorithms.hpp"
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <memory>
+
+// Dummy classes to generate unique kernel name types
+template <typename num_t>
+class nlist_count_kernel;
+template <typename num_t>
+class nlist_fill_kernel;
+template <typename num_t>
+class nlist_displacement_kernel;
+
+/* Stores, for every body, the bodies within the cutoff plus a skin distance
+ * in compressed sparse row form: the neighbours of body i are
+ * m_neighbours[m_offsets[i]..m_offsets[i + 1]). As long as no body has moved
+ * more than half the skin since the list was built, no pair can have come
+ * within the cutoff without being in the list, so the list stays valid and
+ * its construction is amortised over many steps. The displacement is checked
+ * every step, but its result is read back asynchronously, so the host can
+ * enqueue a few steps ahead of the device. */
+template <typename num_t>
+class NeighbourList {
+  size_t m_n_bodies;
+
+  // Grid used to find candidate neighbours when rebuilding
+  CellList<num_t> m_grid;
+
+  DeviceScan<uint32_t> m_scan;
+
+  // CSR neighbour lists
+  sycl::buffer<uint32_t, 1> m_offsets;
+  std::unique_ptr<sycl::buffer<uint32_t, 1>> m_neighbours = nullptr;
+
+  // Positions at the time of the last rebuild
+  sycl::buffer<vec3<num_t>, 1> m_ref_pos;
+
+  // Largest squared displacement since the last rebuild
+  sycl::buffer<num_t, 1> m_max_disp2{sycl::range<1>(1)};
+
+  // How many displacement checks may be in flight before update() waits
+  static constexpr size_t MAX_PENDING_CHECKS = 4;
+
+  // Displacement checks not yet read on the host, oldest first
+  struct check {
+    sycl::event copied;
+    // Steps since the last rebuild when the check was submitted
+    size_t steps;
+  };
+  std::deque<check> m_checks;
+
+  // Host copies of the results of the pending checks, indexed by their steps
+  num_t m_check_results[MAX_PENDING_CHECKS + 1];
+
+  // Steps since the last rebuild
+  size_t m_steps = 0;
+
+  // Average displacement per step in the latest finished check, possibly
+  // from before the last rebuild, to estimate the pending steps with
+  num_t m_disp_per_step = 0;
+
+  // Only rebuild after this fraction of half the skin, as the displacement
+  // of the pending steps is only estimated
+  static constexpr num_t SKIN_MARGIN = num_t(0.8);
+
+  // Cutoff and skin the list was built with, negative if never built
+  num_t m_cutoff = -1;
+  num_t m_skin = -1;
+
+  size_t m_n_rebuilds = 0;
+
+ public:
+  NeighbourList(size_t n_bodies)
+      : m_n_bodies(n_bodies),
+        m_grid(n_bodies),
+        m_offsets(sycl::range<1>(n_bodies + 1)),
+        m_ref_pos(sycl::range<1>(n_bodies)) {}
+
+  // How often the list has been rebuilt
+  size_t n_rebuilds() const { return m_n_rebuilds; }
+
+  // Forces a rebuild on the next update, e.g. after the bodies were reordered
+  void invalidate() {
+    m_cutoff = -1;
+    m_skin = -1;
+  }
+
+  /* Rebuilds the list if it was built with different parameters or any body
+   * may have moved more than half the skin. The displacement of the latest
+   * finished check is extrapolated over the steps still pending, and only if
+   * more than MAX_PENDING_CHECKS are pending does this wait for the device. */
+  void update(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+               num_t cutoff, num_t skin) {
+    if (cutoff != m_cutoff || skin != m_skin) {
+      build(q, positions, cutoff, skin);
+      return;
+    }
+
+    m_steps++;
+    submit_displacement_check(q, positions);
+
+    while (!m_checks.empty() && (m_checks.size() > MAX_PENDING_CHECKS ||
+                                 is_complete(m_checks.front().copied))) {
+      auto c = m_checks.front();
+      m_checks.pop_front();
+      c.copied.wait();
+      m_disp_per_step =
+          std::sqrt(m_check_results[slot(c.steps)]) / num_t(c.steps);
+    }
+
+    if (m_disp_per_step * num_t(m_steps) > SKIN_MARGIN * skin / num_t(2)) {
+      build(q, positions, cutoff, skin);
+    }
+  }
+
+  // Rebuilds the list with all pairs closer than cutoff + skin
+  void build(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+              num_t cutoff, num_t skin) {
+    // Checks against the old reference positions are meaningless now
+    for (auto& c : m_checks) {
+      c.copied.wait();
+    }
+    m_checks.clear();
+    m_steps = 0;
+
+    size_t n_bodies = m_n_bodies;
+    num_t radius2 = (cutoff + skin) * (cutoff + skin);
+    m_grid.build(q, positions, cutoff + skin);
+
+    // Count the neighbours of every body
+    q.submit("neighbour count", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor counts(m_offsets, cgh, sycl::write_only, sycl::no_init);
+      typename CellList<num_t>::View grid(m_grid, cgh);
+
+      cgh.parallel_for<nlist_count_kernel<num_t>>(
+          sycl::range<1>(n_bodies + 1), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            uint32_t count = 0;
+            // The extra work-item leaves a zero to scan into the total
+            if (id < n_bodies) {
+              auto x = pos[id];
+              grid.for_each_neighbour(pos, x, [&](uint32_t j) {
+                auto const diff = pos[j] - x;
+                if (j != id && diff.x() * diff.x() + diff.y() * diff.y() +
+                                       diff.z() * diff.z() <
+                                   radius2) {
+                  count++;
+                }
+              });
+            }
+            counts[id] = count;
+          });
+    });
+
+    m_scan.exclusive(q, m_offsets, n_bodies + 1);
+
+    // The total is needed on the host to size the neighbour array
+    uint32_t total;
+    {
+      auto offsets = m_offsets.get_host_access(sycl::read_only);
+      total = offsets[n_bodies];
+    }
+    if (!m_neighbours || m_neighbours->size() < total) {
+      // Leave some room so small fluctuations don't reallocate
+      m_neighbours = std::make_unique<sycl::buffer<uint32_t, 1>>(
+          sycl::range<1>(std::max<size_t>(1, total + total / 4)));
+    }
+
+    // Fill in the neighbours of every body
+    q.submit("neighbour fill", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor offsets(m_offsets, cgh, sycl::read_only);
+      sycl::accessor neighbours(*m_neighbours, cgh, sycl::write_only);
+      typename CellList<num_t>::View grid(m_grid, cgh);
+
+      cgh.parallel_for<nlist_fill_kernel<num_t>>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            auto next = offsets[id];
+            auto x = pos[id];
+            grid.for_each_neighbour(pos, x, [&](uint32_t j) {
+              auto const diff = pos[j] - x;
+              if (j != id && diff.x() * diff.x() + diff.y() * diff.y() +
+                                     diff.z() * diff.z() <
+                                 radius2) {
+                neighbours[next++] = j;
+              }
+            });
+          });
+    });
+
+    q.submit("neighbour reference", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor ref(m_ref_pos, cgh, sycl::write_only, sycl::no_init);
+      cgh.copy(pos, ref);
+    });
+
+    m_cutoff = cutoff;
+    m_skin = skin;
+    m_n_rebuilds++;
+  }
+
+  // Device-side view of the list used inside a kernel
+  class View {
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_offsets;
+    sycl::accessor<uint32_t, 1, sycl::access_mode::read> m_neighbours;
+
+   public:
+    View(NeighbourList& list, sycl::handler& cgh)
+        : m_offsets(list.m_offsets, cgh, sycl::read_only),
+          m_neighbours(*list.m_neighbours, cgh, sycl::read_only) {}
+
+    // Calls func(j) for every neighbour j of body `id`
+    template <typename Func>
+    void for_each_neighbour(size_t id, Func&& func) const {
+      for (uint32_t k = m_offsets[id]; k < m_offsets[id + 1]; k++) {
+        func(m_neighbours[k]);
+      }
+    }
+  };
+
+ private:
+  static size_t slot(size_t steps) { return steps % (MAX_PENDING_CHECKS + 1); }
+
+  static bool is_complete(const sycl::event& e) {
+    return e.get_info<sycl::info::event::command_execution_status>() ==
+           sycl::info::event_command_status::complete;
+  }
+
+  // Finds the largest squared distance of any body from its position at the
+  // last rebuild with a device-side reduction, and copies it to the host
+  void submit_displacement_check(ProfiledQueue q,
+                                  sycl::buffer<vec3<num_t>, 1>& positions) {
+    q.submit("neighbour displacement", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor ref(m_ref_pos, cgh, sycl::read_only);
+      auto max_disp2 = sycl::reduction(
+          m_max_disp2, cgh, sycl::maximum<num_t>(),
+          sycl::property::reduction::initialize_to_identity{});
+
+      cgh.parallel_for<nlist_displacement_kernel<num_t>>(
+          sycl::range<1>(m_n_bodies), max_disp2,
+          [=](sycl::item<1> item, auto& max) {
+            auto const diff = pos[item] - ref[item];
+            max.combine(diff.x() * diff.x() + diff.y() * diff.y() +
+                        diff.z() * diff.z());
+          });
+    });
+
+    auto copied =
+        q.submit("neighbour displacement copy", [&](sycl::handler& cgh) {
+          sycl::accessor max_disp2(m_max_disp2, cgh, sycl::read_only);
+          cgh.copy(max_disp2, &m_check_results[slot(m_steps)]);
+        });
+    m_checks.push_back({copied, m_steps});
+  }
+};
@@ -0,0 +1,239 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Background loading of Coulomb particle data for the NBody simulation.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "checkpoint.hpp"
+#include "sim.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Creates a Coulomb simulation from a particle file on a background thread.
+ *
+ * Text files hold the particle count on the first line, followed by one
+ * "charge x y z" line per particle. They are read in one go, split into one
+ * chunk of whole lines per hardware thread, and parsed in parallel with
+ * std::from_chars in two passes: the first counts the lines of every chunk,
+ * so that the second knows where to write the particles of each. Reading
+ * the file and the two passes each count for a third of the progress.
+ *
+ * Checkpoint files written by GravSim::save_checkpoint are recognised by
+ * their header and are mapped and copied to the device without parsing. */
+template <typename num_t>
+class ParticleLoader {
+  // Bytes read, counted and parsed so far, out of three times the file size,
+  // for progress reports
+  std::atomic<size_t> m_processed{0};
+  std::atomic<size_t> m_size{0};
+
+  std::future<GravSim<num_t>> m_sim;
+
+  // Bytes between progress updates while parsing
+  static constexpr size_t PROGRESS_STEP = 64 * 1024;
+
+  // Bytes read from the file at once
+  static constexpr size_t READ_BLOCK = 16 * PROGRESS_STEP;
+
+  // Reads the whole file into memory
+  std::vector<char> read_file(const std::string& path) {
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (!file) {
+      throw std::runtime_error("Can't open " + path + "!");
+    }
+    std::fseek(file, 0, SEEK_END);
+    long size = std::ftell(file);
+    std::fseek(file, 0, SEEK_SET);
+
+    std::vector<char> text(size_t(std::max(size, 0L)));
+    m_size = text.size();
+    bool ok = size >= 0;
+    for (size_t read = 0; ok && read < text.size(); read += READ_BLOCK) {
+      size_t block = std::min(READ_BLOCK, text.size() - read);
+      ok = std::fread(text.data() + read, 1, block, file) == block;
+      m_processed += block;
+    }
+    std::fclose(file);
+    if (!ok) {
+      throw std::runtime_error("Can't read " + path + "!");
+    }
+    return text;
+  }
+
+  static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+  }
+
+  // Whether [begin, end) holds anything but whitespace
+  static bool has_content(const char* begin, const char* end) {
+    return std::find_if_not(begin, end, is_blank) != end;
+  }
+
+  // Parses `n_values` whitespace separated numbers from the line
+  // [begin, end), throws if there are fewer
+  template <typename T>
+  static void parse_line(const char* begin, const char* end, T* values,
+                         size_t n_values) {
+    for (size_t i = 0; i < n_values; i++) {
+      begin = std::find_if_not(begin, end, is_blank);
+      auto [next, error] = std::from_chars(begin, end, values[i]);
+      if (error != std::errc()) {
+        throw std::runtime_error("Malformed particle line: " +
+                                 std::string(begin, end));
+      }
+      begin = next;
+    }
+  }
+
+  // Calls func(line_begin, line_end) for the non-blank lines in
+  // [begin, end), which must start at the beginning of a line. Adds the
+  // bytes visited to the progress every PROGRESS_STEP bytes.
+  template <typename Func>
+  void for_each_line(const char* begin, const char* end, Func&& func) {
+    const char* reported = begin;
+    while (begin < end) {
+      auto line_end = static_cast<const char*>(
+          std::memchr(begin, '\n', size_t(end - begin)));
+      if (!line_end) {
+        line_end = end;
+      }
+      if (has_content(begin, line_end)) {
+        func(begin, line_end);
+      }
+      begin = line_end + 1;
+
+      if (size_t(line_end - reported) >= PROGRESS_STEP) {
+        m_processed += size_t(line_end - reported);
+        reported = line_end;
+      }
+    }
+    m_processed += size_t(end - reported);
+  }
+
+  GravSim<num_t> load_text(const std::vector<char>& text) {
+    const char* begin = text.data();
+    const char* end = begin + text.size();
+
+    // First line is the particle count
+    auto first_end =
+        static_cast<const char*>(std::memchr(begin, '\n', text.size()));
+    first_end = first_end ? first_end : end;
+    size_t n_bodies = 0;
+    parse_line(begin, first_end, &n_bodies, 1);
+    begin = std::min(first_end + 1, end);
+    // The first line isn't visited by either pass
+    m_processed += 2 * size_t(begin - text.data());
+
+    // Chunk boundaries, moved forward to the start of the next line
+    size_t n_chunks = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<const char*> bounds(n_chunks + 1, end);
+    bounds[0] = begin;
+    for (size_t c = 1; c < n_chunks; c++) {
+      const char* bound = begin + size_t(end - begin) * c / n_chunks;
+      bound = std::max(bound, bounds[c - 1]);
+      auto line_end = static_cast<const char*>(
+          std::memchr(bound, '\n', size_t(end - bound)));
+      bounds[c] = line_end ? line_end + 1 : end;
+    }
+
+    // Exceptions thrown by a chunk are rethrown by get()
+    const auto in_chunks = [&](auto&& func) {
+      std::vector<std::future<void>> chunks;
+      for (size_t c = 0; c < n_chunks; c++) {
+        chunks.push_back(std::async(std::launch::async, func, c));
+      }
+      for (auto& chunk : chunks) {
+        chunk.get();
+      }
+    };
+
+    std::vector<size_t> offsets(n_chunks + 1, 0);
+    in_chunks([&](size_t c) {
+      for_each_line(bounds[c], bounds[c + 1],
+                    [&](const char*, const char*) { offsets[c + 1]++; });
+    });
+    for (size_t c = 0; c < n_chunks; c++) {
+      offsets[c + 1] += offsets[c];
+    }
+    if (offsets[n_chunks] != n_bodies) {
+      throw std::runtime_error("Expected " + std::to_string(n_bodies) +
+                               " particles, found " +
+                               std::to_string(offsets[n_chunks]) + "!");
+    }
+
+    std::vector<num_t> charges(n_bodies);
+    std::vector<vec3<num_t>> pos(n_bodies);
+    in_chunks([&](size_t c) {
+      size_t i = offsets[c];
+      for_each_line(bounds[c], bounds[c + 1],
+                    [&](const char* line, const char* line_end) {
+                      num_t values[4];
+                      parse_line(line, line_end, values, 4);
+                      charges[i] = values[0];
+                      pos[i] = {values[1], values[2], values[3]};
+                      i++;
+                    });
+    });
+
+    return GravSim<num_t>(charges, pos);
+  }
+
+ public:
+  // Starts loading `path` in the background
+  explicit ParticleLoader(std::string path) {
+    m_sim = std::async(std::launch::async, [this, path]() {
+      // Checkpoints are copied to the device straight from the mapped file
+      char magic[sizeof(CHECKPOINT_MAGIC)] = {};
+      if (std::FILE* file = std::fopen(path.c_str(), "rb")) {
+        std::fread(magic, 1, sizeof(magic), file);
+        std::fclose(file);
+      }
+      if (!std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic))) {
+        return GravSim<num_t>(MappedCheckpoint(path));
+      }
+
+      return load_text(read_file(path));
+    });
+  }
+
+  // The fraction of the text file read and parsed so far
+  float progress() const {
+    size_t size = m_size;
+    return size ? float(m_processed) / float(3 * size) : 0.f;
+  }
+
+  // Whether the simulation can be taken without blocking
+  bool ready() const {
+    return m_sim.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  }
+
+  // Blocks until loaded, rethrows loading errors
+  GravSim<num_t> get() { return m_sim.get(); }
+};
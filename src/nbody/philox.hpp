@@ -0,0 +1,61 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Counter-based random numbers usable in host and device code.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/* Philox4x32-10 from Salmon et al., "Parallel random numbers: as easy as
+ * 1, 2, 3". Maps a 128-bit counter and a 64-bit key to four random 32-bit
+ * words without any state, so every work-item can draw the numbers of its
+ * own counter independently and the results don't depend on the order or
+ * the device they are drawn on. */
+inline std::array<uint32_t, 4> philox4x32(std::array<uint32_t, 4> ctr,
+                                          std::array<uint32_t, 2> key) {
+  constexpr uint32_t M0 = 0xD2511F53;
+  constexpr uint32_t M1 = 0xCD9E8D57;
+  constexpr uint32_t W0 = 0x9E3779B9;
+  constexpr uint32_t W1 = 0xBB67AE85;
+
+  for (int round = 0; round < 10; round++) {
+    uint64_t p0 = uint64_t(M0) * ctr[0];
+    uint64_t p1 = uint64_t(M1) * ctr[2];
+    ctr = {uint32_t(p1 >> 32) ^ ctr[1] ^ key[0], uint32_t(p1),
+           uint32_t(p0 >> 32) ^ ctr[3] ^ key[1], uint32_t(p0)};
+    key[0] += W0;
+    key[1] += W1;
+  }
+  return ctr;
+}
+
+// Four uniform numbers in [0, 1) for element `id` of the stream `seed`
+template <typename num_t>
+std::array<num_t, 4> philox_uniform(uint64_t seed, uint64_t id) {
+  auto bits = philox4x32({uint32_t(id), uint32_t(id >> 32), 0, 0},
+                         {uint32_t(seed), uint32_t(seed >> 32)});
+
+  // The top 24 bits are exactly representable in float
+  std::array<num_t, 4> u;
+  for (int i = 0; i < 4; i++) {
+    u[i] = num_t(bits[i] >> 8) * num_t(1.0 / (1 << 24));
+  }
+  return u;
+}
@@ -0,0 +1,329 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Smooth particle-mesh Ewald summation of periodic Coulomb forces.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "cell_list.hpp"
+#include "fft.hpp"
+#include "forces.hpp"
+#include "profiler.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Dummy classes to generate unique kernel name types
+template <typename num_t>
+class pme_spread_kernel;
+template <typename num_t>
+class pme_complex_kernel;
+template <typename num_t>
+class pme_influence_kernel;
+template <typename num_t>
+class pme_force_kernel;
+
+/* Splits the Coulomb interaction in a periodic cube into a short-range part,
+ * erfc(beta r) / r, summed directly over the bodies within a cutoff with a
+ * periodic cell list, and a smooth long-range part solved on a K^3 mesh
+ * (Essmann et al., J. Chem. Phys. 103, 8577 (1995)):
+ *
+ *  1. spread the charges onto the mesh with cubic B-splines,
+ *  2. FFT the mesh and multiply it by the Ewald influence function,
+ *  3. transform back to get the potential on the mesh,
+ *  4. interpolate its gradient at every body with the same B-splines.
+ *
+ * So a step costs O(N + K^3 log K) rather than O(N^2). beta is chosen so
+ * that the short-range part has decayed to EWALD_TOLERANCE at the cutoff.
+ * Forces follow the sign convention of coulomb_force, and assume the system
+ * is neutral: a net charge only adds a uniform background, which doesn't
+ * change the forces. */
+template <typename num_t>
+class ParticleMeshEwald {
+ public:
+  // erfc(beta * cutoff), the relative size of the neglected short-range part
+  static constexpr double EWALD_TOLERANCE = 1e-5;
+
+ private:
+  size_t m_n_bodies;
+  GridFFT<num_t> m_fft;
+
+  // Charges spread onto the mesh, then the same as complex numbers for the
+  // FFTs
+  sycl::buffer<num_t, 1> m_charges;
+  sycl::buffer<complex_t<num_t>, 1> m_mesh;
+
+  // B-spline factor of the influence function along one axis, |b(m)|^2
+  sycl::buffer<num_t, 1> m_bspline_moduli;
+
+  // Periodic grid for the short-range part
+  CellList<num_t> m_cells;
+
+  /* Cubic B-spline weights of the four mesh points base - j, j = 0..3, for a
+   * body at fractional offset w from mesh point base, and their derivatives
+   * with respect to w */
+  static void bspline(num_t w, num_t (&m)[4], num_t (&dm)[4]) {
+    num_t const v = num_t(1) - w;
+    m[0] = w * w * w / num_t(6);
+    m[1] = (num_t(-3) * w * w * w + num_t(3) * w * w + num_t(3) * w +
+            num_t(1)) /
+           num_t(6);
+    m[2] = (num_t(3) * w * w * w - num_t(6) * w * w + num_t(4)) / num_t(6);
+    m[3] = v * v * v / num_t(6);
+    dm[0] = w * w / num_t(2);
+    dm[1] = (num_t(-3) * w * w + num_t(2) * w + num_t(1)) / num_t(2);
+    dm[2] = (num_t(3) * w * w - num_t(4) * w) / num_t(2);
+    dm[3] = -v * v / num_t(2);
+  }
+
+  // Mesh coordinate of x wrapped into [0, K), split into the mesh point
+  // below it and the offset from that point
+  static void mesh_coord(num_t x, num_t scale, int32_t size, int32_t& base,
+                         num_t& w) {
+    num_t u = x * scale;
+    u -= num_t(size) * sycl::floor(u / num_t(size));
+    auto const below = sycl::floor(u);
+    w = u - below;
+    base = int32_t(below) % size;
+  }
+
+  static uint32_t wrap(int32_t k, int32_t size) {
+    return uint32_t((k % size + size) % size);
+  }
+
+  // |b(m)|^2 = 1 / |sum_k M4(k + 1) exp(2 pi i m k / K)|^2 of a cubic
+  // B-spline, with M4(1..3) = 1/6, 2/3, 1/6
+  static std::vector<num_t> bspline_moduli(uint32_t size) {
+    double const weights[3] = {1.0 / 6.0, 2.0 / 3.0, 1.0 / 6.0};
+    std::vector<num_t> moduli(size);
+    for (uint32_t m = 0; m < size; m++) {
+      double re = 0;
+      double im = 0;
+      for (uint32_t k = 0; k < 3; k++) {
+        double angle = 2 * 3.141592653589793 * double(m * k) / double(size);
+        re += weights[k] * std::cos(angle);
+        im += weights[k] * std::sin(angle);
+      }
+      moduli[m] = num_t(1.0 / (re * re + im * im));
+    }
+    return moduli;
+  }
+
+ public:
+  ParticleMeshEwald(size_t n_bodies, uint32_t mesh_size)
+      : m_n_bodies(n_bodies),
+        m_fft(mesh_size),
+        m_charges(sycl::range<1>(size_t(mesh_size) * mesh_size * mesh_size)),
+        m_mesh(sycl::range<1>(size_t(mesh_size) * mesh_size * mesh_size)),
+        m_bspline_moduli(sycl::range<1>(mesh_size)),
+        m_cells(n_bodies) {
+    auto moduli = bspline_moduli(mesh_size);
+    auto acc = m_bspline_moduli.get_host_access(sycl::write_only);
+    for (uint32_t m = 0; m < mesh_size; m++) {
+      acc[m] = moduli[m];
+    }
+  }
+
+  uint32_t mesh_size() const { return m_fft.size(); }
+
+  // The Ewald splitting parameter for the given cutoff, found by bisection
+  static num_t choose_beta(num_t cutoff) {
+    double lo = 0;
+    double hi = 1;
+    while (std::erfc(hi * double(cutoff)) > EWALD_TOLERANCE) {
+      hi *= 2;
+    }
+    for (int i = 0; i < 64; i++) {
+      double mid = (lo + hi) / 2;
+      if (std::erfc(mid * double(cutoff)) > EWALD_TOLERANCE) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    return num_t(hi);
+  }
+
+  /* Writes the acceleration of every body in a periodic cube of side `box`
+   * with its corner at the origin to `accel`, three values per body. The
+   * box must be at least three cutoffs wide. */
+  void compute(ProfiledQueue q, sycl::buffer<vec3<num_t>, 1>& positions,
+                sycl::buffer<num_t, 1>& charges, sycl::buffer<num_t, 1>& accel,
+                num_t box, num_t cutoff) {
+    m_cells.build_periodic(q, positions, box, cutoff);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    size_t n_bodies = m_n_bodies;
+    int32_t size = int32_t(m_fft.size());
+    size_t n_points = size_t(size) * size * size;
+    num_t scale = num_t(size) / box;
+    num_t beta = choose_beta(cutoff);
+
+    // Spread the charges onto the mesh
+    q.submit("pme clear", [&](sycl::handler& cgh) {
+      sycl::accessor mesh(m_charges, cgh, sycl::write_only, sycl::no_init);
+      cgh.fill(mesh, num_t(0));
+    });
+    q.submit("pme spread", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor charge(charges, cgh, sycl::read_only);
+      sycl::accessor mesh(m_charges, cgh, sycl::read_write);
+
+      cgh.parallel_for<pme_spread_kernel<num_t>>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            auto x = pos[item];
+            int32_t base[3];
+            num_t m[3][4];
+            num_t dm[4];
+            for (int c = 0; c < 3; c++) {
+              num_t w;
+              mesh_coord(x[c], scale, size, base[c], w);
+              bspline(w, m[c], dm);
+            }
+
+            auto q_i = charge[item];
+            for (int jz = 0; jz < 4; jz++) {
+              auto kz = wrap(base[2] - jz, size);
+              for (int jy = 0; jy < 4; jy++) {
+                auto ky = wrap(base[1] - jy, size);
+                for (int jx = 0; jx < 4; jx++) {
+                  auto kx = wrap(base[0] - jx, size);
+                  sycl::atomic_ref<num_t, sycl::memory_order::relaxed,
+                                   sycl::memory_scope::device,
+                                   sycl::access::address_space::global_space>(
+                      mesh[(kz * size + ky) * size + kx])
+                      .fetch_add(q_i * m[0][jx] * m[1][jy] * m[2][jz]);
+                }
+              }
+            }
+          });
+    });
+
+    q.submit("pme complex", [&](sycl::handler& cgh) {
+      sycl::accessor real(m_charges, cgh, sycl::read_only);
+      sycl::accessor mesh(m_mesh, cgh, sycl::write_only, sycl::no_init);
+      cgh.parallel_for<pme_complex_kernel<num_t>>(
+          sycl::range<1>(n_points), [=](sycl::item<1> item) {
+            mesh[item] = complex_t<num_t>{real[item], num_t(0)};
+          });
+    });
+
+    m_fft.template transform<1>(q, m_mesh);
+
+    // Multiply by the influence function
+    // exp(-pi^2 m^2 / beta^2) / (pi V m^2) |b(m)|^2, zero for m = 0
+    q.submit("pme influence", [&](sycl::handler& cgh) {
+      sycl::accessor mesh(m_mesh, cgh, sycl::read_write);
+      sycl::accessor moduli(m_bspline_moduli, cgh, sycl::read_only);
+      num_t const pi = num_t(3.141592653589793);
+      num_t volume = box * box * box;
+
+      cgh.parallel_for<pme_influence_kernel<num_t>>(
+          sycl::range<1>(n_points), [=](sycl::item<1> item) {
+            auto id = uint32_t(item.get_linear_id());
+            uint32_t k[3] = {id % uint32_t(size),
+                             id / uint32_t(size) % uint32_t(size),
+                             id / uint32_t(size * size)};
+            num_t m2 = 0;
+            num_t b = 1;
+            for (int c = 0; c < 3; c++) {
+              // Wrap to the signed frequency, in reciprocal box units
+              auto mc = int32_t(k[c]) < size / 2 ? int32_t(k[c])
+                                                  : int32_t(k[c]) - size;
+              auto m = num_t(mc) / box;
+              m2 += m * m;
+              b *= moduli[k[c]];
+            }
+            num_t theta = 0;
+            if (id != 0) {
+              theta = b * sycl::exp(-pi * pi * m2 / (beta * beta)) /
+                      (pi * volume * m2);
+            }
+            mesh[id] *= theta;
+          });
+    });
+
+    m_fft.template transform<-1>(q, m_mesh);
+
+    // Interpolate the gradient of the mesh potential and add the short-range
+    // part of the neighbours within the cutoff
+    q.submit("pme forces", [&](sycl::handler& cgh) {
+      sycl::accessor pos(positions, cgh, sycl::read_only);
+      sycl::accessor charge(charges, cgh, sycl::read_only);
+      sycl::accessor mesh(m_mesh, cgh, sycl::read_only);
+      sycl::accessor acc_out(accel, cgh, sycl::write_only, sycl::no_init);
+      typename CellList<num_t>::View grid(m_cells, cgh);
+      num_t cutoff2 = cutoff * cutoff;
+      num_t const two_beta_over_sqrt_pi =
+          num_t(2) * beta / num_t(1.772453850905516);
+
+      cgh.parallel_for<pme_force_kernel<num_t>>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            auto x = pos[id];
+
+            int32_t base[3];
+            num_t m[3][4];
+            num_t dm[3][4];
+            for (int c = 0; c < 3; c++) {
+              num_t w;
+              mesh_coord(x[c], scale, size, base[c], w);
+              bspline(w, m[c], dm[c]);
+            }
+
+            vec3<num_t> acc(0);
+            for (int jz = 0; jz < 4; jz++) {
+              auto kz = wrap(base[2] - jz, size);
+              for (int jy = 0; jy < 4; jy++) {
+                auto ky = wrap(base[1] - jy, size);
+                for (int jx = 0; jx < 4; jx++) {
+                  auto kx = wrap(base[0] - jx, size);
+                  num_t phi = mesh[(kz * size + ky) * size + kx].x();
+                  acc += phi * vec3<num_t>{dm[0][jx] * m[1][jy] * m[2][jz],
+                                           m[0][jx] * dm[1][jy] * m[2][jz],
+                                           m[0][jx] * m[1][jy] * dm[2][jz]};
+                }
+              }
+            }
+            acc *= scale;
+
+            grid.for_each_neighbour(pos, x, [&](uint32_t j) {
+              auto diff = pos[j] - x;
+              diff -= box * sycl::round(diff / box);
+              auto const r2 = diff.x() * diff.x() + diff.y() * diff.y() +
+                              diff.z() * diff.z();
+              if (j != id && r2 < cutoff2) {
+                auto const r = sycl::sqrt(r2);
+                acc += charge[j] *
+                       (sycl::erfc(beta * r) / r +
+                        two_beta_over_sqrt_pi * sycl::exp(-beta * beta * r2)) /
+                       r2 * diff;
+              }
+            });
+
+            acc *= charge[id];
+            acc_out[3 * id] = acc.x();
+            acc_out[3 * id + 1] = acc.y();
+            acc_out[3 * id + 2] = acc.z();
+          });
+    });
+  }
+};
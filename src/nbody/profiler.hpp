@@ -0,0 +1,204 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Device execution times of the NBody simulation kernels.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Timings of one named command over the last KernelProfiler::WINDOW runs
+struct kernel_stats {
+  std::string name;
+  size_t count;
+  // Execution time from command_start to command_end
+  double mean_ms;
+  double min_ms;
+  double max_ms;
+  // Time spent waiting from command_submit to command_start
+  double mean_wait_ms;
+};
+
+/* Collects the profiling information of the events of named commands, which
+ * must come from a queue created with sycl::property::queue::enable_profiling.
+ * record() only keeps the event, and collect() reads the timings of the
+ * commands that have completed since without waiting for the others, so the
+ * simulation can keep running while it is profiled. */
+class KernelProfiler {
+ public:
+  // Runs kept per command name for the rolling statistics
+  static constexpr size_t WINDOW = 256;
+  // Events kept waiting for collect(), older ones are dropped beyond this
+  static constexpr size_t MAX_PENDING = 1 << 14;
+
+ private:
+  struct window {
+    std::vector<double> exec_ms;
+    std::vector<double> wait_ms;
+    // Next entry to overwrite once the window is full
+    size_t next = 0;
+  };
+
+  bool m_enabled = false;
+  std::vector<std::pair<const char*, sycl::event>> m_pending;
+  std::map<std::string, window> m_windows;
+
+  // Execution time collected since the last take_busy_ms()
+  double m_busy_ms = 0;
+  size_t m_dropped = 0;
+
+  static double to_ms(uint64_t from_ns, uint64_t to_ns) {
+    return to_ns > from_ns ? double(to_ns - from_ns) * 1e-6 : 0.0;
+  }
+
+  void add(const char* name, const sycl::event& e) {
+    auto submit =
+        e.get_profiling_info<sycl::info::event_profiling::command_submit>();
+    auto start =
+        e.get_profiling_info<sycl::info::event_profiling::command_start>();
+    auto end = e.get_profiling_info<sycl::info::event_profiling::command_end>();
+    double exec_ms = to_ms(start, end);
+    double wait_ms = to_ms(submit, start);
+    m_busy_ms += exec_ms;
+
+    auto& w = m_windows[name];
+    if (w.exec_ms.size() < WINDOW) {
+      w.exec_ms.push_back(exec_ms);
+      w.wait_ms.push_back(wait_ms);
+    } else {
+      w.exec_ms[w.next] = exec_ms;
+      w.wait_ms[w.next] = wait_ms;
+      w.next = (w.next + 1) % WINDOW;
+    }
+  }
+
+  static bool is_complete(const sycl::event& e) {
+    return e.get_info<sycl::info::event::command_execution_status>() ==
+           sycl::info::event_command_status::complete;
+  }
+
+ public:
+  // Events are only kept while enabled
+  void set_enabled(bool enabled) {
+    m_enabled = enabled;
+    if (!enabled) {
+      m_pending.clear();
+    }
+  }
+  bool enabled() const { return m_enabled; }
+
+  // Keeps the event of the command `name`, which must be a string literal
+  void record(const char* name, sycl::event e) {
+    if (!m_enabled) {
+      return;
+    }
+    if (m_pending.size() >= MAX_PENDING) {
+      // Nobody is collecting, drop the older half rather than grow
+      m_pending.erase(m_pending.begin(),
+                      m_pending.begin() + MAX_PENDING / 2);
+      m_dropped += MAX_PENDING / 2;
+    }
+    m_pending.emplace_back(name, std::move(e));
+  }
+
+  // Adds the timings of the commands that have completed, doesn't block
+  void collect() {
+    auto done = std::stable_partition(
+        m_pending.begin(), m_pending.end(),
+        [](const auto& p) { return !is_complete(p.second); });
+    for (auto it = done; it != m_pending.end(); ++it) {
+      add(it->first, it->second);
+    }
+    m_pending.erase(done, m_pending.end());
+  }
+
+  // Blocks until every recorded command has completed and adds them all
+  void collect_all() {
+    for (auto& [name, e] : m_pending) {
+      e.wait();
+      add(name, e);
+    }
+    m_pending.clear();
+  }
+
+  // Statistics of every command name seen, in alphabetical order
+  std::vector<kernel_stats> stats() const {
+    std::vector<kernel_stats> result;
+    for (auto const& [name, w] : m_windows) {
+      size_t n = w.exec_ms.size();
+      double exec_sum = 0;
+      double wait_sum = 0;
+      for (size_t i = 0; i < n; i++) {
+        exec_sum += w.exec_ms[i];
+        wait_sum += w.wait_ms[i];
+      }
+      auto [lo, hi] = std::minmax_element(w.exec_ms.begin(), w.exec_ms.end());
+      result.push_back({name, n, exec_sum / double(n), *lo, *hi,
+                        wait_sum / double(n)});
+    }
+    return result;
+  }
+
+  // Device execution time collected since the last call
+  double take_busy_ms() { return std::exchange(m_busy_ms, 0.0); }
+
+  // Events dropped because collect() wasn't called often enough
+  size_t dropped() const { return m_dropped; }
+
+  // Forgets the statistics, but keeps the pending events
+  void reset() {
+    m_windows.clear();
+    m_busy_ms = 0;
+    m_dropped = 0;
+  }
+};
+
+/* A queue together with the profiler its command groups are recorded by, if
+ * any. The helpers building the solver structures and running the other
+ * passes of a step take one instead of a plain queue, so their kernels show
+ * up next to the force kernels. A plain queue converts to one that doesn't
+ * record anything. */
+class ProfiledQueue {
+  sycl::queue* m_q;
+  KernelProfiler* m_profiler;
+
+ public:
+  ProfiledQueue(sycl::queue& q, KernelProfiler* profiler = nullptr)
+      : m_q(&q), m_profiler(profiler) {}
+
+  // Submits the command group and records its event as the command `name`,
+  // which must be a string literal
+  template <typename CGF>
+  sycl::event submit(const char* name, CGF&& cgf) {
+    sycl::event e = m_q->submit(std::forward<CGF>(cgf));
+    if (m_profiler) {
+      m_profiler->record(name, e);
+    }
+    return e;
+  }
+
+  sycl::queue& queue() const { return *m_q; }
+};
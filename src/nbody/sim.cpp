@@ -25,9 +25,21 @@ void GravSim<float>::step() {
   this->internal_step();
 }
 
-/* Doubles disabled.
+template <>
+void GravSim<float>::step(size_t n_steps) {
+  for (size_t i = 0; i < n_steps; i++) {
+    this->internal_step();
+  }
+}
+
 template <>
 void GravSim<double>::step() {
-        this->_step();
+  this->internal_step();
+}
+
+template <>
+void GravSim<double>::step(size_t n_steps) {
+  for (size_t i = 0; i < n_steps; i++) {
+    this->internal_step();
+  }
 }
-*/
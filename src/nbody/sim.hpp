@@ -21,21 +21,33 @@
 #pragma once
 
 #include "../include/double_buf.hpp"
+#include "barnes_hut.hpp"
+#include "block_steps.hpp"
+#include "body_layout.hpp"
+#include "body_order.hpp"
+#include "cell_list.hpp"
+#include "checkpoint.hpp"
+#include "diagnostics.hpp"
+#include "distributions.hpp"
+#include "forces.hpp"
 #include "integrator.hpp"
+#include "neighbour_list.hpp"
+#include "pme.hpp"
+#include "profiler.hpp"
 #include "sycl_bufs.hpp"
 #include "tuple_utils.hpp"
 
 #include <sycl/sycl.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <memory>
 #include <random>
-
-// Convenience types
-template <typename num_t>
-using vec3 = sycl::vec<num_t, 3>;
-
-class MyKernel;
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 // Template to generate unique kernel name types
 template <typename T, size_t Z>
@@ -52,27 +64,11 @@ const auto except_handler = [](sycl::exception_list el) {
   }
 };
 
-// Initial cylinder distribution parameters
-template <typename num_t>
-struct distrib_cylinder {
-  sycl::vec<num_t, 2> radius;
-  sycl::vec<num_t, 2> angle;
-  sycl::vec<num_t, 2> height;
-  num_t speed;
-};
-
-// Data describing a single charged particle
-template <typename num_t>
-struct particle_data {
-  num_t charge;
-  sycl::vec<num_t, 3> pos;
-};
-
-// Initial sphere distribution parameters
-template <typename num_t>
-struct distrib_sphere {
-  sycl::vec<num_t, 2> radius;
-};
+// If the vector returned by get_info<double_fp_config> is length 0, doubles
+// are not supported by the SYCL device
+inline bool supports_doubles(const sycl::device& dev) {
+  return dev.get_info<sycl::info::device::double_fp_config>().size() != 0;
+}
 
 // The kind of force to simulate
 enum class force_t {
@@ -85,6 +81,83 @@ enum class force_t {
 enum class integrator_t {
   EULER,
   RK4,
+  // Kick-drift-kick leapfrog with velocities kept half a step behind the
+  // positions, so the two half kicks between drifts merge into one kernel
+  LEAPFROG,
+  // Velocity Verlet with synchronised velocities, reusing the acceleration
+  // cached by the previous step
+  VELOCITY_VERLET,
+  // Leapfrog with a power-of-two time step per body, chosen from its
+  // acceleration. Direct summation only.
+  BLOCK_LEAPFROG,
+};
+
+// How the force kernels traverse the other bodies
+enum class kernel_t {
+  // Every work-item reads all positions straight from global memory
+  NAIVE,
+  // Work-groups stage tiles of positions in local memory and share them
+  TILED,
+  // Evaluates every unordered pair of bodies once and applies the result to
+  // both, halving the arithmetic. Direct sum only, without RK4.
+  SYMMETRIC,
+};
+
+// How the direct sum kernels read the positions and weights of other bodies
+enum class layout_t {
+  // Straight from the simulation's vec3 positions, plus a separate charge
+  // stream for Coulomb
+  VEC3,
+  // Position and weight packed into one vec4 per body
+  PACKED,
+  // Separate arrays for every coordinate and the weight
+  SOA,
+};
+
+// Template to generate unique kernel name types for the direct sum kernels,
+// which are instantiated once per body layout, accumulation type and
+// integrator
+template <typename T, size_t Z, layout_t Layout, typename Acc,
+          integrator_t Integrator>
+class direct_kernel {};
+
+// Template to generate unique kernel name types for the symmetric pair
+// kernels, which don't depend on the integrator
+template <typename T, size_t ForceId, layout_t Layout, typename Acc>
+class symmetric_kernel {};
+
+// How the forces between bodies are evaluated
+enum class solver_t {
+  // Sum over all pairs of bodies, O(N^2)
+  DIRECT,
+  // Approximate distant groups of bodies with an octree, O(N log N). Only
+  // supports gravity.
+  BARNES_HUT,
+  // Only visit bodies in neighbouring cells of a grid, O(N). Only supports
+  // Lennard-Jones, which is truncated at the cutoff radius.
+  CELL_LIST,
+  // Like the cell list, but builds Verlet neighbour lists with a skin
+  // distance which are reused until a body has moved by half the skin
+  NEIGHBOUR_LIST,
+  // Particle-mesh Ewald: periodic Coulomb forces in a cubic box, split into
+  // a short-range sum over a periodic cell list and a long-range part solved
+  // with FFTs on a mesh, O(N + K^3 log K). Only supports Coulomb.
+  PME,
+};
+
+// Template to generate unique kernel name types for the approximate solvers,
+// which are instantiated once per integrator
+template <typename T, solver_t Solver, integrator_t Integrator>
+class solver_kernel {};
+
+// Error of an approximate solver relative to direct summation
+template <typename num_t>
+struct accuracy_report {
+  // Root mean square and maximum of |a - a_direct| / |a_direct|
+  num_t rms_error;
+  num_t max_error;
+  // How many bodies were compared
+  size_t n_samples;
 };
 
 template <typename num_t>
@@ -100,9 +173,6 @@ class GravSim {
   // The number of bodies partaking in the simulation
   size_t m_n_bodies;
 
-  // The size of a single timestep
-  static constexpr num_t STEP_SIZE = num_t(.5);
-
   // The current time of the simulation
   num_t m_time;
 
@@ -118,78 +188,184 @@ class GravSim {
   struct {
     num_t eps = 1;
     num_t sigma = 1e-3;
+    // Interactions beyond this distance are ignored by the cell list and
+    // neighbour list solvers
+    num_t cutoff = 2.5;
+    // Extra distance added to the cutoff when building neighbour lists
+    num_t skin = 0.5;
   } m_lj_params;
 
   // Which integrator to use
   integrator_t m_integrator;
 
+  // Acceleration at the current positions, cached by velocity Verlet
+  std::unique_ptr<sycl::buffer<vec3<num_t>, 1>> m_accel = nullptr;
+  bool m_accel_cached = false;
+
+  // Whether the velocities have been staggered for leapfrog integration
+  bool m_leapfrog_staggered = false;
+
+  // Block time step settings. Bodies take steps of STEP_SIZE / 2^rung, with
+  // rungs up to max_rung chosen so that accel * dt^2 stays below eta.
+  struct {
+    uint32_t max_rung = 4;
+    num_t eta = num_t(1e-2);
+  } m_block_params;
+
+  // Rungs and active lists of the block time step leapfrog
+  std::unique_ptr<BlockSteps<num_t>> m_block_steps = nullptr;
+
+  // Whether the block time step velocities have been kicked half a step ahead
+  bool m_block_started = false;
+
+  // Which force kernel variant to launch
+  kernel_t m_kernel;
+
+  // Work-group size, and so the number of bodies per tile, of the tiled kernel
+  size_t m_tile_size;
+
+  // Accelerations summed by the symmetric kernel, three values per body
+  std::unique_ptr<sycl::buffer<num_t, 1>> m_pair_accel = nullptr;
+
+  // Which layout the direct sum kernels read other bodies from
+  layout_t m_layout;
+
+  // Whether the device supports double precision arithmetic
+  bool m_supports_doubles;
+
+  // Whether the direct sum kernels accumulate forces in double precision
+  bool m_double_accum = false;
+
+  // Whether the direct sum kernels take the force parameters from
+  // specialisation constants
+  bool m_specialise_forces = false;
+
+  // Copies of the positions and weights in the non-default layouts, refreshed
+  // every step by the direct sum solver
+  std::unique_ptr<PackedBodies<num_t>> m_packed_bodies = nullptr;
+  std::unique_ptr<SoaBodies<num_t>> m_soa_bodies = nullptr;
+
+  // Which solver to evaluate forces with
+  solver_t m_solver;
+
+  // Barnes-Hut opening angle, larger values are faster but less accurate
+  num_t m_bh_theta = num_t(0.5);
+
+  // Octree rebuilt every step by the Barnes-Hut solver
+  std::unique_ptr<Octree<num_t>> m_octree = nullptr;
+
+  // Cell grid rebuilt every step by the cell list solver
+  std::unique_ptr<CellList<num_t>> m_cell_list = nullptr;
+
+  // Neighbour lists kept between steps by the neighbour list solver
+  std::unique_ptr<NeighbourList<num_t>> m_neighbour_list = nullptr;
+
+  // Particle-mesh Ewald settings. The periodic box spans [0, box) along
+  // every axis, the mesh has grid^3 points with grid a power of two.
+  struct {
+    num_t box = 50;
+    num_t cutoff = 6.25;
+    uint32_t grid = 64;
+  } m_pme_params;
+
+  // Mesh and cell list of the particle-mesh Ewald solver
+  std::unique_ptr<ParticleMeshEwald<num_t>> m_pme = nullptr;
+
+  // Morton order the bodies are sorted into every m_reorder_every steps if
+  // that isn't zero, created by the first reorder
+  std::unique_ptr<BodyOrder<num_t>> m_body_order = nullptr;
+  size_t m_reorder_every = 0;
+
+  // Energy and momentum sums, enqueued every m_diagnostics_every steps if
+  // that isn't zero
+  Diagnostics<num_t> m_diagnostics;
+  size_t m_diagnostics_every = 0;
+  size_t m_step_count = 0;
+
+  // Staging copy and background thread of save_checkpoint
+  std::unique_ptr<CheckpointWriter<num_t>> m_checkpoint_writer = nullptr;
+
+  // Device timings of the command groups submitted through submit() and
+  // the helpers given profiled_queue()
+  KernelProfiler m_profiler;
+
+  // The queue with its command groups recorded by the profiler
+  ProfiledQueue profiled_queue() { return {m_q, &m_profiler}; }
+
+  // Submits the command group and hands its event to the profiler
+  template <typename CGF>
+  sycl::event submit(const char* name, CGF&& cgf) {
+    return profiled_queue().submit(name, std::forward<CGF>(cgf));
+  }
+
+  // Sets a parameter the forces depend on, dropping the acceleration cached
+  // by velocity Verlet if it changes
+  template <typename T>
+  void set_force_param(T& param, T value) {
+    if (param != value) {
+      m_accel_cached = false;
+    }
+    param = value;
+  }
+
+  // Samples every body of the distribution in its own work-item into the
+  // write buffers
+  template <size_t Z, typename Distrib>
+  void submit_sample(Distrib params, uint64_t seed) {
+    submit("sample", [&](sycl::handler& cgh) {
+      auto accs = m_bufs.write().gen_write_accs(cgh, write_bufs_t<0, 1>{});
+      auto vel = std::get<0>(accs);
+      auto pos = std::get<1>(accs);
+
+      cgh.parallel_for<kernel<num_t, Z>>(
+          sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            vec3<num_t> v;
+            vec3<num_t> x;
+            sample_body(seed, id, params, v, x);
+            vel[id] = v;
+            pos[id] = x;
+          });
+    });
+  }
+
   // Base constructor, does not initialize simulation values
   GravSim(size_t n_bodies)
-      : m_q(sycl::default_selector_v, except_handler),
+      : m_q(sycl::default_selector_v, except_handler,
+            {sycl::property::queue::enable_profiling()}),
         m_bufs(n_bodies),
         m_n_bodies(n_bodies),
         m_time(0),
-        m_force(force_t::GRAVITY) {}
+        m_force(force_t::GRAVITY),
+        m_integrator(integrator_t::EULER),
+        m_kernel(kernel_t::NAIVE),
+        m_layout(layout_t::VEC3),
+        m_supports_doubles(::supports_doubles(m_q.get_device())),
+        m_solver(solver_t::DIRECT) {
+    if (std::is_same_v<num_t, double> && !m_supports_doubles) {
+      throw std::runtime_error("The device doesn't support doubles!");
+    }
+    set_tile_size(256);
+  }
 
  public:
-  // Initialize the simulation with a cylinder body distribution
-  GravSim(size_t n_bodies, distrib_cylinder<num_t> params) : GravSim(n_bodies) {
-    // Generates points uniformly distributed in a cylinder using cylindrical
-    // polar coordinates
-    std::mt19937 rng(std::random_device{}());
-    auto rmin = params.radius.x();
-    auto rmax = params.radius.y();
-    std::uniform_real_distribution<num_t> unifr(rmin * rmin, rmax * rmax);
-    std::uniform_real_distribution<num_t> unifp(params.angle.x(),
-                                                params.angle.y());
-    std::uniform_real_distribution<num_t> unify(params.height.x(),
-                                                params.height.y());
-
-    auto accs = m_bufs.write().gen_host_write_accs(write_bufs_t<0, 1>{});
-    for (size_t i = 0; i < m_n_bodies; i++) {
-      auto r = sycl::sqrt(unifr(rng));
-      auto phi = unifp(rng);
-
-      // Velocity tangential to the circular cylinder slice is given
-      // by the derivative of position w.r.t phi
-      std::get<0>(accs)[i] = {-r * sycl::sin(phi), num_t(0),
-                              r * sycl::cos(phi)};
-      // Adjust to make chosen speed the speed of outermost bodies
-      std::get<0>(accs)[i] *= params.speed / params.radius.y();
-      std::get<1>(accs)[i] = {r * sycl::cos(phi), unify(rng),
-                              r * sycl::sin(phi)};
-    }
+  // Initialize the simulation with a cylinder body distribution, sampled on
+  // the device. The same seed always gives the same bodies.
+  GravSim(size_t n_bodies, distrib_cylinder<num_t> params,
+          uint64_t seed = random_seed())
+      : GravSim(n_bodies) {
+    submit_sample<16>(params, seed);
 
     // Make newly-written data the read-buffer
     m_bufs.swap();
   }
 
-  // Initialize the simulation with a sphere body distribution
-  GravSim(size_t n_bodies, distrib_sphere<num_t> params) : GravSim(n_bodies) {
-    // Generates a uniform spherical distribution from spherical coordinates
-    std::mt19937 rng(std::random_device{}());
-    std::uniform_real_distribution<num_t> unifp(0, 2 * 3.141592f);
-    std::uniform_real_distribution<num_t> unifcost(-1, 1);
-    auto rmin = params.radius.x();
-    auto rmax = params.radius.y();
-    std::uniform_real_distribution<num_t> unifu(rmin * rmin * rmin,
-                                                rmax * rmax * rmax);
-
-    auto accs = m_bufs.write().gen_host_write_accs(write_bufs_t<0, 1>{});
-
-    for (size_t i = 0; i < m_n_bodies; i++) {
-      auto r = sycl::pow(unifu(rng), num_t(1) / num_t(3));
-      auto cost = unifcost(rng);
-      auto sint = sycl::sqrt(1 - cost * cost);
-      auto phi = unifp(rng);
-      auto x = r * sint * sycl::cos(phi);
-      auto y = r * sint * sycl::sin(phi);
-      auto z = r * cost;
-
-      // Spherical distribution gives no initial velocity to bodies
-      std::get<0>(accs)[i] = {0, 0, 0};
-      std::get<1>(accs)[i] = {x, y, z};
-    }
+  // Initialize the simulation with a sphere body distribution, sampled on
+  // the device
+  GravSim(size_t n_bodies, distrib_sphere<num_t> params,
+          uint64_t seed = random_seed())
+      : GravSim(n_bodies) {
+    submit_sample<17>(params, seed);
 
     // Make newly-written data the read-buffer
     m_bufs.swap();
@@ -215,157 +391,831 @@ class GravSim {
     m_bufs.swap();
   }
 
+  // Initialize a Coulomb simulation at rest from separate arrays of charges
+  // and positions, copied to the device without going through the host
+  // accessors
+  GravSim(const std::vector<num_t>& charges,
+          const std::vector<vec3<num_t>>& pos)
+      : GravSim(pos.size()) {
+    m_coulomb_charges_buf =
+        std::unique_ptr<SyclBufs<num_t>>(new SyclBufs<num_t>(m_n_bodies));
+
+    m_q.submit([&](sycl::handler& cgh) {
+      cgh.fill(std::get<0>(
+                   m_bufs.write().gen_write_accs(cgh, write_bufs_t<0>{})),
+               vec3<num_t>(0));
+    });
+    m_q.submit([&](sycl::handler& cgh) {
+      cgh.copy(pos.data(), std::get<0>(m_bufs.write().gen_write_accs(
+                               cgh, write_bufs_t<1>{})));
+    });
+    m_q.submit([&](sycl::handler& cgh) {
+      cgh.copy(charges.data(),
+               std::get<0>(m_coulomb_charges_buf->gen_write_accs(
+                   cgh, write_bufs_t<0>{})));
+    });
+    // The vectors may go out of scope once the constructor returns
+    m_q.wait();
+
+    // Make newly-written data the read-buffer
+    m_bufs.swap();
+  }
+
+  /* Restart a simulation from a checkpoint written by save_checkpoint. The
+   * bodies are copied to the device straight from the mapped file, which
+   * must stay open until the constructor returns. The force, integrator and
+   * force parameters are restored too, other settings start from their
+   * defaults. */
+  explicit GravSim(const MappedCheckpoint& checkpoint)
+      : GravSim(checkpoint.header().n_bodies) {
+    checkpoint.check_types<num_t>();
+    auto const& header = checkpoint.header();
+    // Values from a corrupt or newer file would slip through every switch
+    if (header.force > uint32_t(force_t::COULOMB) ||
+        header.integrator > uint32_t(integrator_t::BLOCK_LEAPFROG)) {
+      throw std::runtime_error(
+          "The checkpoint has an unknown force or integrator!");
+    }
+    m_time = num_t(header.time);
+    m_force = force_t(header.force);
+    m_integrator = integrator_t(header.integrator);
+    m_leapfrog_staggered = header.leapfrog_staggered;
+    m_grav_params.G = num_t(header.grav_G);
+    m_grav_params.damping = num_t(header.grav_damping);
+    m_lj_params.eps = num_t(header.lj_eps);
+    m_lj_params.sigma = num_t(header.lj_sigma);
+    m_lj_params.cutoff = num_t(header.lj_cutoff);
+    m_lj_params.skin = num_t(header.lj_skin);
+
+    m_q.submit([&](sycl::handler& cgh) {
+      cgh.copy(checkpoint.velocities<num_t>(),
+               std::get<0>(
+                   m_bufs.write().gen_write_accs(cgh, write_bufs_t<0>{})));
+    });
+    m_q.submit([&](sycl::handler& cgh) {
+      cgh.copy(checkpoint.positions<num_t>(),
+               std::get<0>(
+                   m_bufs.write().gen_write_accs(cgh, write_bufs_t<1>{})));
+    });
+    if (header.has_charges) {
+      m_coulomb_charges_buf =
+          std::unique_ptr<SyclBufs<num_t>>(new SyclBufs<num_t>(m_n_bodies));
+      m_q.submit([&](sycl::handler& cgh) {
+        cgh.copy(checkpoint.charges<num_t>(),
+                 std::get<0>(m_coulomb_charges_buf->gen_write_accs(
+                     cgh, write_bufs_t<0>{})));
+      });
+    }
+    // The mapping may be closed once the constructor returns
+    m_q.wait();
+
+    // Make newly-written data the read-buffer
+    m_bufs.swap();
+  }
+
+  // The size of a single timestep
+  static constexpr num_t STEP_SIZE = num_t(.5);
+
+  // Number of bodies per tile of the symmetric kernel. Every work-item keeps
+  // a private sum for each body of one tile.
+  static constexpr size_t SYMMETRIC_TILE = 16;
+
+  // Use the chosen integrator to advance the velocity and position of a body
+  // in place, given a function computing the acceleration on the body. Also
+  // used by the kernels of the USM backend. For VELOCITY_VERLET, replaces the
+  // velocity with the acceleration.
+  template <integrator_t Integrator, typename Func>
+  static void integrate(const Func& accel, vec3<num_t>& vel, vec3<num_t>& pos,
+                        num_t t) {
+    if constexpr (Integrator == integrator_t::EULER) {
+      integrate_step_euler(accel, STEP_SIZE, vel, pos, t);
+    } else if constexpr (Integrator == integrator_t::RK4) {
+      integrate_step_rk4(accel, STEP_SIZE, vel, pos, t);
+    } else if constexpr (Integrator == integrator_t::LEAPFROG) {
+      integrate_step_leapfrog(accel, STEP_SIZE, vel, pos, t);
+    } else if constexpr (Integrator == integrator_t::VELOCITY_VERLET) {
+      // The velocity Verlet force pass only evaluates the acceleration, the
+      // kicks and drift run in separate kernels around it
+      vel = accel(vel, pos, t);
+    } else {
+      static_assert(Integrator != integrator_t::BLOCK_LEAPFROG,
+                    "Block time steps have their own kernels");
+    }
+  }
+
   void step();
 
+  /* Enqueues `n_steps` steps back to back. Buffers are swapped on the host
+   * without waiting for the device, so the steps only synchronise with each
+   * other through buffer dependencies. The neighbour list solver reads its
+   * displacement checks back asynchronously and only waits for the device
+   * when it gets more than a few steps ahead, or to rebuild the lists. */
+  void step(size_t n_steps);
+
   void sync_queue() { m_q.wait(); }
 
-  void set_force_type(force_t force) { m_force = force; }
+  // The queue the simulation runs on, e.g. to allocate host USM for copyTo
+  sycl::queue get_queue() const { return m_q; }
+
+  void set_force_type(force_t force) { set_force_param(m_force, force); }
+
+  void set_integrator(integrator_t integrator) {
+    if (integrator != m_integrator) {
+      m_accel_cached = false;
+      m_leapfrog_staggered = false;
+      m_block_started = false;
+    }
+    m_integrator = integrator;
+  }
+
+  void set_kernel(kernel_t kernel) { m_kernel = kernel; }
+
+  // Set the tile size of the tiled kernel, clamped to the device limit
+  void set_tile_size(size_t tile_size) {
+    auto max_size =
+        m_q.get_device().get_info<sycl::info::device::max_work_group_size>();
+    m_tile_size = std::max<size_t>(1, std::min(tile_size, max_size));
+  }
+
+  size_t get_tile_size() const { return m_tile_size; }
+
+  void set_layout(layout_t layout) { m_layout = layout; }
+
+  bool supports_doubles() const { return m_supports_doubles; }
+
+  /* Accumulate the pairwise forces of the direct sum kernels in double
+   * precision while keeping the bodies in num_t, so that large sums don't
+   * lose the contributions of distant bodies. Requires device support for
+   * doubles. */
+  void set_double_accumulation(bool double_accum) {
+    if (double_accum && !m_supports_doubles) {
+      throw std::runtime_error(
+          "The device doesn't support double precision accumulation!");
+    }
+    m_double_accum = double_accum;
+  }
+
+  // Bytes the direct sum kernels read from global memory per pairwise
+  // interaction. The tiled kernel shares every read across a work-group.
+  double bytes_per_interaction() const {
+    size_t weight_bytes = m_force == force_t::COULOMB ? sizeof(num_t) : 0;
+    size_t bytes = 0;
+    switch (m_layout) {
+      case layout_t::VEC3:
+        bytes = sizeof(vec3<num_t>) + weight_bytes;
+        break;
+      case layout_t::PACKED:
+        bytes = sizeof(sycl::vec<num_t, 4>);
+        break;
+      case layout_t::SOA:
+        bytes = 4 * sizeof(num_t);
+        break;
+    }
+    switch (m_kernel) {
+      case kernel_t::TILED:
+        return double(bytes) / double(m_tile_size);
+      case kernel_t::SYMMETRIC:
+        // Both tiles are read once for all pairs between them
+        return double(bytes) / double(SYMMETRIC_TILE);
+      default:
+        return double(bytes);
+    }
+  }
+
+  /* Pass the force parameters to the direct sum kernels as specialisation
+   * constants, so that the JIT compiler can fold them into the force loop.
+   * Every new combination of parameter values compiles the kernels again. */
+  void set_specialise_forces(bool specialise) {
+    m_specialise_forces = specialise;
+  }
+
+  void set_solver(solver_t solver) { set_force_param(m_solver, solver); }
+
+  // Set the deepest block time step rung and the step accuracy parameter
+  void set_block_steps(uint32_t max_rung, num_t eta) {
+    max_rung = std::min(max_rung, BlockSteps<num_t>::MAX_RUNG);
+    if (max_rung != m_block_params.max_rung) {
+      // Bodies on rungs beyond a lower maximum took their last half kick
+      // with a time step they can no longer have, so the rungs are chosen
+      // again from scratch
+      m_block_started = false;
+    }
+    m_block_params.max_rung = max_rung;
+    m_block_params.eta = eta;
+  }
+
+  // Set the Barnes-Hut opening angle
+  void set_bh_theta(num_t theta) { set_force_param(m_bh_theta, theta); }
+
+  // Set the side of the periodic box of the particle-mesh Ewald solver
+  void set_pme_box(num_t box) { set_force_param(m_pme_params.box, box); }
+
+  // Set the cutoff of the short-range part of the particle-mesh Ewald solver,
+  // at most a third of the box
+  void set_pme_cutoff(num_t cutoff) {
+    set_force_param(m_pme_params.cutoff, cutoff);
+  }
+
+  // Set the mesh points along every axis of the particle-mesh Ewald solver
+  void set_pme_grid(uint32_t grid) {
+    if (grid < 4 || (grid & (grid - 1)) != 0) {
+      throw std::runtime_error(
+          "The particle-mesh Ewald grid must be a power of two of at least "
+          "4!");
+    }
+    set_force_param(m_pme_params.grid, grid);
+  }
+
+  // The number of bodies partaking in the simulation
+  size_t n_bodies() const { return m_n_bodies; }
 
-  void set_integrator(integrator_t integrator) { m_integrator = integrator; }
+  // The number of steps taken since the simulation was created
+  size_t step_count() const { return m_step_count; }
+
+  // The number of pairwise interactions evaluated by a single step. For the
+  // approximate solvers this is the direct summation equivalent.
+  size_t interactions_per_step() const {
+    size_t evals = m_integrator == integrator_t::RK4 ? 4 : 1;
+    return evals * m_n_bodies * m_n_bodies;
+  }
+
+  // Floating point operations of the interactions of a single step, also as
+  // the direct summation equivalent
+  size_t flops_per_step() const {
+    size_t flops = 0;
+    switch (m_force) {
+      case force_t::GRAVITY:
+        flops = gravity_force<num_t>::FLOPS;
+        break;
+      case force_t::LENNARD_JONES:
+        flops = lennard_jones_force<num_t>::FLOPS;
+        break;
+      case force_t::COULOMB:
+        flops = coulomb_force<num_t>::FLOPS;
+        break;
+    }
+    return flops * interactions_per_step();
+  }
 
   // Set gravity damping
-  void set_grav_damping(num_t damping) { m_grav_params.damping = damping; }
+  void set_grav_damping(num_t damping) {
+    set_force_param(m_grav_params.damping, damping);
+  }
 
   // Set gravitational constant
-  void set_grav_G(num_t G) { m_grav_params.G = G; }
+  void set_grav_G(num_t G) { set_force_param(m_grav_params.G, G); }
 
   // Set Lennard-Jones potential well depth
-  void set_lj_eps(num_t eps) { m_lj_params.eps = eps; }
+  void set_lj_eps(num_t eps) { set_force_param(m_lj_params.eps, eps); }
 
   // Set Lennard-Jones zero-potential distance
-  void set_lj_sigma(num_t sigma) { m_lj_params.sigma = sigma; }
+  void set_lj_sigma(num_t sigma) {
+    set_force_param(m_lj_params.sigma, sigma);
+  }
+
+  // Set Lennard-Jones cutoff radius used by the cell and neighbour list
+  // solvers
+  void set_lj_cutoff(num_t cutoff) {
+    set_force_param(m_lj_params.cutoff, cutoff);
+  }
+
+  // Set the neighbour list skin distance
+  void set_lj_skin(num_t skin) { m_lj_params.skin = skin; }
+
+  // How often the neighbour lists have been rebuilt
+  size_t neighbour_list_rebuilds() const {
+    return m_neighbour_list ? m_neighbour_list->n_rebuilds() : 0;
+  }
+
+  /* Sorts the bodies along a Morton curve every `every` steps, 0 turns it
+   * off. Nearby bodies then also sit close together in memory, which helps
+   * the caches of the approximate solvers. copyTo and checkpoints still
+   * write the bodies in their original order. */
+  void set_reorder_interval(size_t every) { m_reorder_every = every; }
 
-  // Calls the provided function with body position data
+  // How often the bodies have been reordered
+  size_t n_reorders() const {
+    return m_body_order ? m_body_order->n_sorts() : 0;
+  }
+
+  // Calls the provided function with body position data, in the current
+  // order of the bodies
   template <typename Func, size_t VarId>
   void with_mapped(read_bufs_t<VarId>, Func&& func) {
     auto acc = m_bufs.read().gen_host_read_accs(read_bufs_t<VarId>{});
     func(std::get<0>(acc).get_pointer());
   }
 
-  // Copy buffer contents into the dest pointer (host or device)
+  // Copy buffer contents into the dest pointer (host or device), in the
+  // original order of the bodies
   template <size_t VarId>
   sycl::event copyTo(void* dest) {
-    return m_q.submit([&](sycl::handler& cgh) {
+    if (m_body_order) {
+      return m_body_order->copy_in_id_order(
+          profiled_queue(), m_bufs.read().template get_buf<VarId>(), dest);
+    }
+    return submit("copy", [&](sycl::handler& cgh) {
       cgh.copy(
           std::get<0>(m_bufs.read().gen_read_accs(cgh, read_bufs_t<VarId>{})),
           dest);
     });
   }
 
+  /* Writes the bodies, time, force and integrator to `path` in the
+   * background. Only the copy of the bodies into host staging memory is
+   * enqueued here, later steps can run while the file is written. Waits for
+   * a previous checkpoint still being written first. */
+  void save_checkpoint(const std::string& path) {
+    if (m_block_started) {
+      throw std::runtime_error(
+          "Block time step runs can't be checkpointed, the rungs aren't "
+          "saved!");
+    }
+    if (!m_checkpoint_writer) {
+      m_checkpoint_writer = std::make_unique<CheckpointWriter<num_t>>(m_q);
+    }
+
+    auto header = make_checkpoint_header<num_t>(
+        m_n_bodies, m_coulomb_charges_buf != nullptr);
+    header.time = m_time;
+    header.force = uint32_t(m_force);
+    header.integrator = uint32_t(m_integrator);
+    header.leapfrog_staggered = m_leapfrog_staggered;
+    header.grav_G = m_grav_params.G;
+    header.grav_damping = m_grav_params.damping;
+    header.lj_eps = m_lj_params.eps;
+    header.lj_sigma = m_lj_params.sigma;
+    header.lj_cutoff = m_lj_params.cutoff;
+    header.lj_skin = m_lj_params.skin;
+
+    auto& writer = *m_checkpoint_writer;
+    writer.reserve(m_n_bodies);
+    std::vector<sycl::event> copies{copyTo<0>(writer.velocities()),
+                                    copyTo<1>(writer.positions())};
+    if (m_coulomb_charges_buf && m_body_order) {
+      copies.push_back(m_body_order->copy_in_id_order(
+          profiled_queue(), m_coulomb_charges_buf->template get_buf<0>(),
+          writer.charges()));
+    } else if (m_coulomb_charges_buf) {
+      copies.push_back(submit("copy", [&](sycl::handler& cgh) {
+        cgh.copy(std::get<0>(m_coulomb_charges_buf->gen_read_accs(
+                     cgh, read_bufs_t<0>{})),
+                 writer.charges());
+      }));
+    }
+    writer.write_async(header, path, std::move(copies));
+  }
+
+  /* Enqueues a pass summing the energy and momentum of the bodies on the
+   * device, which diagnostics() reads back. With leapfrog integration, the
+   * velocities are half a step ahead of the positions. */
+  void submit_diagnostics() {
+    auto q = profiled_queue();
+    auto& bufs = m_bufs.read();
+    auto* charges = m_coulomb_charges_buf
+                        ? &m_coulomb_charges_buf->template get_buf<0>()
+                        : nullptr;
+    switch (m_force) {
+      case force_t::GRAVITY:
+        m_diagnostics.template submit<0>(
+            q, bufs.template get_buf<0>(), bufs.template get_buf<1>(),
+            gravity_force<num_t>{m_grav_params.G, m_grav_params.damping},
+            nullptr, m_step_count);
+        break;
+      case force_t::LENNARD_JONES:
+        m_diagnostics.template submit<1>(
+            q, bufs.template get_buf<0>(), bufs.template get_buf<1>(),
+            lennard_jones_force<num_t>{num_t(24) * m_lj_params.eps *
+                                       m_lj_params.sigma},
+            nullptr, m_step_count);
+        break;
+      case force_t::COULOMB:
+        if (!charges) {
+          throw std::runtime_error("Coulomb charges weren't initialized!");
+        }
+        m_diagnostics.template submit<2>(
+            q, bufs.template get_buf<0>(), bufs.template get_buf<1>(),
+            coulomb_force<num_t>{}, charges, m_step_count);
+        break;
+    }
+  }
+
+  // Enqueues submit_diagnostics() after every `every` steps, 0 disables it
+  void set_diagnostics_interval(size_t every) { m_diagnostics_every = every; }
+
+  // The sums of the last diagnostics pass, blocks until they are available
+  diagnostics_report<num_t> diagnostics() { return m_diagnostics.read(); }
+
+  /* Execution times of every kernel and copy of a step, recorded once
+   * enabled, including the solver structure builds, the reordering and the
+   * layout and diagnostics passes */
+  KernelProfiler& profiler() { return m_profiler; }
+
+  // Blocks until the last checkpoint is written, rethrows its errors
+  void wait_checkpoint() {
+    if (m_checkpoint_writer) {
+      m_checkpoint_writer->wait();
+    }
+  }
+
+  /* Compares the Barnes-Hut accelerations of up to `n_samples` bodies, spread
+   * evenly over all bodies, with direct summation. Blocks until the result is
+   * available. */
+  accuracy_report<num_t> check_barnes_hut_accuracy(size_t n_samples) {
+    n_samples = std::max<size_t>(1, std::min(n_samples, m_n_bodies));
+    build_octree();
+
+    sycl::buffer<num_t, 1> errors_buf{sycl::range<1>(n_samples)};
+    submit("accuracy check", [&](sycl::handler& cgh) {
+      auto pos =
+          std::get<0>(m_bufs.read().gen_read_accs(cgh, read_bufs_t<1>{}));
+      sycl::accessor errors(errors_buf, cgh, sycl::write_only, sycl::no_init);
+      typename Octree<num_t>::View tree(*m_octree, cgh, m_bh_theta);
+
+      gravity_force<num_t> force{m_grav_params.G, m_grav_params.damping};
+      size_t n_bodies = m_n_bodies;
+
+      cgh.parallel_for<kernel<num_t, 7>>(
+          sycl::range<1>(n_samples), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id() * n_bodies / n_samples;
+            auto x = pos[id];
+
+            vec3<num_t> direct(0);
+            for (size_t i = 0; i < n_bodies; i++) {
+              direct += force.pair(pos[i] - x, num_t(1), i == id);
+            }
+            direct = force.total(direct, num_t(1));
+
+            auto diff = tree.accel(force, pos, x, id) - direct;
+            errors[item] = sycl::sqrt(
+                (diff.x() * diff.x() + diff.y() * diff.y() +
+                 diff.z() * diff.z()) /
+                (direct.x() * direct.x() + direct.y() * direct.y() +
+                 direct.z() * direct.z()));
+          });
+    });
+
+    accuracy_report<num_t> report{0, 0, n_samples};
+    auto errors = errors_buf.get_host_access(sycl::read_only);
+    for (size_t i = 0; i < n_samples; i++) {
+      report.rms_error += errors[i] * errors[i];
+      report.max_error = std::max(report.max_error, errors[i]);
+    }
+    report.rms_error = std::sqrt(report.rms_error / num_t(n_samples));
+
+    return report;
+  }
+
  private:
+  // Rebuilds the octree from the current positions
+  void build_octree() {
+    if (!m_octree) {
+      m_octree = std::make_unique<Octree<num_t>>(m_n_bodies);
+    }
+    m_octree->build(profiled_queue(), m_bufs.read().template get_buf<1>());
+  }
+
+  // Rebuilds the cell grid from the current positions
+  void build_cell_list() {
+    if (!m_cell_list) {
+      m_cell_list = std::make_unique<CellList<num_t>>(m_n_bodies);
+    }
+    m_cell_list->build(profiled_queue(), m_bufs.read().template get_buf<1>(),
+                       m_lj_params.cutoff);
+  }
+
+  // Copies the current positions and weights into the selected layout
+  void update_layout() {
+    auto& positions = m_bufs.read().template get_buf<1>();
+    sycl::buffer<num_t, 1>* weights = nullptr;
+    if (m_force == force_t::COULOMB && m_coulomb_charges_buf) {
+      weights = &m_coulomb_charges_buf->template get_buf<0>();
+    }
+
+    if (m_layout == layout_t::PACKED) {
+      if (!m_packed_bodies) {
+        m_packed_bodies = std::make_unique<PackedBodies<num_t>>(m_n_bodies);
+      }
+      m_packed_bodies->update(profiled_queue(), positions, weights);
+    } else if (m_layout == layout_t::SOA) {
+      if (!m_soa_bodies) {
+        m_soa_bodies = std::make_unique<SoaBodies<num_t>>(m_n_bodies);
+      }
+      m_soa_bodies->update(profiled_queue(), positions, weights);
+    }
+  }
+
+  // Builds whatever the selected solver needs from the current positions
+  void prepare_solver() {
+    if (m_solver == solver_t::BARNES_HUT) {
+      if (m_force != force_t::GRAVITY) {
+        throw std::runtime_error(
+            "The Barnes-Hut solver only supports gravity!");
+      }
+      build_octree();
+    } else if (m_solver == solver_t::CELL_LIST) {
+      if (m_force != force_t::LENNARD_JONES) {
+        throw std::runtime_error(
+            "The cell list solver only supports Lennard-Jones!");
+      }
+      build_cell_list();
+    } else if (m_solver == solver_t::NEIGHBOUR_LIST) {
+      if (m_force != force_t::LENNARD_JONES) {
+        throw std::runtime_error(
+            "The neighbour list solver only supports Lennard-Jones!");
+      }
+      if (!m_neighbour_list) {
+        m_neighbour_list = std::make_unique<NeighbourList<num_t>>(m_n_bodies);
+      }
+      m_neighbour_list->update(profiled_queue(),
+                               m_bufs.read().template get_buf<1>(),
+                               m_lj_params.cutoff, m_lj_params.skin);
+    } else if (m_solver == solver_t::PME) {
+      if (m_force != force_t::COULOMB) {
+        throw std::runtime_error(
+            "The particle-mesh Ewald solver only supports Coulomb!");
+      }
+      if (!m_pme || m_pme->mesh_size() != m_pme_params.grid) {
+        m_pme = std::make_unique<ParticleMeshEwald<num_t>>(m_n_bodies,
+                                                           m_pme_params.grid);
+      }
+    } else if (m_layout != layout_t::VEC3) {
+      update_layout();
+    }
+  }
+
   void internal_step() {
-    m_q.submit([&](sycl::handler& cgh) {
+    if (m_integrator == integrator_t::BLOCK_LEAPFROG) {
+      block_step();
+    } else if (m_integrator == integrator_t::VELOCITY_VERLET) {
+      if (!m_accel_cached) {
+        prepare_solver();
+        submit_forces(integrator_t::VELOCITY_VERLET);
+        submit_kick(0);
+      }
+
+      // Half kick with the cached acceleration and drift, then the closing
+      // half kick with the acceleration at the new positions
+      submit_drift();
+      m_bufs.swap();
+      prepare_solver();
+      submit_forces(integrator_t::VELOCITY_VERLET);
+      submit_kick(STEP_SIZE / 2);
+    } else {
+      if (m_integrator == integrator_t::LEAPFROG && !m_leapfrog_staggered) {
+        // Move the velocities half a step back, so that the first full kick
+        // takes them half a step ahead of the positions
+        prepare_solver();
+        submit_forces(integrator_t::VELOCITY_VERLET);
+        submit_kick(-STEP_SIZE / 2);
+        m_leapfrog_staggered = true;
+      }
+
+      prepare_solver();
+      submit_forces(m_integrator);
+      m_bufs.swap();
+    }
+
+    m_time += STEP_SIZE;
+    m_step_count++;
+    if (m_diagnostics_every && m_step_count % m_diagnostics_every == 0) {
+      submit_diagnostics();
+    }
+    if (m_reorder_every && m_step_count % m_reorder_every == 0) {
+      reorder_bodies();
+    }
+  }
+
+  /* Sorts the bodies along a Morton curve and moves every per-body array
+   * into the new order. The octree and cell lists are rebuilt every step
+   * anyway, only the neighbour lists have to be rebuilt early. */
+  void reorder_bodies() {
+    if (!m_body_order) {
+      m_body_order = std::make_unique<BodyOrder<num_t>>(m_n_bodies);
+    }
+    auto& order = *m_body_order;
+    auto q = profiled_queue();
+    order.sort(q, m_bufs.read().template get_buf<1>());
+
+    order.gather(q, m_bufs.read().template get_buf<0>(),
+                 m_bufs.write().template get_buf<0>());
+    order.gather(q, m_bufs.read().template get_buf<1>(),
+                 m_bufs.write().template get_buf<1>());
+    m_bufs.swap();
+
+    if (m_coulomb_charges_buf) {
+      order.permute(q, m_coulomb_charges_buf->template get_buf<0>());
+    }
+    if (m_accel) {
+      order.permute(q, *m_accel);
+    }
+    if (m_block_steps) {
+      order.permute(q, m_block_steps->rungs());
+    }
+    if (m_neighbour_list) {
+      m_neighbour_list->invalidate();
+    }
+  }
+
+  /* Advances all bodies by STEP_SIZE in 2^max_rung sub-steps. Each sub-step
+   * drifts every body, then evaluates forces only for the bodies whose own
+   * step ends there, which kick their velocities through the end of that step
+   * and half way into their next one. All bodies stay in the read buffers. */
+  void block_step() {
+    if (m_solver != solver_t::DIRECT) {
+      throw std::runtime_error(
+          "Block time steps only support the direct sum solver!");
+    }
+    if (!m_block_steps) {
+      m_block_steps = std::make_unique<BlockSteps<num_t>>(m_n_bodies);
+    }
+
+    auto max_rung = m_block_params.max_rung;
+    if (!m_block_started) {
+      // All bodies are active at sub-step 0, and pick their first rung
+      m_block_steps->select_active(profiled_queue(), 0, max_rung);
+      submit_block_forces(0);
+      m_block_started = true;
+    }
+
+    uint32_t n_sub_steps = uint32_t(1) << max_rung;
+    for (uint32_t t = 1; t <= n_sub_steps; t++) {
+      submit_block_drift(STEP_SIZE / num_t(n_sub_steps));
+      m_block_steps->select_active(profiled_queue(), t, max_rung);
+      submit_block_forces(t);
+    }
+  }
+
+  // Drifts the positions of all bodies by `dt` in place
+  void submit_block_drift(num_t dt) {
+    submit("block drift", [&](sycl::handler& cgh) {
+      sycl::accessor vel(m_bufs.read().template get_buf<0>(), cgh,
+                         sycl::read_only);
+      sycl::accessor pos(m_bufs.read().template get_buf<1>(), cgh,
+                         sycl::read_write);
+
+      cgh.parallel_for<kernel<num_t, 12>>(
+          sycl::range<1>(m_n_bodies),
+          [=](sycl::item<1> item) { pos[item] += vel[item] * dt; });
+    });
+  }
+
+  // Evaluates the forces on the active bodies of sub-step `t` and kicks them
+  void submit_block_forces(uint32_t t) {
+    submit("block forces", [&](sycl::handler& cgh) {
+      switch (m_force) {
+        case force_t::GRAVITY:
+          submit_block_kick<0>(
+              cgh, t,
+              gravity_force<num_t>{m_grav_params.G, m_grav_params.damping},
+              unit_weights<num_t>{});
+          break;
+        case force_t::LENNARD_JONES:
+          submit_block_kick<1>(cgh, t,
+                               lennard_jones_force<num_t>{
+                                   num_t(24) * m_lj_params.eps *
+                                   m_lj_params.sigma},
+                               unit_weights<num_t>{});
+          break;
+        case force_t::COULOMB: {
+          if (!m_coulomb_charges_buf) {
+            throw std::runtime_error(
+                "Coulomb charge buffer wasn't initialized!");
+          }
+
+          auto charges_acc = std::get<0>(
+              m_coulomb_charges_buf->gen_read_accs(cgh, read_bufs_t<0>{}));
+          const auto charges = [=](size_t i) { return charges_acc[i]; };
+
+          submit_block_kick<2>(cgh, t, coulomb_force<num_t>{}, charges);
+        } break;
+      }
+    });
+  }
+
+  /* One work-item per body, of which only the first n_active look up an
+   * active body. Its velocity receives the closing half kick of the step it
+   * just finished and the opening half kick of the next, whose length is
+   * chosen from the new acceleration. At sub-step 0 there is no closing kick.
+   */
+  template <size_t ForceId, typename Force, typename Weights>
+  void submit_block_kick(sycl::handler& cgh, uint32_t t, Force force,
+                         Weights weights) {
+    sycl::accessor vel(m_bufs.read().template get_buf<0>(), cgh,
+                       sycl::read_write);
+    sycl::accessor pos(m_bufs.read().template get_buf<1>(), cgh,
+                       sycl::read_only);
+    typename BlockSteps<num_t>::View steps(*m_block_steps, cgh, t,
+                                           m_block_params.max_rung);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    size_t n_bodies = m_n_bodies;
+    num_t eta = m_block_params.eta;
+
+    cgh.parallel_for<kernel<num_t, 13 + ForceId>>(
+        sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+          auto k = item.get_linear_id();
+          if (k >= steps.n_active()) {
+            return;
+          }
+          auto id = steps.active(k);
+
+          vec3<num_t> acc{0, 0, 0};
+          auto own_pos = pos[id];
+          for (size_t i = 0; i < n_bodies; i++) {
+            acc += force.pair(pos[i] - own_pos, weights(i), i == id);
+          }
+          acc = force.total(acc, weights(id));
+
+          auto old_rung = steps.rung(id);
+          auto rung = steps.choose_rung(old_rung, sycl::length(acc), eta,
+                                        STEP_SIZE);
+          num_t old_dt = t == 0 ? 0 : STEP_SIZE / num_t(1u << old_rung);
+          num_t new_dt = STEP_SIZE / num_t(1u << rung);
+          vel[id] += acc * ((old_dt + new_dt) / 2);
+          steps.set_rung(id, rung);
+        });
+  }
+
+  // Runs the force kernel of the selected solver on the read buffers and
+  // writes its results to the write buffers. This is the only place the
+  // integrator is chosen at runtime, every kernel is specialised for one.
+  void submit_forces(integrator_t integrator) {
+    switch (integrator) {
+      case integrator_t::EULER:
+        submit_forces<integrator_t::EULER>();
+        break;
+      case integrator_t::RK4:
+        submit_forces<integrator_t::RK4>();
+        break;
+      case integrator_t::LEAPFROG:
+        submit_forces<integrator_t::LEAPFROG>();
+        break;
+      case integrator_t::VELOCITY_VERLET:
+        submit_forces<integrator_t::VELOCITY_VERLET>();
+        break;
+      case integrator_t::BLOCK_LEAPFROG:
+        throw std::runtime_error(
+            "Block time steps don't use the shared force kernels!");
+    }
+  }
+
+  template <integrator_t Integrator>
+  void submit_forces() {
+    if (m_solver == solver_t::PME) {
+      submit_pme<Integrator>();
+      return;
+    }
+
+    // The symmetric kernel sums the accelerations into m_pair_accel, and a
+    // second pass integrates them
+    bool symmetric =
+        m_kernel == kernel_t::SYMMETRIC && m_solver == solver_t::DIRECT;
+    if (symmetric) {
+      if (Integrator == integrator_t::RK4) {
+        throw std::runtime_error(
+            "The symmetric kernel doesn't support RK4 integration!");
+      }
+      if (!m_pair_accel) {
+        m_pair_accel = std::make_unique<sycl::buffer<num_t, 1>>(
+            sycl::range<1>(3 * m_n_bodies));
+      }
+      submit("clear accelerations", [&](sycl::handler& cgh) {
+        sycl::accessor pair_accel(*m_pair_accel, cgh, sycl::write_only,
+                                  sycl::no_init);
+        cgh.fill(pair_accel, num_t(0));
+      });
+    }
+
+    submit("forces", [&](sycl::handler& cgh) {
       // Initialize accessors to body data
       auto reads = m_bufs.read().gen_read_accs(cgh, read_bufs_t<0, 1>{});
       auto writes = m_bufs.write().gen_write_accs(cgh, write_bufs_t<0, 1>{});
-      auto vel = std::get<0>(reads);
-      auto pos = std::get<1>(reads);
-      auto wvel = std::get<0>(writes);
-      auto wpos = std::get<1>(writes);
-
-      // Dummy variable copies to avoid capturing `this` in kernel lambda
-      num_t t = m_time;
-      size_t n_bodies = m_n_bodies;
-      integrator_t integrator = m_integrator;
 
       // Launch different kernel depending on the force choice
       switch (m_force) {
         case force_t::GRAVITY: {
-          // Again, dummy copies
-          num_t G = m_grav_params.G;
-          num_t damping = m_grav_params.damping;
-
-          cgh.parallel_for<kernel<num_t, 0>>(
-              sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
-                auto id = item.get_linear_id();
-
-                // Computes the gravitational acceleration on a body using the
-                // chosen constants
-                const auto grav = [&](vec3<num_t>, vec3<num_t> x,
-                                      num_t) -> vec3<num_t> {
-                  vec3<num_t> acc(0);
-
-                  for (size_t i = 0; i < n_bodies; i++) {
-                    auto const diff = pos[i] - x;
-                    auto const r =
-                        sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
-                                   diff.z() * diff.z());
-                    acc += diff /
-                           (r * r * r + num_t(1e24) * num_t(i == id) + damping);
-                  }
-
-                  return G * acc;
-                };
-
-                vec3<num_t> wvelTmp;
-                vec3<num_t> wposTmp;
-
-                // Use the chosen integrator to find new values of position and
-                // velocity
-                if (integrator == integrator_t::EULER) {
-                  std::tie(wvelTmp, wposTmp, std::ignore) =
-                      integrate_step_euler(grav, STEP_SIZE, vel[id], pos[id],
-                                           t);
-
-                } else if (integrator == integrator_t::RK4) {
-                  std::tie(wvelTmp, wposTmp, std::ignore) =
-                      integrate_step_rk4(grav, STEP_SIZE, vel[id], pos[id], t);
-                }
-
-                wvel[id] = wvelTmp;
-                wpos[id] = wposTmp;
-              });
+          gravity_force<num_t> force{m_grav_params.G, m_grav_params.damping};
+          if (m_solver == solver_t::BARNES_HUT) {
+            submit_barnes_hut<Integrator>(cgh, force, reads, writes);
+          } else {
+            submit_force_kernel<Integrator, 0>(cgh, force,
+                                               unit_weights<num_t>{}, reads,
+                                               writes);
+          }
         } break;
         case force_t::LENNARD_JONES: {
-          // Dummy copies
-          num_t eps = m_lj_params.eps;
-          num_t sigma = m_lj_params.sigma;
-          auto A = num_t(24) * eps * sigma;
-
-          cgh.parallel_for<kernel<num_t, 1>>(
-              sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
-                auto id = item.get_linear_id();
-
-                // Computes the acceleration on a body from the sum of
-                // Lennard-Jones
-                // potentials between itself and all other bodies using the
-                // provided
-                // parameters
-                const auto force = [&](vec3<num_t>, vec3<num_t> x,
-                                       num_t) -> vec3<num_t> {
-                  vec3<num_t> acc(0);
-
-                  for (size_t i = 0; i < n_bodies; i++) {
-                    auto const diff = pos[i] - x;
-                    auto const r =
-                        sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
-                                   diff.z() * diff.z()) +
-                        num_t(1e24) * num_t(i == id);
-
-                    acc += sycl::pow(r, num_t(-8)) * diff -
-                           num_t(2) * sycl::pow(r, num_t(-14)) * diff;
-                  }
-
-                  return A * acc;
-                };
-
-                vec3<num_t> wvelTmp;
-                vec3<num_t> wposTmp;
-
-                // Use the chosen integrator to find new values of position and
-                // velocity
-                if (integrator == integrator_t::EULER) {
-                  std::tie(wvelTmp, wposTmp, std::ignore) =
-                      integrate_step_euler(force, STEP_SIZE, vel[id], pos[id],
-                                           t);
-                } else if (integrator == integrator_t::RK4) {
-                  std::tie(wvelTmp, wposTmp, std::ignore) =
-                      integrate_step_rk4(force, STEP_SIZE, vel[id], pos[id], t);
-                }
-
-                wvel[id] = wvelTmp;
-                wpos[id] = wposTmp;
-              });
+          lennard_jones_force<num_t> force{num_t(24) * m_lj_params.eps *
+                                           m_lj_params.sigma};
+          if (m_solver == solver_t::CELL_LIST) {
+            submit_cell_list<Integrator>(cgh, force, reads, writes);
+          } else if (m_solver == solver_t::NEIGHBOUR_LIST) {
+            submit_neighbour_list<Integrator>(cgh, force, reads, writes);
+          } else {
+            submit_force_kernel<Integrator, 1>(cgh, force,
+                                               unit_weights<num_t>{}, reads,
+                                               writes);
+          }
         } break;
         case force_t::COULOMB: {
           if (!m_coulomb_charges_buf) {
@@ -376,52 +1226,481 @@ class GravSim {
           // Read accessor for particle charges
           auto charges_acc = std::get<0>(
               m_coulomb_charges_buf->gen_read_accs(cgh, read_bufs_t<0>{}));
+          const auto charges = [=](size_t i) { return charges_acc[i]; };
 
-          cgh.parallel_for<kernel<num_t, 2>>(
-              sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
-                auto id = item.get_linear_id();
-                num_t my_charge = charges_acc[id];
-
-                // Computes the gravitational acceleration on a body using the
-                // chosen constants
-                const auto cmb = [&](vec3<num_t>, vec3<num_t> x,
-                                     num_t) -> vec3<num_t> {
-                  vec3<num_t> acc(0);
-
-                  for (size_t i = 0; i < n_bodies; i++) {
-                    auto const diff = pos[i] - x;
-                    auto const r =
-                        sycl::sqrt(diff.x() * diff.x() + diff.y() * diff.y() +
-                                   diff.z() * diff.z());
-                    acc += charges_acc[i] * diff /
-                           (r * r * r + num_t(1e24) * num_t(i == id));
-                  }
-
-                  return my_charge * acc;
-                };
-
-                vec3<num_t> wvelTmp;
-                vec3<num_t> wposTmp;
-
-                // Use the chosen integrator to find new values of position and
-                // velocity
-                if (integrator == integrator_t::EULER) {
-                  std::tie(wvelTmp, wposTmp, std::ignore) =
-                      integrate_step_euler(cmb, STEP_SIZE, vel[id], pos[id], t);
-                } else if (integrator == integrator_t::RK4) {
-                  std::tie(wvelTmp, wposTmp, std::ignore) =
-                      integrate_step_rk4(cmb, STEP_SIZE, vel[id], pos[id], t);
-                }
-
-                wvel[id] = wvelTmp;
-                wpos[id] = wposTmp;
-              });
-
+          submit_force_kernel<Integrator, 2>(cgh, coulomb_force<num_t>{},
+                                             charges, reads, writes);
         } break;
       }
     });
 
-    m_bufs.swap();
-    m_time += STEP_SIZE;
+    if (symmetric) {
+      submit_pair_integrate<Integrator>();
+    }
+  }
+
+  /* Computes the particle-mesh Ewald accelerations into m_pair_accel and
+   * integrates them. The mesh is only solved at the current positions, so
+   * RK4 isn't supported. */
+  template <integrator_t Integrator>
+  void submit_pme() {
+    if (Integrator == integrator_t::RK4) {
+      throw std::runtime_error(
+          "The particle-mesh Ewald solver doesn't support RK4 integration!");
+    }
+    if (!m_coulomb_charges_buf) {
+      throw std::runtime_error("Coulomb charge buffer wasn't initialized!");
+    }
+    if (!m_pair_accel) {
+      m_pair_accel = std::make_unique<sycl::buffer<num_t, 1>>(
+          sycl::range<1>(3 * m_n_bodies));
+    }
+
+    m_pme->compute(profiled_queue(), m_bufs.read().template get_buf<1>(),
+                   m_coulomb_charges_buf->template get_buf<0>(),
+                   *m_pair_accel, m_pme_params.box, m_pme_params.cutoff);
+    submit_pair_integrate<Integrator>();
+  }
+
+  // Integrates every body with the accelerations summed by the symmetric
+  // kernel or the particle-mesh Ewald solver
+  template <integrator_t Integrator>
+  void submit_pair_integrate() {
+    submit("pair integrate", [&](sycl::handler& cgh) {
+      auto reads = m_bufs.read().gen_read_accs(cgh, read_bufs_t<0, 1>{});
+      auto writes = m_bufs.write().gen_write_accs(cgh, write_bufs_t<0, 1>{});
+      sycl::accessor pair_accel(*m_pair_accel, cgh, sycl::read_only);
+      auto vel = std::get<0>(reads);
+      auto pos = std::get<1>(reads);
+      auto wvel = std::get<0>(writes);
+      auto wpos = std::get<1>(writes);
+
+      // Dummy variable copies to avoid capturing `this` in kernel lambda
+      num_t t = m_time;
+
+      cgh.parallel_for<solver_kernel<num_t, solver_t::DIRECT, Integrator>>(
+          sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+            vec3<num_t> acc{pair_accel[3 * id], pair_accel[3 * id + 1],
+                            pair_accel[3 * id + 2]};
+
+            // None of the supported integrators evaluate the acceleration
+            // anywhere but at the current position
+            const auto accel = [&](vec3<num_t>, vec3<num_t>,
+                                   num_t) -> vec3<num_t> { return acc; };
+
+            vec3<num_t> wvelTmp = vel[id];
+            vec3<num_t> wposTmp = pos[id];
+            integrate<Integrator>(accel, wvelTmp, wposTmp, t);
+
+            wvel[id] = wvelTmp;
+            wpos[id] = wposTmp;
+          });
+    });
+  }
+
+  // First half of a velocity Verlet step: kicks the velocities by half a step
+  // with the cached acceleration and drifts the positions by a full step
+  void submit_drift() {
+    submit("drift", [&](sycl::handler& cgh) {
+      auto reads = m_bufs.read().gen_read_accs(cgh, read_bufs_t<0, 1>{});
+      auto writes = m_bufs.write().gen_write_accs(cgh, write_bufs_t<0, 1>{});
+      sycl::accessor accel(*m_accel, cgh, sycl::read_only);
+      auto vel = std::get<0>(reads);
+      auto pos = std::get<1>(reads);
+      auto wvel = std::get<0>(writes);
+      auto wpos = std::get<1>(writes);
+
+      cgh.parallel_for<kernel<num_t, 10>>(
+          sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+            auto half_vel = vel[item] + accel[item] * (STEP_SIZE / 2);
+            wvel[item] = half_vel;
+            wpos[item] = pos[item] + half_vel * STEP_SIZE;
+          });
+    });
+  }
+
+  /* Adds `factor` times the accelerations left in the write velocity buffer
+   * by a VELOCITY_VERLET force pass onto the current velocities, and caches
+   * the accelerations for the next velocity Verlet step. */
+  void submit_kick(num_t factor) {
+    if (!m_accel) {
+      m_accel = std::make_unique<sycl::buffer<vec3<num_t>, 1>>(
+          sycl::range<1>(m_n_bodies));
+    }
+
+    submit("kick", [&](sycl::handler& cgh) {
+      sycl::accessor vel(m_bufs.read().template get_buf<0>(), cgh,
+                         sycl::read_write);
+      sycl::accessor new_accel(m_bufs.write().template get_buf<0>(), cgh,
+                               sycl::read_only);
+      sycl::accessor accel(*m_accel, cgh, sycl::write_only, sycl::no_init);
+
+      cgh.parallel_for<kernel<num_t, 11>>(
+          sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+            auto a = new_accel[item];
+            vel[item] += a * factor;
+            accel[item] = a;
+          });
+    });
+
+    m_accel_cached = true;
+  }
+
+  // Launches the selected kernel variant and layout for the given force
+  // model. `weights(i)` returns the mass or charge of body i.
+  template <integrator_t Integrator, size_t ForceId, typename Force,
+            typename Weights, typename Reads, typename Writes>
+  void submit_force_kernel(sycl::handler& cgh, Force force, Weights weights,
+                           Reads reads, Writes writes) {
+    switch (m_layout) {
+      case layout_t::VEC3: {
+        auto pos = std::get<1>(reads);
+        split_bodies<num_t, decltype(pos), Weights> bodies{pos, weights};
+        submit_direct<Integrator, ForceId, layout_t::VEC3>(cgh, force, bodies,
+                                                           reads, writes);
+      } break;
+      case layout_t::PACKED: {
+        typename PackedBodies<num_t>::View bodies(*m_packed_bodies, cgh);
+        submit_direct<Integrator, ForceId, layout_t::PACKED>(
+            cgh, force, bodies, reads, writes);
+      } break;
+      case layout_t::SOA: {
+        typename SoaBodies<num_t>::View bodies(*m_soa_bodies, cgh);
+        submit_direct<Integrator, ForceId, layout_t::SOA>(cgh, force, bodies,
+                                                          reads, writes);
+      } break;
+    }
+  }
+
+  // `bodies.pos(i)` and `bodies.weight(i)` read the position and weight of
+  // body i in the chosen layout
+  template <integrator_t Integrator, size_t ForceId, layout_t Layout,
+            typename Force, typename Bodies, typename Reads, typename Writes>
+  void submit_direct(sycl::handler& cgh, Force force, Bodies bodies,
+                     Reads reads, Writes writes) {
+    if (m_specialise_forces) {
+      force.specialise(cgh);
+    }
+
+    if (m_double_accum) {
+      submit_direct<Integrator, ForceId, Layout, double>(cgh, force, bodies,
+                                                         reads, writes);
+    } else {
+      submit_direct<Integrator, ForceId, Layout, num_t>(cgh, force, bodies,
+                                                        reads, writes);
+    }
+  }
+
+  // The forces are summed in `acc_t` precision
+  template <integrator_t Integrator, size_t ForceId, layout_t Layout,
+            typename acc_t, typename Force, typename Bodies, typename Reads,
+            typename Writes>
+  void submit_direct(sycl::handler& cgh, Force force, Bodies bodies,
+                     Reads reads, Writes writes) {
+    switch (m_kernel) {
+      case kernel_t::NAIVE:
+        submit_naive<Integrator, ForceId, Layout, acc_t>(cgh, force, bodies,
+                                                         reads, writes);
+        break;
+      case kernel_t::TILED:
+        submit_tiled<Integrator, ForceId, Layout, acc_t>(cgh, force, bodies,
+                                                         reads, writes);
+        break;
+      case kernel_t::SYMMETRIC:
+        submit_symmetric<ForceId, Layout, acc_t>(cgh, force, bodies);
+        break;
+    }
+  }
+
+  // One work-item per body, reading every other body from global memory
+  template <integrator_t Integrator, size_t ForceId, layout_t Layout,
+            typename acc_t, typename Force, typename Bodies, typename Reads,
+            typename Writes>
+  void submit_naive(sycl::handler& cgh, Force host_force, Bodies bodies,
+                    Reads reads, Writes writes) {
+    auto vel = std::get<0>(reads);
+    auto pos = std::get<1>(reads);
+    auto wvel = std::get<0>(writes);
+    auto wpos = std::get<1>(writes);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    size_t n_bodies = m_n_bodies;
+
+    cgh.parallel_for<
+        direct_kernel<num_t, ForceId, Layout, acc_t, Integrator>>(
+        sycl::range<1>(n_bodies),
+        [=](sycl::item<1> item, sycl::kernel_handler kh) {
+          auto id = item.get_linear_id();
+          const auto force = specialised_force(kh, host_force);
+
+          // Computes the acceleration on a body from the sum of its
+          // interactions with all bodies
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            vec3<acc_t> acc(0);
+
+            for (size_t i = 0; i < n_bodies; i++) {
+              auto pair =
+                  force.pair(bodies.pos(i) - x, bodies.weight(i), i == id);
+              acc += pair.template convert<acc_t>();
+            }
+
+            return force.total(acc.template convert<num_t>(),
+                               bodies.weight(id));
+          };
+
+          vec3<num_t> wvelTmp = vel[id];
+          vec3<num_t> wposTmp = pos[id];
+          integrate<Integrator>(accel, wvelTmp, wposTmp, t);
+
+          wvel[id] = wvelTmp;
+          wpos[id] = wposTmp;
+        });
+  }
+
+  // One work-group per tile of bodies, see BodyTiles
+  template <integrator_t Integrator, size_t ForceId, layout_t Layout,
+            typename acc_t, typename Force, typename Bodies, typename Reads,
+            typename Writes>
+  void submit_tiled(sycl::handler& cgh, Force host_force, Bodies bodies,
+                    Reads reads, Writes writes) {
+    auto vel = std::get<0>(reads);
+    auto pos = std::get<1>(reads);
+    auto wvel = std::get<0>(writes);
+    auto wpos = std::get<1>(writes);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    size_t n_bodies = m_n_bodies;
+    size_t tile_size = m_tile_size;
+
+    // Round the launch up to a whole number of work-groups
+    size_t n_groups = (n_bodies + tile_size - 1) / tile_size;
+
+    BodyTiles<num_t> tiles(cgh, tile_size);
+
+    cgh.parallel_for<
+        direct_kernel<num_t, 3 + ForceId, Layout, acc_t, Integrator>>(
+        sycl::nd_range<1>(n_groups * tile_size, tile_size),
+        [=](sycl::nd_item<1> item, sycl::kernel_handler kh) {
+          auto id = item.get_global_id(0);
+          const auto force = specialised_force(kh, host_force);
+
+          // Work-items past the last body still have to reach every barrier,
+          // so they integrate a copy of body 0 and discard the result
+          auto body = id < n_bodies ? id : 0;
+
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            auto acc = tiles.template pair_sum<acc_t>(item, force, bodies,
+                                                      n_bodies, x, id);
+            return force.total(acc.template convert<num_t>(),
+                               bodies.weight(body));
+          };
+
+          vec3<num_t> wvelTmp = vel[body];
+          vec3<num_t> wposTmp = pos[body];
+          integrate<Integrator>(accel, wvelTmp, wposTmp, t);
+
+          if (id < n_bodies) {
+            wvel[id] = wvelTmp;
+            wpos[id] = wposTmp;
+          }
+        });
+  }
+
+  /* One work-item per pair of tiles I <= J, evaluating every unordered pair
+   * of bodies once. A pair adds to the sum of the body in tile I and
+   * subtracts from a private sum for the body in tile J, and the sums are
+   * added to m_pair_accel with atomics once per body and tile pair. This
+   * relies on pair() being linear in the weight and odd in diff, and on
+   * total() being linear, which holds for all force models. */
+  template <size_t ForceId, layout_t Layout, typename acc_t, typename Force,
+            typename Bodies>
+  void submit_symmetric(sycl::handler& cgh, Force host_force, Bodies bodies) {
+    sycl::accessor pair_accel(*m_pair_accel, cgh, sycl::read_write);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    size_t n_bodies = m_n_bodies;
+    size_t n_tiles = (n_bodies + SYMMETRIC_TILE - 1) / SYMMETRIC_TILE;
+
+    cgh.parallel_for<symmetric_kernel<num_t, ForceId, Layout, acc_t>>(
+        sycl::range<2>(n_tiles, n_tiles),
+        [=](sycl::item<2> item, sycl::kernel_handler kh) {
+          auto tile_i = item.get_id(0);
+          auto tile_j = item.get_id(1);
+          if (tile_j < tile_i) {
+            return;
+          }
+          const auto force = specialised_force(kh, host_force);
+
+          // Adds the sum of pair() terms `acc` of body `id` to its
+          // acceleration
+          const auto flush = [&](size_t id, vec3<acc_t> acc) {
+            auto total =
+                force.total(acc.template convert<num_t>(), bodies.weight(id));
+            for (int c = 0; c < 3; c++) {
+              sycl::atomic_ref<num_t, sycl::memory_order::relaxed,
+                               sycl::memory_scope::device,
+                               sycl::access::address_space::global_space>(
+                  pair_accel[3 * id + c])
+                  .fetch_add(total[c]);
+            }
+          };
+
+          size_t base_i = tile_i * SYMMETRIC_TILE;
+          size_t base_j = tile_j * SYMMETRIC_TILE;
+          size_t n_i = std::min(SYMMETRIC_TILE, n_bodies - base_i);
+          size_t n_j = std::min(SYMMETRIC_TILE, n_bodies - base_j);
+
+          vec3<acc_t> acc_j[SYMMETRIC_TILE];
+          for (size_t b = 0; b < n_j; b++) {
+            acc_j[b] = vec3<acc_t>(0);
+          }
+
+          for (size_t a = 0; a < n_i; a++) {
+            auto x = bodies.pos(base_i + a);
+            auto w = bodies.weight(base_i + a);
+            vec3<acc_t> acc_i(0);
+
+            // Within a tile, only the pairs with b > a
+            for (size_t b = tile_i == tile_j ? a + 1 : 0; b < n_j; b++) {
+              auto pair =
+                  force.pair(bodies.pos(base_j + b) - x, num_t(1), false);
+              acc_i += (pair * bodies.weight(base_j + b))
+                           .template convert<acc_t>();
+              acc_j[b] -= (pair * w).template convert<acc_t>();
+            }
+            flush(base_i + a, acc_i);
+          }
+
+          for (size_t b = 0; b < n_j; b++) {
+            flush(base_j + b, acc_j[b]);
+          }
+        });
+  }
+
+  // One work-item per body, walking the octree built for this step
+  template <integrator_t Integrator, typename Reads, typename Writes>
+  void submit_barnes_hut(sycl::handler& cgh, gravity_force<num_t> force,
+                         Reads reads, Writes writes) {
+    auto vel = std::get<0>(reads);
+    auto pos = std::get<1>(reads);
+    auto wvel = std::get<0>(writes);
+    auto wpos = std::get<1>(writes);
+    typename Octree<num_t>::View tree(*m_octree, cgh, m_bh_theta);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+
+    cgh.parallel_for<
+        solver_kernel<num_t, solver_t::BARNES_HUT, Integrator>>(
+        sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+          auto id = item.get_linear_id();
+
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            return tree.accel(force, pos, x, id);
+          };
+
+          vec3<num_t> wvelTmp = vel[id];
+          vec3<num_t> wposTmp = pos[id];
+          integrate<Integrator>(accel, wvelTmp, wposTmp, t);
+
+          wvel[id] = wvelTmp;
+          wpos[id] = wposTmp;
+        });
+  }
+
+  // One work-item per body, visiting only the bodies in the neighbouring
+  // cells and ignoring those beyond the cutoff
+  template <integrator_t Integrator, typename Reads, typename Writes>
+  void submit_cell_list(sycl::handler& cgh, lennard_jones_force<num_t> force,
+                        Reads reads, Writes writes) {
+    auto vel = std::get<0>(reads);
+    auto pos = std::get<1>(reads);
+    auto wvel = std::get<0>(writes);
+    auto wpos = std::get<1>(writes);
+    typename CellList<num_t>::View grid(*m_cell_list, cgh);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    num_t cutoff2 = m_lj_params.cutoff * m_lj_params.cutoff;
+
+    cgh.parallel_for<
+        solver_kernel<num_t, solver_t::CELL_LIST, Integrator>>(
+        sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+          auto id = item.get_linear_id();
+
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            vec3<num_t> acc(0);
+
+            grid.for_each_neighbour(pos, x, [&](uint32_t j) {
+              auto const diff = pos[j] - x;
+              if (diff.x() * diff.x() + diff.y() * diff.y() +
+                      diff.z() * diff.z() <
+                  cutoff2) {
+                acc += force.pair(diff, num_t(1), j == id);
+              }
+            });
+
+            return force.total(acc, num_t(1));
+          };
+
+          vec3<num_t> wvelTmp = vel[id];
+          vec3<num_t> wposTmp = pos[id];
+          integrate<Integrator>(accel, wvelTmp, wposTmp, t);
+
+          wvel[id] = wvelTmp;
+          wpos[id] = wposTmp;
+        });
+  }
+
+  // One work-item per body, gathering over its neighbour list
+  template <integrator_t Integrator, typename Reads, typename Writes>
+  void submit_neighbour_list(sycl::handler& cgh,
+                             lennard_jones_force<num_t> force, Reads reads,
+                             Writes writes) {
+    auto vel = std::get<0>(reads);
+    auto pos = std::get<1>(reads);
+    auto wvel = std::get<0>(writes);
+    auto wpos = std::get<1>(writes);
+    typename NeighbourList<num_t>::View neighbours(*m_neighbour_list, cgh);
+
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    num_t cutoff2 = m_lj_params.cutoff * m_lj_params.cutoff;
+
+    cgh.parallel_for<
+        solver_kernel<num_t, solver_t::NEIGHBOUR_LIST, Integrator>>(
+        sycl::range<1>(m_n_bodies), [=](sycl::item<1> item) {
+          auto id = item.get_linear_id();
+
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            vec3<num_t> acc(0);
+
+            neighbours.for_each_neighbour(id, [&](uint32_t j) {
+              auto const diff = pos[j] - x;
+              if (diff.x() * diff.x() + diff.y() * diff.y() +
+                      diff.z() * diff.z() <
+                  cutoff2) {
+                acc += force.pair(diff, num_t(1), false);
+              }
+            });
+
+            return force.total(acc, num_t(1));
+          };
+
+          vec3<num_t> wvelTmp = vel[id];
+          vec3<num_t> wposTmp = pos[id];
+          integrate<Integrator>(accel, wvelTmp, wposTmp, t);
+
+          wvel[id] = wvelTmp;
+          wpos[id] = wposTmp;
+        });
   }
 };
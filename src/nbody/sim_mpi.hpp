@@ -0,0 +1,321 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Direct sum NBody simulation distributed across MPI ranks.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "sim.hpp"
+
+#include <mpi.h>
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+// Template to generate unique kernel name types, Z < 2 are the force kernels
+// and the others the integration kernels
+template <typename T, size_t Z>
+class mpi_kernel {};
+
+/* Direct summation NBody simulation with every MPI rank owning a contiguous
+ * block of bodies. The position blocks travel around a ring of ranks: at
+ * stage k of a step, a rank adds the forces from the block of the rank k
+ * places to its left, while it already forwards that block to the right and
+ * receives the next one with non-blocking MPI calls. After all ranks'
+ * blocks have passed, the rank integrates its own bodies.
+ *
+ * The blocks are exchanged through host USM, so any MPI implementation can
+ * send them, not only device-aware ones, and on the CPU device the kernels
+ * read them in place. Only gravity and Lennard-Jones forces with Euler
+ * integration are supported, as the accelerations are summed over several
+ * kernels before the bodies move. */
+template <typename num_t>
+class GravSimMPI {
+  MPI_Comm m_comm;
+  int m_rank;
+  int m_size;
+
+  sycl::queue m_q;
+
+  // The number of bodies partaking in the simulation, across all ranks
+  size_t m_n_bodies;
+
+  // All blocks have the size of the largest one, the last ones may be
+  // shorter
+  size_t m_block_size;
+
+  // Positions of the bodies of this rank
+  vec3<num_t>* m_pos = nullptr;
+
+  // Velocities and summed accelerations of the bodies of this rank
+  vec3<num_t>* m_vel = nullptr;
+  vec3<num_t>* m_acc = nullptr;
+
+  // Double buffer receiving the blocks of the other ranks
+  vec3<num_t>* m_ring[2] = {nullptr, nullptr};
+
+  // The current time of the simulation
+  num_t m_time = 0;
+
+  force_t m_force = force_t::GRAVITY;
+
+  // Force parameters
+  struct {
+    num_t G = 1e-5;
+    num_t damping = 1e-5;
+  } m_grav_params;
+
+  struct {
+    num_t eps = 1;
+    num_t sigma = 1e-3;
+  } m_lj_params;
+
+  // The first body of the block owned by `rank`, and its number of bodies
+  size_t block_begin(int rank) const {
+    return std::min(size_t(rank) * m_block_size, m_n_bodies);
+  }
+
+  size_t block_count(int rank) const {
+    return std::min(block_begin(rank) + m_block_size, m_n_bodies) -
+           block_begin(rank);
+  }
+
+  // Base constructor, does not initialize simulation values
+  GravSimMPI(MPI_Comm comm, size_t n_bodies)
+      : m_comm(comm),
+        m_q(sycl::default_selector_v, except_handler,
+            sycl::property::queue::in_order{}),
+        m_n_bodies(n_bodies) {
+    MPI_Comm_rank(comm, &m_rank);
+    MPI_Comm_size(comm, &m_size);
+    m_block_size = (n_bodies + m_size - 1) / m_size;
+
+    m_pos = sycl::malloc_host<vec3<num_t>>(m_block_size, m_q);
+    m_vel = sycl::malloc_device<vec3<num_t>>(m_block_size, m_q);
+    m_acc = sycl::malloc_device<vec3<num_t>>(m_block_size, m_q);
+    for (auto& ring : m_ring) {
+      ring = sycl::malloc_host<vec3<num_t>>(m_block_size, m_q);
+    }
+  }
+
+  // Every rank samples the bodies of its own block on its device. The seed
+  // of rank 0 is used by all ranks.
+  template <typename Distrib>
+  void sample(Distrib params, uint64_t seed) {
+    MPI_Bcast(&seed, 1, MPI_UINT64_T, 0, m_comm);
+    // The positions are sent from the host by the first step
+    submit_sample_distrib(m_q, params, seed, block_begin(m_rank),
+                          block_count(m_rank), m_vel, m_pos)
+        .wait();
+  }
+
+ public:
+  // Initialize the simulation with a cylinder body distribution, sampled on
+  // the devices. Collective over `comm`. The same seed gives the same bodies
+  // as GravSim.
+  GravSimMPI(MPI_Comm comm, size_t n_bodies, distrib_cylinder<num_t> params,
+             uint64_t seed = random_seed())
+      : GravSimMPI(comm, n_bodies) {
+    sample(params, seed);
+  }
+
+  // Initialize the simulation with a sphere body distribution
+  GravSimMPI(MPI_Comm comm, size_t n_bodies, distrib_sphere<num_t> params,
+             uint64_t seed = random_seed())
+      : GravSimMPI(comm, n_bodies) {
+    sample(params, seed);
+  }
+
+  // The allocations are owned by this object and freed with it
+  GravSimMPI(const GravSimMPI&) = delete;
+  GravSimMPI& operator=(const GravSimMPI&) = delete;
+
+  ~GravSimMPI() {
+    m_q.wait();
+    sycl::free(m_pos, m_q);
+    sycl::free(m_vel, m_q);
+    sycl::free(m_acc, m_q);
+    for (auto& ring : m_ring) {
+      sycl::free(ring, m_q);
+    }
+  }
+
+  int rank() const { return m_rank; }
+  int size() const { return m_size; }
+
+  // Collective over the communicator, returns once this rank's bodies have
+  // moved
+  void step() {
+    switch (m_force) {
+      case force_t::GRAVITY: {
+        gravity_force<num_t> force{m_grav_params.G, m_grav_params.damping};
+        ring_step<0>(force);
+      } break;
+      case force_t::LENNARD_JONES: {
+        lennard_jones_force<num_t> force{num_t(24) * m_lj_params.eps *
+                                         m_lj_params.sigma};
+        ring_step<1>(force);
+      } break;
+      case force_t::COULOMB:
+        throw std::runtime_error(
+            "The MPI backend doesn't support Coulomb forces!");
+    }
+    m_time += GravSim<num_t>::STEP_SIZE;
+  }
+
+  void sync_queue() { m_q.wait(); }
+
+  void set_force_type(force_t force) {
+    if (force == force_t::COULOMB) {
+      throw std::runtime_error(
+          "The MPI backend doesn't support Coulomb forces!");
+    }
+    m_force = force;
+  }
+
+  // Set gravity damping
+  void set_grav_damping(num_t damping) { m_grav_params.damping = damping; }
+
+  // Set gravitational constant
+  void set_grav_G(num_t G) { m_grav_params.G = G; }
+
+  // Set Lennard-Jones potential well depth
+  void set_lj_eps(num_t eps) { m_lj_params.eps = eps; }
+
+  // Set Lennard-Jones zero-potential distance
+  void set_lj_sigma(num_t sigma) { m_lj_params.sigma = sigma; }
+
+  // The number of pairwise interactions evaluated by a single step, across
+  // all ranks
+  size_t interactions_per_step() const { return m_n_bodies * m_n_bodies; }
+
+  // Floating point operations of the interactions of a single step
+  size_t flops_per_step() const {
+    size_t flops = m_force == force_t::GRAVITY
+                       ? gravity_force<num_t>::FLOPS
+                       : lennard_jones_force<num_t>::FLOPS;
+    return flops * interactions_per_step();
+  }
+
+ private:
+  template <size_t ForceId, typename Force>
+  void ring_step(Force force) {
+    int right = (m_rank + 1) % m_size;
+    int left = (m_rank + m_size - 1) % m_size;
+    int bytes = int(m_block_size * sizeof(vec3<num_t>));
+
+    m_q.memset(m_acc, 0, m_block_size * sizeof(vec3<num_t>));
+
+    // Kernels reading each ring buffer, and sends from it
+    sycl::event reads[2];
+    MPI_Request sends[2] = {MPI_REQUEST_NULL, MPI_REQUEST_NULL};
+    MPI_Request own_send = MPI_REQUEST_NULL;
+    MPI_Request recv = MPI_REQUEST_NULL;
+
+    for (int k = 0; k < m_size; k++) {
+      // The block of stage 0 is this rank's own, the others were received
+      // into the ring buffers during the stage before
+      int origin = (m_rank + m_size - k) % m_size;
+      const vec3<num_t>* block = k == 0 ? m_pos : m_ring[k % 2];
+      if (k > 0) {
+        MPI_Wait(&recv, MPI_STATUS_IGNORE);
+      }
+
+      sycl::event read = submit_block<ForceId>(force, block, origin);
+
+      // Pass the block on while the kernel runs. The buffer receiving the
+      // next block was read and sent during the stage before.
+      if (k + 1 < m_size) {
+        MPI_Request& send = k == 0 ? own_send : sends[k % 2];
+        MPI_Isend(block, bytes, MPI_BYTE, right, 0, m_comm, &send);
+
+        int next = (k + 1) % 2;
+        MPI_Wait(&sends[next], MPI_STATUS_IGNORE);
+        reads[next].wait();
+        MPI_Irecv(m_ring[next], bytes, MPI_BYTE, left, 0, m_comm, &recv);
+      }
+      if (k > 0) {
+        reads[k % 2] = read;
+      }
+    }
+
+    // The own positions may only change once they've been sent
+    MPI_Wait(&own_send, MPI_STATUS_IGNORE);
+    MPI_Waitall(2, sends, MPI_STATUSES_IGNORE);
+    submit_integrate<ForceId>(force);
+    m_q.wait();
+  }
+
+  // Adds the forces from the block of rank `origin` to the accelerations
+  template <size_t ForceId, typename Force>
+  sycl::event submit_block(Force force, const vec3<num_t>* block,
+                           int origin) {
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    size_t begin = block_begin(m_rank);
+    size_t origin_begin = block_begin(origin);
+    size_t origin_count = block_count(origin);
+    const vec3<num_t>* pos = m_pos;
+    vec3<num_t>* acc = m_acc;
+
+    return m_q.submit([&](sycl::handler& cgh) {
+      cgh.parallel_for<mpi_kernel<num_t, ForceId>>(
+          sycl::range<1>(block_count(m_rank)), [=](sycl::item<1> item) {
+            auto k = item.get_linear_id();
+            auto id = begin + k;
+            vec3<num_t> x = pos[k];
+            vec3<num_t> sum(0);
+            for (size_t j = 0; j < origin_count; j++) {
+              sum += force.pair(block[j] - x, num_t(1), origin_begin + j == id);
+            }
+            acc[k] += sum;
+          });
+    });
+  }
+
+  template <size_t ForceId, typename Force>
+  void submit_integrate(Force force) {
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    vec3<num_t>* pos = m_pos;
+    vec3<num_t>* vel = m_vel;
+    const vec3<num_t>* acc = m_acc;
+
+    m_q.submit([&](sycl::handler& cgh) {
+      cgh.parallel_for<mpi_kernel<num_t, 2 + ForceId>>(
+          sycl::range<1>(block_count(m_rank)), [=](sycl::item<1> item) {
+            auto k = item.get_linear_id();
+
+            // Euler only evaluates the acceleration at the start of the
+            // step, which the ring has summed already
+            const auto accel = [&](vec3<num_t>, vec3<num_t>,
+                                   num_t) -> vec3<num_t> {
+              return force.total(acc[k], num_t(1));
+            };
+
+            vec3<num_t> wvelTmp = vel[k];
+            vec3<num_t> wposTmp = pos[k];
+            GravSim<num_t>::template integrate<integrator_t::EULER>(
+                accel, wvelTmp, wposTmp, t);
+            vel[k] = wvelTmp;
+            pos[k] = wposTmp;
+          });
+    });
+  }
+};
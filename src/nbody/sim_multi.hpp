@@ -0,0 +1,520 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Direct sum NBody simulation with the bodies split across devices.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "sim.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Template to generate unique kernel name types, instantiated once per
+// integrator
+template <typename T, size_t Z, integrator_t Integrator>
+class multi_kernel {};
+
+// Which devices GravSimMulti divides the bodies between
+enum class device_split_t {
+  // Every device of the default device's type on its platform
+  DEVICES,
+  // The NUMA domains of the default device, as sub-devices. Falls back to
+  // the default device alone if it can't be partitioned.
+  NUMA,
+};
+
+/* Direct summation NBody simulation with the bodies divided into slices, one
+ * per device, with all devices sharing a context. Every device keeps a copy
+ * of all positions and integrates its own slice against them. After each
+ * step, the new position slices are gathered into one host allocation and
+ * copied back to every device. The copies are ordered by events only, so
+ * consecutive steps don't wait on the host. Slices are sized by the compute
+ * units of their device. Like GravSimUSM, only the naive direct sum kernel
+ * with the vec3 layout and the Euler and RK4 integrators are supported. */
+template <typename num_t>
+class GravSimMulti {
+  // State of one device
+  struct slice {
+    sycl::queue q;
+
+    // Range of bodies integrated on this device
+    size_t begin;
+    size_t count;
+
+    // Copy of the positions of all bodies
+    vec3<num_t>* pos = nullptr;
+
+    // Velocities and new positions of the bodies in the slice
+    vec3<num_t>* vel = nullptr;
+    vec3<num_t>* new_pos = nullptr;
+
+    // Copy of the charges of all bodies, only used in Coulomb simulation
+    num_t* charges = nullptr;
+
+    // Latest copies of the slice into the host positions, and of the host
+    // positions back into `pos`
+    sycl::event gathered;
+    sycl::event broadcast;
+  };
+
+  std::vector<slice> m_slices;
+
+  // Positions of all bodies, gathered from the devices every step. Host USM
+  // in the shared context, so every device can copy to and from it.
+  vec3<num_t>* m_host_pos = nullptr;
+
+  // Copies out of m_host_pos by copyTo since the last gather, which the next
+  // gather must not overwrite before they are done
+  std::vector<sycl::event> m_host_pos_reads;
+
+  // Host copy of the velocities handed out by with_mapped
+  std::vector<vec3<num_t>> m_host_vel;
+
+  // The number of bodies partaking in the simulation
+  size_t m_n_bodies;
+
+  // The current time of the simulation
+  num_t m_time = 0;
+
+  force_t m_force = force_t::GRAVITY;
+  integrator_t m_integrator = integrator_t::EULER;
+
+  // Force parameters
+  struct {
+    num_t G = 1e-5;
+    num_t damping = 1e-5;
+  } m_grav_params;
+
+  struct {
+    num_t eps = 1;
+    num_t sigma = 1e-3;
+  } m_lj_params;
+
+  // Base constructor, does not initialize simulation values
+  GravSimMulti(size_t n_bodies, const std::vector<sycl::device>& devices)
+      : m_n_bodies(n_bodies) {
+    // Devices with an empty share get no slice, so without bodies or devices
+    // there would be no queue to allocate the host copy of the positions on
+    if (n_bodies == 0) {
+      throw std::runtime_error("Simulation needs at least one body!");
+    }
+    if (devices.empty()) {
+      throw std::runtime_error("Simulation needs at least one device!");
+    }
+
+    sycl::context context(devices);
+
+    size_t total_units = 0;
+    for (auto const& dev : devices) {
+      if (std::is_same_v<num_t, double> && !supports_doubles(dev)) {
+        throw std::runtime_error("A device doesn't support doubles!");
+      }
+      total_units += dev.get_info<sycl::info::device::max_compute_units>();
+    }
+
+    size_t units = 0;
+    for (auto const& dev : devices) {
+      size_t begin = n_bodies * units / total_units;
+      units += dev.get_info<sycl::info::device::max_compute_units>();
+      size_t end = n_bodies * units / total_units;
+      if (end == begin) {
+        continue;
+      }
+
+      slice s;
+      s.q = sycl::queue(context, dev, except_handler,
+                        sycl::property::queue::in_order{});
+      s.begin = begin;
+      s.count = end - begin;
+      s.pos = sycl::malloc_device<vec3<num_t>>(n_bodies, s.q);
+      s.vel = sycl::malloc_device<vec3<num_t>>(s.count, s.q);
+      s.new_pos = sycl::malloc_device<vec3<num_t>>(s.count, s.q);
+      m_slices.push_back(s);
+    }
+
+    m_host_pos = sycl::malloc_host<vec3<num_t>>(n_bodies, m_slices[0].q);
+  }
+
+  // Copies initial velocities and positions from the host
+  void upload(const std::vector<vec3<num_t>>& vel,
+              const std::vector<vec3<num_t>>& pos) {
+    std::copy(pos.begin(), pos.end(), m_host_pos);
+    for (auto& s : m_slices) {
+      s.q.memcpy(s.vel, vel.data() + s.begin, s.count * sizeof(vec3<num_t>));
+      s.broadcast =
+          s.q.memcpy(s.pos, m_host_pos, m_n_bodies * sizeof(vec3<num_t>));
+    }
+    // The host vectors go out of scope after construction
+    sync_queue();
+  }
+
+  // Every device samples the bodies of its slice, which are then gathered
+  // and broadcast like the new positions of a step
+  template <typename Distrib>
+  void sample(Distrib params, uint64_t seed) {
+    for (auto& s : m_slices) {
+      s.gathered = submit_sample_distrib(s.q, params, seed, s.begin, s.count,
+                                         s.vel, s.new_pos);
+      s.gathered = s.q.memcpy(m_host_pos + s.begin, s.new_pos,
+                              s.count * sizeof(vec3<num_t>), s.gathered);
+    }
+
+    auto gathered = gathered_events();
+    for (auto& s : m_slices) {
+      s.broadcast = s.q.memcpy(s.pos, m_host_pos,
+                               m_n_bodies * sizeof(vec3<num_t>), gathered);
+    }
+  }
+
+ public:
+  // The devices used for the given split
+  static std::vector<sycl::device> split_devices(device_split_t split) {
+    sycl::device dev(sycl::default_selector_v);
+    if (split == device_split_t::NUMA) {
+      try {
+        auto sub_devices = dev.create_sub_devices<
+            sycl::info::partition_property::partition_by_affinity_domain>(
+            sycl::info::partition_affinity_domain::numa);
+        if (!sub_devices.empty()) {
+          return sub_devices;
+        }
+      } catch (sycl::exception&) {
+        // The device doesn't support partitioning by NUMA domain
+      }
+      return {dev};
+    }
+
+    return dev.get_platform().get_devices(
+        dev.get_info<sycl::info::device::device_type>());
+  }
+
+  // Initialize the simulation with a cylinder body distribution, sampled on
+  // the devices. The same seed gives the same bodies as GravSim.
+  GravSimMulti(size_t n_bodies, distrib_cylinder<num_t> params,
+               device_split_t split = device_split_t::DEVICES,
+               uint64_t seed = random_seed())
+      : GravSimMulti(n_bodies, split_devices(split)) {
+    sample(params, seed);
+  }
+
+  // Initialize the simulation with a sphere body distribution, sampled on
+  // the devices
+  GravSimMulti(size_t n_bodies, distrib_sphere<num_t> params,
+               device_split_t split = device_split_t::DEVICES,
+               uint64_t seed = random_seed())
+      : GravSimMulti(n_bodies, split_devices(split)) {
+    sample(params, seed);
+  }
+
+  GravSimMulti(size_t n_bodies, std::vector<particle_data<num_t>>&& particles,
+               device_split_t split = device_split_t::DEVICES)
+      : GravSimMulti(n_bodies, split_devices(split)) {
+    std::vector<vec3<num_t>> vel(n_bodies, vec3<num_t>(0));
+    std::vector<vec3<num_t>> pos(n_bodies);
+    std::vector<num_t> charges(n_bodies);
+    for (size_t i = 0; i < n_bodies; i++) {
+      pos[i] = particles[i].pos;
+      charges[i] = particles[i].charge;
+    }
+
+    for (auto& s : m_slices) {
+      s.charges = sycl::malloc_device<num_t>(n_bodies, s.q);
+      s.q.memcpy(s.charges, charges.data(), n_bodies * sizeof(num_t));
+    }
+    upload(vel, pos);
+  }
+
+  // The allocations are owned by this object and freed with it
+  GravSimMulti(const GravSimMulti&) = delete;
+  GravSimMulti& operator=(const GravSimMulti&) = delete;
+
+  ~GravSimMulti() {
+    // Kernels and copies may still be using the allocations
+    sync_queue();
+    for (auto& s : m_slices) {
+      sycl::free(s.pos, s.q);
+      sycl::free(s.vel, s.q);
+      sycl::free(s.new_pos, s.q);
+      if (s.charges) {
+        sycl::free(s.charges, s.q);
+      }
+    }
+    sycl::free(m_host_pos, m_slices[0].q);
+  }
+
+  // The number of devices the bodies are split across
+  size_t n_devices() const { return m_slices.size(); }
+
+  void step() {
+    if (m_integrator == integrator_t::RK4) {
+      internal_step<integrator_t::RK4>();
+    } else {
+      internal_step<integrator_t::EULER>();
+    }
+    m_time += GravSim<num_t>::STEP_SIZE;
+  }
+
+  // Enqueues `n_steps` steps back to back without host synchronisation
+  void step(size_t n_steps) {
+    for (size_t i = 0; i < n_steps; i++) {
+      step();
+    }
+  }
+
+  void sync_queue() {
+    for (auto& s : m_slices) {
+      s.q.wait();
+    }
+  }
+
+  // The queue of the first device, which copyTo runs on. All queues share
+  // its context, so host USM allocated with it is usable by every device.
+  sycl::queue get_queue() const { return m_slices[0].q; }
+
+  void set_force_type(force_t force) { m_force = force; }
+
+  void set_integrator(integrator_t integrator) {
+    if (integrator != integrator_t::EULER && integrator != integrator_t::RK4) {
+      throw std::runtime_error(
+          "The multi-device backend only supports Euler and RK4 "
+          "integration!");
+    }
+    m_integrator = integrator;
+  }
+
+  void set_kernel(kernel_t kernel) {
+    if (kernel != kernel_t::NAIVE) {
+      throw std::runtime_error(
+          "The multi-device backend only supports the naive kernel!");
+    }
+  }
+
+  void set_layout(layout_t layout) {
+    if (layout != layout_t::VEC3) {
+      throw std::runtime_error(
+          "The multi-device backend only supports vec3 layout!");
+    }
+  }
+
+  void set_double_accumulation(bool double_accum) {
+    if (double_accum) {
+      throw std::runtime_error(
+          "The multi-device backend doesn't support double precision "
+          "accumulation!");
+    }
+  }
+
+  void set_specialise_forces(bool specialise) {
+    if (specialise) {
+      throw std::runtime_error(
+          "The multi-device backend doesn't support specialised force "
+          "parameters!");
+    }
+  }
+
+  void set_solver(solver_t solver) {
+    if (solver != solver_t::DIRECT) {
+      throw std::runtime_error(
+          "The multi-device backend only supports the direct sum solver!");
+    }
+  }
+
+  // The number of pairwise interactions evaluated by a single step
+  size_t interactions_per_step() const {
+    size_t evals = m_integrator == integrator_t::RK4 ? 4 : 1;
+    return evals * m_n_bodies * m_n_bodies;
+  }
+
+  // Floating point operations of the interactions of a single step
+  size_t flops_per_step() const {
+    size_t flops = 0;
+    switch (m_force) {
+      case force_t::GRAVITY:
+        flops = gravity_force<num_t>::FLOPS;
+        break;
+      case force_t::LENNARD_JONES:
+        flops = lennard_jones_force<num_t>::FLOPS;
+        break;
+      case force_t::COULOMB:
+        flops = coulomb_force<num_t>::FLOPS;
+        break;
+    }
+    return flops * interactions_per_step();
+  }
+
+  // Set gravity damping
+  void set_grav_damping(num_t damping) { m_grav_params.damping = damping; }
+
+  // Set gravitational constant
+  void set_grav_G(num_t G) { m_grav_params.G = G; }
+
+  // Set Lennard-Jones potential well depth
+  void set_lj_eps(num_t eps) { m_lj_params.eps = eps; }
+
+  // Set Lennard-Jones zero-potential distance
+  void set_lj_sigma(num_t sigma) { m_lj_params.sigma = sigma; }
+
+  // Calls the provided function with a host copy of the body data
+  template <typename Func, size_t VarId>
+  void with_mapped(read_bufs_t<VarId>, Func&& func) {
+    if (VarId == 0) {
+      m_host_vel.resize(m_n_bodies);
+      for (auto& s : m_slices) {
+        s.q.memcpy(m_host_vel.data() + s.begin, s.vel,
+                   s.count * sizeof(vec3<num_t>));
+      }
+      sync_queue();
+      func(m_host_vel.data());
+    } else {
+      for (auto& s : m_slices) {
+        s.gathered.wait();
+      }
+      func(m_host_pos);
+    }
+  }
+
+  // Copy body data into the dest pointer (host or device)
+  template <size_t VarId>
+  sycl::event copyTo(void* dest) {
+    auto* out = static_cast<vec3<num_t>*>(dest);
+    if (VarId == 0) {
+      // Velocities only exist in slices, so every device copies its own and
+      // an empty host task on the first queue completes after all of them
+      std::vector<sycl::event> copies;
+      for (auto& s : m_slices) {
+        copies.push_back(s.q.memcpy(out + s.begin, s.vel,
+                                    s.count * sizeof(vec3<num_t>)));
+      }
+      return m_slices[0].q.submit([&](sycl::handler& cgh) {
+        cgh.depends_on(copies);
+        cgh.host_task([] {});
+      });
+    }
+    auto copied = m_slices[0].q.memcpy(
+        out, m_host_pos, m_n_bodies * sizeof(vec3<num_t>), gathered_events());
+    m_host_pos_reads.push_back(copied);
+    return copied;
+  }
+
+ private:
+  std::vector<sycl::event> gathered_events() const {
+    std::vector<sycl::event> events;
+    for (auto const& s : m_slices) {
+      events.push_back(s.gathered);
+    }
+    return events;
+  }
+
+  template <integrator_t Integrator>
+  void internal_step() {
+    // Each device integrates its slice against the positions broadcast by
+    // the previous step
+    for (auto& s : m_slices) {
+      s.q.submit([&](sycl::handler& cgh) {
+        switch (m_force) {
+          case force_t::GRAVITY: {
+            gravity_force<num_t> force{m_grav_params.G,
+                                       m_grav_params.damping};
+            submit_force_kernel<Integrator, 0>(cgh, s, force,
+                                               unit_weights<num_t>{});
+          } break;
+          case force_t::LENNARD_JONES: {
+            lennard_jones_force<num_t> force{num_t(24) * m_lj_params.eps *
+                                             m_lj_params.sigma};
+            submit_force_kernel<Integrator, 1>(cgh, s, force,
+                                               unit_weights<num_t>{});
+          } break;
+          case force_t::COULOMB: {
+            if (!s.charges) {
+              throw std::runtime_error("Coulomb charges weren't initialized!");
+            }
+
+            const num_t* charges_ptr = s.charges;
+            const auto charges = [=](size_t i) { return charges_ptr[i]; };
+            submit_force_kernel<Integrator, 2>(cgh, s, coulomb_force<num_t>{},
+                                               charges);
+          } break;
+        }
+      });
+    }
+
+    // All-gather of the new positions. The host positions may only be
+    // overwritten once every device has copied the previous ones, and any
+    // copyTo of them has finished.
+    auto overwritable = std::move(m_host_pos_reads);
+    m_host_pos_reads.clear();
+    for (auto const& s : m_slices) {
+      overwritable.push_back(s.broadcast);
+    }
+    for (auto& s : m_slices) {
+      s.gathered = s.q.memcpy(m_host_pos + s.begin, s.new_pos,
+                              s.count * sizeof(vec3<num_t>), overwritable);
+    }
+
+    auto gathered = gathered_events();
+    for (auto& s : m_slices) {
+      s.broadcast = s.q.memcpy(s.pos, m_host_pos,
+                               m_n_bodies * sizeof(vec3<num_t>), gathered);
+    }
+  }
+
+  // One work-item per body of the slice, reading all positions from the
+  // device's copy. `weights(i)` returns the mass or charge of body i.
+  template <integrator_t Integrator, size_t ForceId, typename Force,
+            typename Weights>
+  void submit_force_kernel(sycl::handler& cgh, const slice& s, Force force,
+                           Weights weights) {
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    size_t n_bodies = m_n_bodies;
+    size_t begin = s.begin;
+    const vec3<num_t>* pos = s.pos;
+    vec3<num_t>* vel = s.vel;
+    vec3<num_t>* new_pos = s.new_pos;
+
+    cgh.parallel_for<multi_kernel<num_t, ForceId, Integrator>>(
+        sycl::range<1>(s.count), [=](sycl::item<1> item) {
+          auto k = item.get_linear_id();
+          auto id = begin + k;
+
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            vec3<num_t> acc(0);
+            for (size_t i = 0; i < n_bodies; i++) {
+              acc += force.pair(pos[i] - x, weights(i), i == id);
+            }
+            return force.total(acc, weights(id));
+          };
+
+          vec3<num_t> wvelTmp = vel[k];
+          vec3<num_t> wposTmp = pos[id];
+          GravSim<num_t>::template integrate<Integrator>(accel, wvelTmp,
+                                                         wposTmp, t);
+
+          // Each work-item only reads its own velocity, so it can be
+          // updated in place
+          vel[k] = wvelTmp;
+          new_pos[k] = wposTmp;
+        });
+  }
+};
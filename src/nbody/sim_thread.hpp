@@ -0,0 +1,325 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Runs the NBody simulation on its own thread and publishes snapshots of
+ *    the bodies for rendering.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "profiler.hpp"
+#include "sim.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/* Hands the latest of a stream of values from one writer thread to one
+ * reader thread without locks. Each side owns one slot, and the third slot
+ * is swapped atomically with the writer's on publish() and with the
+ * reader's on update(). The writer never waits for the reader and the
+ * reader always gets the most recently published value, values published
+ * in between are skipped. */
+template <typename T>
+class TripleBuffer {
+  // Set in m_middle when the middle slot holds a value the reader hasn't seen
+  static constexpr uint8_t FRESH = 4;
+
+  std::array<T, 3> m_slots{};
+  std::atomic<uint8_t> m_middle{1};
+  uint8_t m_back = 0;
+  uint8_t m_front = 2;
+
+ public:
+  // The slot the writer fills next
+  T& back() { return m_slots[m_back]; }
+
+  // Makes the back slot the latest value and takes over an unused slot
+  void publish() {
+    m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) &
+             ~FRESH;
+  }
+
+  // Whether a value was published since the last update()
+  bool fresh() const {
+    return m_middle.load(std::memory_order_relaxed) & FRESH;
+  }
+
+  // Takes over the latest value if one was published since the last call,
+  // returns whether it did
+  bool update() {
+    if (!(m_middle.load(std::memory_order_relaxed) & FRESH)) {
+      return false;
+    }
+    m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & ~FRESH;
+    return true;
+  }
+
+  // The slot the reader took over last
+  T& front() { return m_slots[m_front]; }
+
+  // All slots, only for setup and teardown while neither side runs
+  std::array<T, 3>& slots() { return m_slots; }
+};
+
+// State of the bodies after a batch of steps, in host USM or the storage
+// handed to SimThread
+template <typename num_t>
+struct sim_snapshot {
+  vec3<num_t>* pos = nullptr;
+  vec3<num_t>* vel = nullptr;
+  // Which of the snapshots this is, e.g. to find its storage
+  size_t slot = 0;
+  size_t step_count = 0;
+  size_t neighbour_list_rebuilds = 0;
+  // Steps in the batch, the host time taken to submit them, and the device
+  // kernel time collected during the batch if profiling
+  size_t batch_steps = 0;
+  double submit_ms = 0;
+  double kernel_ms = 0;
+  std::vector<kernel_stats> kernels;
+};
+
+/* Steps a GravSim on a background thread in batches, and copies the bodies
+ * into a snapshot after every batch. The renderer draws the latest snapshot
+ * whenever it wants, so a slow simulation doesn't slow down the frame rate
+ * and a fast one isn't held back by it.
+ *
+ * The simulation itself is only used by one thread at a time: with_sim()
+ * runs code on the caller's thread between two batches, which only waits
+ * for the background thread to finish submitting the current batch. */
+template <typename num_t>
+class SimThread {
+  using clock = std::chrono::high_resolution_clock;
+
+ public:
+  // Upper limit of the steps per batch chosen with a batch budget
+  static constexpr size_t MAX_STEPS_PER_BATCH = 1024;
+
+  // Snapshots in the triple buffer
+  static constexpr size_t N_SNAPSHOTS = 3;
+
+ private:
+  GravSim<num_t> m_sim;
+  sycl::queue m_q;
+  size_t m_n_bodies;
+  TripleBuffer<sim_snapshot<num_t>> m_snapshots;
+  // Whether the snapshots are in host USM allocated here
+  bool m_owns_storage;
+
+  // Guards the simulation and everything below
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  bool m_running = false;
+  bool m_snapshot_requested = true;
+  bool m_stopping = false;
+  size_t m_steps_per_batch = 1;
+  // Batch time to scale m_steps_per_batch to, 0 keeps it fixed
+  double m_batch_budget_ms = 0;
+  std::exception_ptr m_error = nullptr;
+
+  std::thread m_thread;
+
+  void run() {
+    while (true) {
+      std::vector<sycl::event> copies;
+      size_t batch_steps;
+      clock::time_point tstart;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] {
+          return m_stopping || m_running || m_snapshot_requested;
+        });
+        if (m_stopping) {
+          return;
+        }
+        batch_steps = m_running ? m_steps_per_batch : 0;
+        m_snapshot_requested = false;
+
+        auto& snapshot = m_snapshots.back();
+        try {
+          tstart = clock::now();
+          m_sim.step(batch_steps);
+          auto tsubmit = clock::now();
+
+          snapshot.step_count = m_sim.step_count();
+          snapshot.neighbour_list_rebuilds = m_sim.neighbour_list_rebuilds();
+          snapshot.batch_steps = batch_steps;
+          snapshot.submit_ms =
+              std::chrono::duration<double, std::milli>(tsubmit - tstart)
+                  .count();
+          auto& profiler = m_sim.profiler();
+          if (profiler.enabled()) {
+            profiler.collect();
+            snapshot.kernel_ms = profiler.take_busy_ms();
+            snapshot.kernels = profiler.stats();
+          } else {
+            snapshot.kernel_ms = 0;
+            snapshot.kernels.clear();
+          }
+
+          copies = {m_sim.template copyTo<1>(snapshot.pos),
+                    m_sim.template copyTo<0>(snapshot.vel)};
+        } catch (...) {
+          m_error = std::current_exception();
+          m_running = false;
+          continue;
+        }
+      }
+
+      // The copies wait for the batch, without holding up with_sim()
+      try {
+        sycl::event::wait_and_throw(copies);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = std::current_exception();
+        m_running = false;
+        continue;
+      }
+      m_snapshots.publish();
+
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_batch_budget_ms > 0 && batch_steps > 0) {
+        // Grow by at most 2x a batch so a single fast one can't overshoot
+        double ms =
+            std::chrono::duration<double, std::milli>(clock::now() - tstart)
+                .count();
+        double scale = std::min(2.0, m_batch_budget_ms / std::max(ms, 1e-3));
+        m_steps_per_batch =
+            std::clamp(size_t(double(m_steps_per_batch) * scale), size_t(1),
+                       MAX_STEPS_PER_BATCH);
+      }
+    }
+  }
+
+ public:
+  /* Snapshot i is copied to storage[i], the positions followed by the
+   * velocities, if given. It could be mapped GL memory, which the renderer
+   * must only reuse once it took over another snapshot, and which must
+   * outlive the thread. Otherwise the snapshots are allocated in host USM. */
+  explicit SimThread(GravSim<num_t> sim,
+                     std::array<vec3<num_t>*, N_SNAPSHOTS> storage = {})
+      : m_sim(std::move(sim)),
+        m_q(m_sim.get_queue()),
+        m_n_bodies(m_sim.n_bodies()),
+        m_owns_storage(storage[0] == nullptr) {
+    auto& snapshots = m_snapshots.slots();
+    for (size_t i = 0; i < N_SNAPSHOTS; i++) {
+      snapshots[i].slot = i;
+      if (m_owns_storage) {
+        snapshots[i].pos = sycl::malloc_host<vec3<num_t>>(m_n_bodies, m_q);
+        snapshots[i].vel = sycl::malloc_host<vec3<num_t>>(m_n_bodies, m_q);
+      } else {
+        snapshots[i].pos = storage[i];
+        snapshots[i].vel = storage[i] + m_n_bodies;
+      }
+    }
+    // The first snapshot shows the initial state
+    m_thread = std::thread([this]() { run(); });
+  }
+
+  SimThread(const SimThread&) = delete;
+  SimThread& operator=(const SimThread&) = delete;
+
+  // Stops after the current batch
+  ~SimThread() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+
+    m_sim.sync_queue();
+    if (m_owns_storage) {
+      for (auto& snapshot : m_snapshots.slots()) {
+        sycl::free(snapshot.pos, m_q);
+        sycl::free(snapshot.vel, m_q);
+      }
+    }
+  }
+
+  /* Runs func(sim) between two batches and returns its result. Rethrows
+   * an error raised by a previous batch, which pauses the simulation. */
+  template <typename Func>
+  auto with_sim(Func&& func) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_error) {
+      std::rethrow_exception(std::exchange(m_error, nullptr));
+    }
+    return func(m_sim);
+  }
+
+  // Takes a snapshot even while paused, e.g. after stepping in with_sim()
+  void request_snapshot() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_snapshot_requested = true;
+    }
+    m_cv.notify_all();
+  }
+
+  // Whether batches are stepped continuously
+  void set_running(bool running) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_running = running;
+    }
+    m_cv.notify_all();
+  }
+
+  // Steps a fixed number of steps per batch
+  void set_steps_per_batch(size_t n_steps) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_steps_per_batch = std::clamp(n_steps, size_t(1), MAX_STEPS_PER_BATCH);
+    m_batch_budget_ms = 0;
+  }
+
+  // Scales the steps per batch so that every batch takes about `budget_ms`
+  void set_batch_budget(double budget_ms) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_batch_budget_ms = budget_ms;
+  }
+
+  // The steps of the batches run at the moment
+  size_t steps_per_batch() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_steps_per_batch;
+  }
+
+  /* Takes over the latest snapshot for the calling thread, which must be
+   * the only one reading them, and returns whether it is new. The snapshot
+   * stays valid until the next call. */
+  bool update_snapshot() { return m_snapshots.update(); }
+  // Whether update_snapshot() would take over a new snapshot, e.g. to wait
+  // until the current one may be written again first
+  bool has_new_snapshot() const { return m_snapshots.fresh(); }
+  const sim_snapshot<num_t>& snapshot() { return m_snapshots.front(); }
+
+  size_t n_bodies() const { return m_n_bodies; }
+  sycl::queue get_queue() const { return m_q; }
+};
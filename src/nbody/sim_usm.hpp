@@ -0,0 +1,402 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    NBody simulation backend on device USM allocations.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "sim.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// Template to generate unique kernel name types, instantiated once per
+// integrator
+template <typename T, size_t Z, integrator_t Integrator>
+class usm_kernel {};
+
+/* Direct summation NBody simulation with the same public interface as
+ * GravSim, but with body data in sycl::malloc_device allocations instead of
+ * buffers. Steps are submitted to an in-order queue and chained through the
+ * event of the previous step, so no accessors are created and the runtime
+ * doesn't need to track buffer dependencies, which keeps the host cost of a
+ * step low when N is small. Only the direct sum solver with the vec3 layout
+ * and the Euler and RK4 integrators are supported. */
+template <typename num_t>
+class GravSimUSM {
+  sycl::queue m_q;
+
+  // Ping-pong device allocations of (velocity, position), index m_read holds
+  // the current state
+  vec3<num_t>* m_vel[2] = {nullptr, nullptr};
+  vec3<num_t>* m_pos[2] = {nullptr, nullptr};
+  size_t m_read = 0;
+
+  // Charges used only in Coulomb simulation
+  num_t* m_charges = nullptr;
+
+  // Event of the most recently submitted command
+  sycl::event m_last;
+
+  // Host copy of the positions handed out by with_mapped
+  std::vector<vec3<num_t>> m_host_pos;
+
+  // The number of bodies partaking in the simulation
+  size_t m_n_bodies;
+
+  // The current time of the simulation
+  num_t m_time = 0;
+
+  force_t m_force = force_t::GRAVITY;
+  integrator_t m_integrator = integrator_t::EULER;
+  kernel_t m_kernel = kernel_t::NAIVE;
+  size_t m_tile_size;
+
+  // Force parameters
+  struct {
+    num_t G = 1e-5;
+    num_t damping = 1e-5;
+  } m_grav_params;
+
+  struct {
+    num_t eps = 1;
+    num_t sigma = 1e-3;
+  } m_lj_params;
+
+  // Base constructor, does not initialize simulation values
+  GravSimUSM(size_t n_bodies)
+      : m_q(sycl::default_selector_v, except_handler,
+            sycl::property::queue::in_order{}),
+        m_n_bodies(n_bodies) {
+    if (std::is_same_v<num_t, double> && !supports_doubles(m_q.get_device())) {
+      throw std::runtime_error("The device doesn't support doubles!");
+    }
+    for (size_t i = 0; i < 2; i++) {
+      m_vel[i] = sycl::malloc_device<vec3<num_t>>(n_bodies, m_q);
+      m_pos[i] = sycl::malloc_device<vec3<num_t>>(n_bodies, m_q);
+    }
+    set_tile_size(256);
+  }
+
+  // Copies initial velocities and positions from the host
+  void upload(const std::vector<vec3<num_t>>& vel,
+              const std::vector<vec3<num_t>>& pos) {
+    m_q.memcpy(m_vel[m_read], vel.data(), m_n_bodies * sizeof(vec3<num_t>));
+    m_last = m_q.memcpy(m_pos[m_read], pos.data(),
+                        m_n_bodies * sizeof(vec3<num_t>));
+    // The host vectors go out of scope after construction
+    m_last.wait();
+  }
+
+ public:
+  // Initialize the simulation with a cylinder body distribution, sampled on
+  // the device. The same seed gives the same bodies as GravSim.
+  GravSimUSM(size_t n_bodies, distrib_cylinder<num_t> params,
+             uint64_t seed = random_seed())
+      : GravSimUSM(n_bodies) {
+    m_last = submit_sample_distrib(m_q, params, seed, 0, n_bodies,
+                                   m_vel[m_read], m_pos[m_read]);
+  }
+
+  // Initialize the simulation with a sphere body distribution, sampled on
+  // the device
+  GravSimUSM(size_t n_bodies, distrib_sphere<num_t> params,
+             uint64_t seed = random_seed())
+      : GravSimUSM(n_bodies) {
+    m_last = submit_sample_distrib(m_q, params, seed, 0, n_bodies,
+                                   m_vel[m_read], m_pos[m_read]);
+  }
+
+  GravSimUSM(size_t n_bodies, std::vector<particle_data<num_t>>&& particles)
+      : GravSimUSM(n_bodies) {
+    std::vector<vec3<num_t>> vel(n_bodies, vec3<num_t>(0));
+    std::vector<vec3<num_t>> pos(n_bodies);
+    std::vector<num_t> charges(n_bodies);
+    for (size_t i = 0; i < n_bodies; i++) {
+      pos[i] = particles[i].pos;
+      charges[i] = particles[i].charge;
+    }
+
+    m_charges = sycl::malloc_device<num_t>(n_bodies, m_q);
+    m_q.memcpy(m_charges, charges.data(), n_bodies * sizeof(num_t));
+    upload(vel, pos);
+  }
+
+  // The allocations are owned by this object and freed with it
+  GravSimUSM(const GravSimUSM&) = delete;
+  GravSimUSM& operator=(const GravSimUSM&) = delete;
+
+  ~GravSimUSM() {
+    // Kernels may still be using the allocations
+    m_q.wait();
+    for (size_t i = 0; i < 2; i++) {
+      sycl::free(m_vel[i], m_q);
+      sycl::free(m_pos[i], m_q);
+    }
+    if (m_charges) {
+      sycl::free(m_charges, m_q);
+    }
+  }
+
+  void step() {
+    size_t write = 1 - m_read;
+    auto vel = m_vel[m_read];
+    auto pos = m_pos[m_read];
+    auto wvel = m_vel[write];
+    auto wpos = m_pos[write];
+
+    m_last = m_q.submit([&](sycl::handler& cgh) {
+      // Redundant on an in-order queue, but keeps the chain explicit should
+      // the step ever be submitted elsewhere
+      cgh.depends_on(m_last);
+
+      switch (m_force) {
+        case force_t::GRAVITY: {
+          gravity_force<num_t> force{m_grav_params.G, m_grav_params.damping};
+          submit_force_kernel<0>(cgh, force, unit_weights<num_t>{}, vel, pos,
+                                 wvel, wpos);
+        } break;
+        case force_t::LENNARD_JONES: {
+          lennard_jones_force<num_t> force{num_t(24) * m_lj_params.eps *
+                                           m_lj_params.sigma};
+          submit_force_kernel<1>(cgh, force, unit_weights<num_t>{}, vel, pos,
+                                 wvel, wpos);
+        } break;
+        case force_t::COULOMB: {
+          if (!m_charges) {
+            throw std::runtime_error("Coulomb charges weren't initialized!");
+          }
+
+          const num_t* charges_ptr = m_charges;
+          const auto charges = [=](size_t i) { return charges_ptr[i]; };
+          submit_force_kernel<2>(cgh, coulomb_force<num_t>{}, charges, vel,
+                                 pos, wvel, wpos);
+        } break;
+      }
+    });
+
+    m_read = write;
+    m_time += GravSim<num_t>::STEP_SIZE;
+  }
+
+  // Enqueues `n_steps` steps back to back without host synchronisation
+  void step(size_t n_steps) {
+    for (size_t i = 0; i < n_steps; i++) {
+      step();
+    }
+  }
+
+  void sync_queue() { m_q.wait(); }
+
+  // The queue the simulation runs on, e.g. to allocate host USM for copyTo
+  sycl::queue get_queue() const { return m_q; }
+
+  void set_force_type(force_t force) { m_force = force; }
+
+  // The symplectic integrators need passes over buffers between the force
+  // evaluations, which only GravSim implements
+  void set_integrator(integrator_t integrator) {
+    if (integrator != integrator_t::EULER && integrator != integrator_t::RK4) {
+      throw std::runtime_error(
+          "The USM backend only supports Euler and RK4 integration!");
+    }
+    m_integrator = integrator;
+  }
+
+  void set_kernel(kernel_t kernel) {
+    if (kernel == kernel_t::SYMMETRIC) {
+      throw std::runtime_error(
+          "The USM backend doesn't support the symmetric kernel!");
+    }
+    m_kernel = kernel;
+  }
+
+  // Set the tile size of the tiled kernel, clamped to the device limit
+  void set_tile_size(size_t tile_size) {
+    auto max_size =
+        m_q.get_device().get_info<sycl::info::device::max_work_group_size>();
+    m_tile_size = std::max<size_t>(1, std::min(tile_size, max_size));
+  }
+
+  size_t get_tile_size() const { return m_tile_size; }
+
+  void set_layout(layout_t layout) {
+    if (layout != layout_t::VEC3) {
+      throw std::runtime_error("The USM backend only supports vec3 layout!");
+    }
+  }
+
+  void set_double_accumulation(bool double_accum) {
+    if (double_accum) {
+      throw std::runtime_error(
+          "The USM backend doesn't support double precision accumulation!");
+    }
+  }
+
+  void set_specialise_forces(bool specialise) {
+    if (specialise) {
+      throw std::runtime_error(
+          "The USM backend doesn't support specialised force parameters!");
+    }
+  }
+
+  void set_solver(solver_t solver) {
+    if (solver != solver_t::DIRECT) {
+      throw std::runtime_error(
+          "The USM backend only supports the direct sum solver!");
+    }
+  }
+
+  // The number of pairwise interactions evaluated by a single step
+  size_t interactions_per_step() const {
+    size_t evals = m_integrator == integrator_t::RK4 ? 4 : 1;
+    return evals * m_n_bodies * m_n_bodies;
+  }
+
+  // Floating point operations of the interactions of a single step
+  size_t flops_per_step() const {
+    size_t flops = 0;
+    switch (m_force) {
+      case force_t::GRAVITY:
+        flops = gravity_force<num_t>::FLOPS;
+        break;
+      case force_t::LENNARD_JONES:
+        flops = lennard_jones_force<num_t>::FLOPS;
+        break;
+      case force_t::COULOMB:
+        flops = coulomb_force<num_t>::FLOPS;
+        break;
+    }
+    return flops * interactions_per_step();
+  }
+
+  // Set gravity damping
+  void set_grav_damping(num_t damping) { m_grav_params.damping = damping; }
+
+  // Set gravitational constant
+  void set_grav_G(num_t G) { m_grav_params.G = G; }
+
+  // Set Lennard-Jones potential well depth
+  void set_lj_eps(num_t eps) { m_lj_params.eps = eps; }
+
+  // Set Lennard-Jones zero-potential distance
+  void set_lj_sigma(num_t sigma) { m_lj_params.sigma = sigma; }
+
+  // Calls the provided function with a host copy of the body data
+  template <typename Func, size_t VarId>
+  void with_mapped(read_bufs_t<VarId>, Func&& func) {
+    m_host_pos.resize(m_n_bodies);
+    auto src = VarId == 0 ? m_vel[m_read] : m_pos[m_read];
+    m_last = m_q.memcpy(m_host_pos.data(), src,
+                        m_n_bodies * sizeof(vec3<num_t>));
+    m_last.wait();
+    func(m_host_pos.data());
+  }
+
+  // Copy body data into the dest pointer (host or device)
+  template <size_t VarId>
+  sycl::event copyTo(void* dest) {
+    auto src = VarId == 0 ? m_vel[m_read] : m_pos[m_read];
+    m_last = m_q.memcpy(dest, src, m_n_bodies * sizeof(vec3<num_t>));
+    return m_last;
+  }
+
+ private:
+  // Launches the selected kernel variant for the given force model.
+  // `weights(i)` returns the mass or charge of body i.
+  template <size_t ForceId, typename Force, typename Weights>
+  void submit_force_kernel(sycl::handler& cgh, Force force, Weights weights,
+                           const vec3<num_t>* vel, const vec3<num_t>* pos,
+                           vec3<num_t>* wvel, vec3<num_t>* wpos) {
+    if (m_integrator == integrator_t::RK4) {
+      submit_force_kernel<integrator_t::RK4, ForceId>(cgh, force, weights, vel,
+                                                      pos, wvel, wpos);
+    } else {
+      submit_force_kernel<integrator_t::EULER, ForceId>(
+          cgh, force, weights, vel, pos, wvel, wpos);
+    }
+  }
+
+  template <integrator_t Integrator, size_t ForceId, typename Force,
+            typename Weights>
+  void submit_force_kernel(sycl::handler& cgh, Force force, Weights weights,
+                           const vec3<num_t>* vel, const vec3<num_t>* pos,
+                           vec3<num_t>* wvel, vec3<num_t>* wpos) {
+    // Dummy variable copies to avoid capturing `this` in kernel lambda
+    num_t t = m_time;
+    size_t n_bodies = m_n_bodies;
+
+    if (m_kernel == kernel_t::NAIVE) {
+      cgh.parallel_for<usm_kernel<num_t, ForceId, Integrator>>(
+          sycl::range<1>(n_bodies), [=](sycl::item<1> item) {
+            auto id = item.get_linear_id();
+
+            const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                   num_t) -> vec3<num_t> {
+              vec3<num_t> acc(0);
+              for (size_t i = 0; i < n_bodies; i++) {
+                acc += force.pair(pos[i] - x, weights(i), i == id);
+              }
+              return force.total(acc, weights(id));
+            };
+
+            vec3<num_t> wvelTmp = vel[id];
+            vec3<num_t> wposTmp = pos[id];
+            GravSim<num_t>::template integrate<Integrator>(accel, wvelTmp,
+                                                           wposTmp, t);
+            wvel[id] = wvelTmp;
+            wpos[id] = wposTmp;
+          });
+      return;
+    }
+
+    // Tiled variant, see GravSim::submit_tiled
+    size_t tile_size = m_tile_size;
+    size_t n_groups = (n_bodies + tile_size - 1) / tile_size;
+    split_bodies<num_t, const vec3<num_t>*, Weights> bodies{pos, weights};
+    BodyTiles<num_t> tiles(cgh, tile_size);
+
+    cgh.parallel_for<usm_kernel<num_t, 3 + ForceId, Integrator>>(
+        sycl::nd_range<1>(n_groups * tile_size, tile_size),
+        [=](sycl::nd_item<1> item) {
+          auto id = item.get_global_id(0);
+          auto body = id < n_bodies ? id : 0;
+
+          const auto accel = [&](vec3<num_t>, vec3<num_t> x,
+                                 num_t) -> vec3<num_t> {
+            auto acc = tiles.template pair_sum<num_t>(item, force, bodies,
+                                                      n_bodies, x, id);
+            return force.total(acc, weights(body));
+          };
+
+          vec3<num_t> wvelTmp = vel[body];
+          vec3<num_t> wposTmp = pos[body];
+          GravSim<num_t>::template integrate<Integrator>(accel, wvelTmp,
+                                                         wposTmp, t);
+
+          if (id < n_bodies) {
+            wvel[id] = wvelTmp;
+            wpos[id] = wposTmp;
+          }
+        });
+  }
+};
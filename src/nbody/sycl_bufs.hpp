@@ -81,6 +81,10 @@ class SyclBufs {
   SyclBufs(size_t N)
       : m_bufs(make_tuple_multi<size_t, sycl::buffer<Ts, 1>...>(N)) {}
 
+  // Returns the selected buffer itself
+  template <size_t Id>
+  AUTO_FUNC(get_buf(), std::get<Id>(m_bufs))
+
   // Returns a tuple of read accessors for the selected buffers
   template <size_t... Ids>
   AUTO_FUNC(
@@ -0,0 +1,280 @@
+/***************************************************************************
+ *
+ *  Copyright (C) Codeplay Software Limited
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  Description:
+ *    Background writer of NBody position snapshots.
+ *
+ **************************************************************************/
+
+#pragma once
+
+#include "forces.hpp"
+
+#include <sycl/sycl.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Trajectory file header, followed by the frames
+struct trajectory_header {
+  char magic[8];
+  uint32_t version;
+  // Whether positions are stored as 16-bit fractions of the frame's bounds
+  uint32_t quantised;
+  uint64_t n_bodies;
+};
+
+/* Every frame starts with this header. Unquantised frames follow it with
+ * three 32-bit floats per body. Quantised frames follow it with three
+ * 16-bit integers q per body, which decode to lo + q * scale per axis. */
+struct trajectory_frame_header {
+  uint64_t step;
+  double time;
+  float lo[3];
+  float scale[3];
+};
+
+constexpr char TRAJECTORY_MAGIC[8] = {'N', 'B', 'O', 'D', 'Y', 'T', 'R', 'J'};
+constexpr uint32_t TRAJECTORY_VERSION = 1;
+
+// What TrajectoryWriter::push does when all staging slots are in use
+enum class trajectory_full_t {
+  // Skip the frame, the simulation never waits
+  DROP,
+  // Wait for the writer thread to free a slot
+  BLOCK,
+};
+
+/* Streams position snapshots to a file without making the simulation wait
+ * for disk I/O. push() enqueues a copy of the positions into one of a ring
+ * of host USM slots on the simulation's queue and returns straight away.
+ * A writer thread waits for each copy, packs or quantises the positions and
+ * writes the frame, then hands the slot back. Frames pushed while every slot
+ * is in use are dropped or wait for a slot, and are counted either way. */
+template <typename num_t>
+class TrajectoryWriter {
+  struct frame {
+    size_t slot;
+    uint64_t step;
+    double time;
+    sycl::event copied;
+  };
+
+  sycl::queue m_q;
+  size_t m_n_bodies;
+  bool m_quantise;
+  trajectory_full_t m_full;
+  std::FILE* m_file;
+
+  std::vector<vec3<num_t>*> m_slots;
+
+  // Slots free for the next push, and frames waiting for the writer thread
+  std::vector<size_t> m_free;
+  std::deque<frame> m_pending;
+  bool m_closing = false;
+  std::exception_ptr m_error = nullptr;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+
+  std::atomic<size_t> m_written{0};
+  std::atomic<size_t> m_dropped{0};
+  std::atomic<size_t> m_waited{0};
+
+  std::thread m_thread;
+
+  void write_bytes(const void* data, size_t size) {
+    if (std::fwrite(data, 1, size, m_file) != size) {
+      throw std::runtime_error("Failed to write trajectory frame!");
+    }
+  }
+
+  // Writes the frame in `slot` using `buffer` as packing space
+  void write_frame(const frame& f, std::vector<char>& buffer) {
+    const vec3<num_t>* pos = m_slots[f.slot];
+    trajectory_frame_header header{f.step, f.time, {0, 0, 0}, {0, 0, 0}};
+
+    if (m_quantise) {
+      vec3<num_t> lo = m_n_bodies ? pos[0] : vec3<num_t>(0);
+      vec3<num_t> hi = lo;
+      for (size_t i = 1; i < m_n_bodies; i++) {
+        lo = sycl::fmin(lo, pos[i]);
+        hi = sycl::fmax(hi, pos[i]);
+      }
+      vec3<num_t> scale = (hi - lo) / num_t(65535);
+      for (int d = 0; d < 3; d++) {
+        header.lo[d] = float(lo[d]);
+        header.scale[d] = float(scale[d]);
+      }
+
+      buffer.resize(m_n_bodies * 3 * sizeof(uint16_t));
+      auto* out = reinterpret_cast<uint16_t*>(buffer.data());
+      for (size_t i = 0; i < m_n_bodies; i++) {
+        for (int d = 0; d < 3; d++) {
+          num_t q = scale[d] > 0 ? (pos[i][d] - lo[d]) / scale[d] : num_t(0);
+          out[3 * i + d] = uint16_t(std::min(q + num_t(.5), num_t(65535)));
+        }
+      }
+    } else {
+      // Packed without the padding of vec3
+      buffer.resize(m_n_bodies * 3 * sizeof(float));
+      auto* out = reinterpret_cast<float*>(buffer.data());
+      for (size_t i = 0; i < m_n_bodies; i++) {
+        for (int d = 0; d < 3; d++) {
+          out[3 * i + d] = float(pos[i][d]);
+        }
+      }
+    }
+
+    write_bytes(&header, sizeof(header));
+    write_bytes(buffer.data(), buffer.size());
+  }
+
+  void writer_loop() {
+    std::vector<char> buffer;
+    while (true) {
+      frame f;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&] { return m_closing || !m_pending.empty(); });
+        if (m_pending.empty()) {
+          return;
+        }
+        f = m_pending.front();
+        m_pending.pop_front();
+      }
+
+      try {
+        f.copied.wait();
+        write_frame(f, buffer);
+        m_written++;
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = std::current_exception();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_free.push_back(f.slot);
+      }
+      m_cv.notify_all();
+    }
+  }
+
+ public:
+  // Writes the positions of `n_bodies` bodies copied on `q` to `path`,
+  // staging up to `n_slots` frames at a time
+  TrajectoryWriter(sycl::queue q, const std::string& path, size_t n_bodies,
+                   bool quantise = false, size_t n_slots = 4,
+                   trajectory_full_t full = trajectory_full_t::DROP)
+      : m_q(q), m_n_bodies(n_bodies), m_quantise(quantise), m_full(full) {
+    m_file = std::fopen(path.c_str(), "wb");
+    if (!m_file) {
+      throw std::runtime_error("Can't open " + path + "!");
+    }
+
+    trajectory_header header{};
+    std::memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.quantised = quantise;
+    header.n_bodies = n_bodies;
+    if (std::fwrite(&header, sizeof(header), 1, m_file) != 1) {
+      std::fclose(m_file);
+      throw std::runtime_error("Can't write " + path + "!");
+    }
+
+    for (size_t s = 0; s < std::max<size_t>(n_slots, 1); s++) {
+      m_slots.push_back(sycl::malloc_host<vec3<num_t>>(n_bodies, m_q));
+      m_free.push_back(s);
+    }
+    m_thread = std::thread([this]() { writer_loop(); });
+  }
+
+  TrajectoryWriter(const TrajectoryWriter&) = delete;
+  TrajectoryWriter& operator=(const TrajectoryWriter&) = delete;
+
+  // Writes the frames still pending before closing the file
+  ~TrajectoryWriter() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_closing = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+
+    std::fclose(m_file);
+    for (auto* slot : m_slots) {
+      sycl::free(slot, m_q);
+    }
+  }
+
+  // Blocks until every frame pushed so far is written, rethrows their errors
+  void flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [&] { return m_free.size() == m_slots.size(); });
+    if (m_error) {
+      std::rethrow_exception(m_error);
+    }
+  }
+
+  /* Enqueues a snapshot of the positions of `sim`, which must run on the
+   * queue given to the constructor, and returns whether it was taken.
+   * Rethrows the error of a frame that failed to write. */
+  template <typename Sim>
+  bool push(Sim& sim, uint64_t step, double time) {
+    size_t slot;
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      if (m_error) {
+        std::rethrow_exception(m_error);
+      }
+      if (m_free.empty()) {
+        if (m_full == trajectory_full_t::DROP) {
+          m_dropped++;
+          return false;
+        }
+        m_waited++;
+        m_cv.wait(lock, [&] { return !m_free.empty(); });
+      }
+      slot = m_free.back();
+      m_free.pop_back();
+    }
+
+    // Ordered after the steps enqueued so far like any other command
+    sycl::event copied = sim.template copyTo<1>(m_slots[slot]);
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_pending.push_back({slot, step, time, copied});
+    }
+    m_cv.notify_all();
+    return true;
+  }
+
+  // Frames on disk, frames skipped because all slots were in use, and
+  // frames that had to wait for a slot
+  size_t frames_written() const { return m_written; }
+  size_t frames_dropped() const { return m_dropped; }
+  size_t frames_waited() const { return m_waited; }
+};